@@ -8,6 +8,7 @@
 
 #include <iostream>
 #include <cstring>
+#include <chrono>
 #include <glm/vec3.hpp>
 
 #include "easylogging++.h"
@@ -24,6 +25,9 @@ const char * elConf =
 
 static int width = 512, height = 512;
 
+// Render every image in a pass of its own instead of all in one
+static bool separate = false;
+
 int main(int argc, char *argv[])
 {
     // Configure logging system
@@ -43,6 +47,10 @@ int main(int argc, char *argv[])
         {
             height = std::stoi(argv[++i]);
         }
+        else if (std::strcmp(argv[i], "-separate") == 0)
+        {
+            separate = true;
+        }
     }
 
     LOG(INFO) << "Ray tracer started, Width: " << width << ", Height: " << height;
@@ -74,22 +82,42 @@ int main(int argc, char *argv[])
     scene.AddSurface(&sphere2);
     scene.AddSurface(&sphere3);
 
-    Image image(width, height);
+    Image mask(width, height), noAA(width, height), uniform(width, height), random(width, height);
     RayTracer rTracer(scene, width, height);
 
-    // render image with no anti-aliasing
-    rTracer.Render(image);
-    image.OutputPPM("no-aa.ppm");
+    auto start = std::chrono::steady_clock::now();
+    if (separate)
+    {
+        rTracer.BWRender(mask);
+
+        // render image with no anti-aliasing
+        rTracer.Render(noAA);
 
-    // Render with 8x8 sample rate uniform samling
-    rTracer.SetSampleRate(4);
-    rTracer.Render(image);
-    image.OutputPPM("8x8uniformsampling.ppm");
+        // Render with 8x8 sample rate uniform samling
+        rTracer.SetSampleRate(4);
+        rTracer.Render(uniform);
+
+        // Render 8x8 anti-aliase random sampling.
+        rTracer.SamplingType = RayTracer::PostProcess::RandomSampling;
+        rTracer.Render(random);
+    }
+    else
+    {
+        // All four from one pass, the mask and no-aa come out of the
+        // uniform samples
+        rTracer.SetSampleRate(4);
+        rTracer.RenderTargets({ { RayTracer::CoverageMask, &mask },
+                                { RayTracer::NoAntiAliasing, &noAA },
+                                { RayTracer::UniformAntiAliasing, &uniform },
+                                { RayTracer::RandomAntiAliasing, &random } });
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << "Rendered 4 images in " << elapsed.count() << " ms";
 
-    // Render 8x8 anti-aliase random sampling.
-    rTracer.SamplingType = RayTracer::PostProcess::RandomSampling;
-    rTracer.Render(image);
-    image.OutputPPM("8x8randomsampling.ppm");
+    mask.OutputPPM("bw.ppm");
+    noAA.OutputPPM("no-aa.ppm");
+    uniform.OutputPPM("8x8uniformsampling.ppm");
+    random.OutputPPM("8x8randomsampling.ppm");
 
     exit(EXIT_SUCCESS);
 }
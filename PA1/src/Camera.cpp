@@ -71,6 +71,52 @@ Ray Camera::GetRay(int x, int y, float offsetx, float offsety) const
 	return Ray(Position, dir);
 }
 
+void Camera::GetRays(RayBuffer& buffer) const
+{
+    const int count = buffer.Size();
+
+    // Everything that doesn't change per ray is worked out once per batch
+    const float su = (r - l) / ScreenWidth;
+    const float sv = (t - b) / ScreenHeight;
+    const glm::vec3 toPlane = -Forward * d;
+
+    const float* __restrict px = buffer.OffsetX.data();
+    const float* __restrict py = buffer.OffsetY.data();
+    const int* __restrict pixelx = buffer.PixelX.data();
+    const int* __restrict pixely = buffer.PixelY.data();
+    float* __restrict ox = buffer.OriginX.data();
+    float* __restrict oy = buffer.OriginY.data();
+    float* __restrict oz = buffer.OriginZ.data();
+    float* __restrict dx = buffer.DirectionX.data();
+    float* __restrict dy = buffer.DirectionY.data();
+    float* __restrict dz = buffer.DirectionZ.data();
+    float* __restrict ix = buffer.InverseX.data();
+    float* __restrict iy = buffer.InverseY.data();
+    float* __restrict iz = buffer.InverseZ.data();
+
+    for (int i = 0; i < count; ++i)
+    {
+        float u = l + su * (pixelx[i] + Utility::clamp(0.0f, px[i], 1.0f));
+        float v = b + sv * (pixely[i] + Utility::clamp(0.0f, py[i], 1.0f));
+
+        // Same as GetRay, up is negated to put y = 0 at the top
+        float x = Right.x * u - Up.x * v + toPlane.x;
+        float y = Right.y * u - Up.y * v + toPlane.y;
+        float z = Right.z * u - Up.z * v + toPlane.z;
+        float invLength = 1.0f / std::sqrt(x * x + y * y + z * z);
+
+        dx[i] = x * invLength;
+        dy[i] = y * invLength;
+        dz[i] = z * invLength;
+        ix[i] = 1.0f / dx[i];
+        iy[i] = 1.0f / dy[i];
+        iz[i] = 1.0f / dz[i];
+        ox[i] = Position.x;
+        oy[i] = Position.y;
+        oz[i] = Position.z;
+    }
+}
+
 void Camera::SetScreenSize(int width, int height)
 {
     ScreenWidth = width;
@@ -16,6 +16,7 @@
 #include <glm/geometric.hpp>
 
 #include "Ray.h"
+#include "RayBuffer.h"
 #include "Utility.h"
 
 class Camera
@@ -37,6 +38,9 @@ public:
   // Make a ray from the x, y coordinate passed
   Ray GetRay(int x, int y) const;
   Ray GetRay(int x, int y, float offsetx, float offsety) const;
+
+  // Batch GetRay, makes every ray in the buffer from its pixel and offset
+  void GetRays(RayBuffer& buffer) const;
 public:
   glm::vec3 Position;
   glm::vec3 Target;
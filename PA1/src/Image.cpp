@@ -28,6 +28,12 @@ void Image::SetBuffer(std::vector<glm::vec3> const & image)
     ImageBuffer = image;
 }
 
+void Image::SetBuffer(std::vector<glm::vec3>&& image)
+{
+    LOG(INFO) << "Image buffer moved in, buffer size is: " << image.size();
+    ImageBuffer = std::move(image);
+}
+
 void Image::SetFilename(std::string name)
 {
     LOG(INFO) << "Image name set to: " << name;
@@ -119,6 +125,18 @@ void Image::OutputPPM(std::string file) const
 
     LOG(INFO) << "Outputting to ppm file: " << file;
 
+    // Convert the whole buffer first so it goes out in a single write. The
+    // image is written linear, GammaEncode is left to the caller.
+    std::vector<uint8_t> bytes(ImageBuffer.size() * 3);
+    for (size_t i = 0; i < ImageBuffer.size(); ++i)
+    {
+        Pixel p = ColorToPixel(ImageBuffer[i]);
+
+        bytes[i * 3 + 0] = GetPixelR(p);
+        bytes[i * 3 + 1] = GetPixelG(p);
+        bytes[i * 3 + 2] = GetPixelB(p);
+    }
+
     // Open stream and write ppm headers, color bit's set to 255 per channel
     std::ofstream ofs(file, std::ios::out | std::ios::binary);
 
@@ -128,15 +146,7 @@ void Image::OutputPPM(std::string file) const
         << Height   << '\n'
         << 255      << '\n';
 
-    for (glm::vec3 color : ImageBuffer)
-    {
-        glm::vec3 encoded = GammaEncode(color);
-        Pixel p = ColorToPixel(color);
-
-        ofs << GetPixelR(p)
-            << GetPixelG(p)
-            << GetPixelB(p);
-    }
+    ofs.write((const char*)bytes.data(), bytes.size());
 
     ofs.close();
 
@@ -66,6 +66,7 @@ public:
     ~Image();
 
     void SetBuffer(std::vector<glm::vec3> const & image);
+    void SetBuffer(std::vector<glm::vec3>&& image);
     void SetFilename(std::string name = "default.ppm");
 
     static glm::vec3 GammaEncode (const glm::vec3& color);
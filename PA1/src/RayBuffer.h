@@ -0,0 +1,93 @@
+/******************************************************************************
+ *
+ *  filename: RayBuffer.h
+ *  author  : Do Won Cha
+ *  content : Structure of arrays block of camera rays, filled by
+ *            Camera::GetRays and consumed by the samplers.
+ *
+ *****************************************************************************/
+
+#pragma once
+#ifndef _RAY_RAY_BUFFER_
+#define _RAY_RAY_BUFFER_
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "Ray.h"
+
+// Allocator that lines every array up on a cache line so SIMD loads never split
+template<typename T>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t count)
+  {
+    void* memory = nullptr;
+    if (posix_memalign(&memory, 64, count * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(memory);
+  }
+
+  void deallocate(T* memory, size_t) { free(memory); }
+
+  template<typename U>
+  bool operator==(const AlignedAllocator<U>&) const { return true; }
+  template<typename U>
+  bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloats;
+
+/**
+ *  One entry per pixel sample. Fill in PixelX, PixelY and the offsets in any
+ *  pattern, Camera::GetRays fills in the rest.
+ */
+class RayBuffer
+{
+public:
+  RayBuffer() : Count(0) { }
+
+  // Grows the arrays if needed, never shrinks them
+  void Resize(int count)
+  {
+    Count = count;
+    if ((int)OriginX.size() >= count)
+      return;
+
+    for (AlignedFloats* array : { &OriginX, &OriginY, &OriginZ,
+                                  &DirectionX, &DirectionY, &DirectionZ,
+                                  &InverseX, &InverseY, &InverseZ,
+                                  &OffsetX, &OffsetY })
+      array->resize(count);
+
+    PixelX.resize(count);
+    PixelY.resize(count);
+  }
+
+  int Size() const { return Count; }
+
+  Ray GetRay(int i) const
+  {
+    return Ray(glm::vec3(OriginX[i], OriginY[i], OriginZ[i]),
+               glm::vec3(DirectionX[i], DirectionY[i], DirectionZ[i]));
+  }
+public:
+  AlignedFloats OriginX, OriginY, OriginZ;
+  AlignedFloats DirectionX, DirectionY, DirectionZ;
+  AlignedFloats InverseX, InverseY, InverseZ;     // 1 / Direction, for slab tests
+  AlignedFloats OffsetX, OffsetY;                 // Offset inside the pixel
+  std::vector<int> PixelX, PixelY;
+private:
+  int Count;
+};
+
+#endif // _RAY_RAY_BUFFER_
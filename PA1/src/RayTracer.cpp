@@ -31,20 +31,30 @@ void RayTracer::BWRender(Image& image) const
 
     // Buffer to hold color values, reserve size of the window.
     std::vector<glm::vec3> buffer;
+    buffer.reserve(ScreenWidth * ScreenHeight);
 
-    HitData data;
-    // Most expensive thing ive ever seen.
+    // Centre rays a row at a time, made the way RenderTargets makes them
+    SampleRays.Resize(ScreenWidth);
     for (int y = 0; y < ScreenHeight; ++y)
     {
         for (int x = 0; x < ScreenWidth; ++x)
         {
-            Ray ray = MainCamera.GetRay(x, y);
-            glm::vec3 result = BWTrace(ray);
+            SampleRays.PixelX[x] = x;
+            SampleRays.PixelY[x] = y;
+            SampleRays.OffsetX[x] = 0.5f;
+            SampleRays.OffsetY[x] = 0.5f;
+        }
+        MainCamera.GetRays(SampleRays);
+
+        for (int x = 0; x < ScreenWidth; ++x)
+        {
+            glm::vec3 result = BWTrace(SampleRays.GetRay(x));
             buffer.push_back(result);
         }
     }
 
-    image.SetBuffer(buffer);
+    // Hand the buffer over, copying it would double the peak memory
+    image.SetBuffer(std::move(buffer));
 }
 
 void RayTracer::Render(Image& image) const
@@ -53,19 +63,144 @@ void RayTracer::Render(Image& image) const
 
     // Buffer to hold color values, reserve size of the window.
     std::vector<glm::vec3> buffer;
+    buffer.reserve(ScreenWidth * ScreenHeight);
 
     // Most expensive thing ive ever seen.
     for (int y = 0; y < ScreenHeight; ++y)
     {
         for (int x = 0; x < ScreenWidth; ++x)
         {
-            Ray ray = MainCamera.GetRay(x, y);
 			      glm::vec3 result = Sampler(x, y);
             buffer.push_back(result);
         }
     }
 
-    image.SetBuffer(buffer);
+    // Hand the buffer over, copying it would double the peak memory
+    image.SetBuffer(std::move(buffer));
+}
+
+void RayTracer::RenderTargets(const std::vector<RenderTarget>& targets) const
+{
+    LOG(INFO) << "Rendering " << targets.size() << " targets in one pass";
+
+    bool wanted[4] = { false, false, false, false };
+    for (const RenderTarget& target : targets)
+        wanted[target.Output] = true;
+
+    const int s2 = SampleRate * SampleRate;
+    const float coef = 1.0f / SampleRate;
+
+    // Where each kind of sample sits in the rays of a pixel. The uniform grid
+    // starts with the no anti-aliasing sample and may have the centre one.
+    const int uniformCount = wanted[UniformAntiAliasing] ? s2 : 0;
+    const int randomFirst = uniformCount;
+    const int randomCount = wanted[RandomAntiAliasing] ? s2 : 0;
+    int count = randomFirst + randomCount;
+
+    int corner = -1, centre = -1;
+    if (wanted[NoAntiAliasing])
+        corner = uniformCount > 0 ? 0 : count++;
+    if (wanted[CoverageMask])
+    {
+        int half = SampleRate / 2;
+        bool onGrid = uniformCount > 0 && SampleRate % 2 == 0 && half * coef == 0.5f;
+        centre = onGrid ? half * SampleRate + half : count++;
+    }
+
+    // RandomSampler starts a new generator for every pixel, so every pixel
+    // gets the same offsets and they only need drawing once
+    std::vector<float> randomX(randomCount), randomY(randomCount);
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    for (int i = 0; i < randomCount; ++i)
+    {
+        randomX[i] = distribution(generator);
+        randomY[i] = distribution(generator);
+    }
+
+    std::vector<glm::vec3> buffers[4];
+    for (int output = 0; output < 4; ++output)
+    {
+        if (wanted[output])
+            buffers[output].reserve(ScreenWidth * ScreenHeight);
+    }
+
+    SampleRays.Resize(count);
+    std::vector<glm::vec3> colors(count);
+    std::vector<char> hits(count);
+
+    for (int y = 0; y < ScreenHeight; ++y)
+    {
+        for (int x = 0; x < ScreenWidth; ++x)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                SampleRays.PixelX[i] = x;
+                SampleRays.PixelY[i] = y;
+            }
+            for (int i = 0; i < uniformCount; ++i)
+            {
+                SampleRays.OffsetX[i] = (i / SampleRate) * coef;
+                SampleRays.OffsetY[i] = (i % SampleRate) * coef;
+            }
+            for (int i = 0; i < randomCount; ++i)
+            {
+                SampleRays.OffsetX[randomFirst + i] = randomX[i];
+                SampleRays.OffsetY[randomFirst + i] = randomY[i];
+            }
+            if (corner >= uniformCount)
+                SampleRays.OffsetX[corner] = SampleRays.OffsetY[corner] = 0.0f;
+            if (centre >= uniformCount)
+                SampleRays.OffsetX[centre] = SampleRays.OffsetY[centre] = 0.5f;
+            MainCamera.GetRays(SampleRays);
+
+            // Every ray is intersected once, the mask only needs the hit
+            for (int i = 0; i < count; ++i)
+            {
+                Ray ray = SampleRays.GetRay(i);
+                HitData data;
+                mScene.IntersectSurfaces(ray, 10000.0f, data);
+                hits[i] = data.HitSurface != nullptr;
+
+                bool maskOnly = i == centre && centre >= uniformCount;
+                if (!maskOnly)
+                    colors[i] = TraceHit(ray, data, 0);
+            }
+
+            // Summed in the order and with the scale of the samplers
+            if (uniformCount > 0)
+            {
+                glm::vec3 result;
+                for (int i = 0; i < uniformCount; ++i)
+                    result += colors[i];
+                buffers[UniformAntiAliasing].push_back(result * coef * coef);
+            }
+            if (randomCount > 0)
+            {
+                glm::vec3 result;
+                for (int i = 0; i < randomCount; ++i)
+                    result += colors[randomFirst + i];
+                buffers[RandomAntiAliasing].push_back(result / (float)s2);
+            }
+            if (corner >= 0)
+                buffers[NoAntiAliasing].push_back(colors[corner]);
+            if (centre >= 0)
+                buffers[CoverageMask].push_back(glm::vec3(hits[centre] ? 1.0f : 0.0f));
+        }
+    }
+
+    // The last target of every kind takes the buffer, any others a copy
+    for (size_t t = 0; t < targets.size(); ++t)
+    {
+        bool last = true;
+        for (size_t later = t + 1; later < targets.size(); ++later)
+            last = last && targets[later].Output != targets[t].Output;
+
+        if (last)
+            targets[t].Target->SetBuffer(std::move(buffers[targets[t].Output]));
+        else
+            targets[t].Target->SetBuffer(buffers[targets[t].Output]);
+    }
 }
 
 std::vector<Pixel> RayTracer::Render() const
@@ -74,6 +209,7 @@ std::vector<Pixel> RayTracer::Render() const
 
     // generate buffer for window size
     std::vector<Pixel> buffer;
+    buffer.reserve(ScreenWidth * ScreenHeight);
 
     for (int y = 0; y < ScreenHeight; ++y)
     {
@@ -103,8 +239,13 @@ glm::vec3 RayTracer::Trace(const Ray& ray, int depth) const
         return glm::vec3(0.0f);        //If max depth has been reached return 0
 
     HitData data;
-    bool result = mScene.IntersectSurfaces(ray, 10000.0f, data);
+    mScene.IntersectSurfaces(ray, 10000.0f, data);
 
+    return TraceHit(ray, data, depth);
+}
+
+glm::vec3 RayTracer::TraceHit(const Ray& ray, const HitData& data, int depth) const
+{
     if (data.HitSurface == nullptr)
         return glm::vec3(0.0f);
 
@@ -200,15 +341,23 @@ glm::vec3 RayTracer::Sampler(int x, int y) const
 
 glm::vec3 RayTracer::UniformSampler(int x, int y) const
 {
-    glm::vec3 result;
+    // Lay out the sample grid, then make every ray of the pixel at once
+    int s2 = SampleRate * SampleRate;
     float coef = 1.0f / SampleRate;
-    for (float offsetx = 0.0f; offsetx < 1.0f; offsetx += coef)
+    SampleRays.Resize(s2);
+    for (int i = 0; i < s2; ++i)
     {
-        for (float offsety = 0.0f; offsety < 1.0f; offsety += coef)
-        {
-            Ray ray = MainCamera.GetRay(x, y, offsetx, offsety);
-            result += Trace(ray, 0);
-        }
+        SampleRays.PixelX[i] = x;
+        SampleRays.PixelY[i] = y;
+        SampleRays.OffsetX[i] = (i / SampleRate) * coef;
+        SampleRays.OffsetY[i] = (i % SampleRate) * coef;
+    }
+    MainCamera.GetRays(SampleRays);
+
+    glm::vec3 result;
+    for (int i = 0; i < s2; ++i)
+    {
+        result += Trace(SampleRays.GetRay(i), 0);
     }
     return result * coef * coef;
 }
@@ -218,15 +367,21 @@ glm::vec3 RayTracer::RandomSampler(int x, int y) const
     std::default_random_engine generator;
     std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
 
-    glm::vec3 result;
     int s2 = SampleRate * SampleRate;
+    SampleRays.Resize(s2);
     for (int i = 0; i < s2; ++i)
     {
-        float offsetx = distribution(generator);
-        float offsety = distribution(generator);
+        SampleRays.PixelX[i] = x;
+        SampleRays.PixelY[i] = y;
+        SampleRays.OffsetX[i] = distribution(generator);
+        SampleRays.OffsetY[i] = distribution(generator);
+    }
+    MainCamera.GetRays(SampleRays);
 
-        Ray ray = MainCamera.GetRay(x, y, offsetx, offsety);
-        result += Trace(ray, 0);
+    glm::vec3 result;
+    for (int i = 0; i < s2; ++i)
+    {
+        result += Trace(SampleRays.GetRay(i), 0);
     }
 
     result = (result / (float) s2);
@@ -44,6 +44,9 @@ public:
 
     glm::vec3 Trace(const Ray& ray, int depth) const;
 
+    // Rest of Trace once the ray was intersected with the scene
+    glm::vec3 TraceHit(const Ray& ray, const HitData& data, int depth) const;
+
     glm::vec3 Shade(const Ray& ray, const HitData& Data) const;
 
     // Check whether shadow ray is blocked by any surface
@@ -67,6 +70,29 @@ public:
 
     void SetSampleRate(int s);
 
+    // Images RenderTargets can fill in from a single pass over the pixels
+    enum RenderOutput
+    {
+        CoverageMask,           // BWRender
+        NoAntiAliasing,         // Render at sample rate 1
+        UniformAntiAliasing,    // Render with uniform sampling at the sample rate
+        RandomAntiAliasing      // Render with random sampling at the sample rate
+    };
+
+    struct RenderTarget
+    {
+        RenderOutput Output;
+        Image* Target;
+    };
+
+    /**
+     *  Render every target in one pass over the pixels, each comes out the
+     *  same as its own render would. Rays the targets share are traced once,
+     *  no anti-aliasing is the first sample of the uniform grid and the mask
+     *  takes the hit of the grid sample on the pixel centre when there is one.
+     */
+    void RenderTargets(const std::vector<RenderTarget>& targets) const;
+
     glm::vec3 Sampler(int x, int y) const;
 
     // Uses evenly spaced ray's in the pixel. Uses sample * sample.
@@ -90,6 +116,9 @@ private:
 
     int SampleRate;
     int MaxTraceDepth;
+
+    // Camera rays of the pixel being sampled
+    mutable RayBuffer SampleRays;
 };
 
 #endif /* end of include guard: _RAY_TRACER_ */
@@ -34,10 +34,11 @@ bool Scene::IntersectSurfaces(const Ray& ray, float tMax, HitData& data) const
     // float tMin = tMax;
     for (Surface* s : Surfaces)
     {
-        if (s->Intersect(ray, data.t, data.tMax, data.tPoint))
+        // The limit goes first, t used to be passed in its place before it
+        // was ever set and the hits depended on what was on the stack
+        if (s->Intersect(ray, data.tMax, data.t, data.tPoint))
         {
             data.Point      = data.tPoint;
-            data.t          = data.tMax;
             data.HitSurface = s;
             data.Normal     = data.HitSurface->GetNormal(data.Point);
             surfacehit = true;
@@ -30,6 +30,7 @@ public:
     Surface* HitSurface;
 public:
     HitData() :
+        t(0.0f),
         tMax(100000.0f),
         HitSurface(nullptr)
 { }
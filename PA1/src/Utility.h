@@ -15,7 +15,8 @@
 #elif __unix__ || __APPLE__
 #endif
 
-//#include <cstdint>
+#include <cstdint>
+#include <cmath>
 #include <algorithm>
 
 namespace Utility
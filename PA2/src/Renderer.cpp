@@ -557,9 +557,20 @@ void Renderer::OutputToPPM(const std::string& filename) const
 
     LOG(INFO) << "Outputting to ppm file: " << filename;
 
+    // Encode the whole frame first so it goes out in a single write
+    const std::vector<float>& thresholds = GammaThresholds();
+    std::vector<uint8_t> bytes(bufferSize * 3);
+    for (size_t i = 0; i < bufferSize; ++i)
+    {
+        glm::vec3 pinned = PinToUnit(ColorBuffer[i]);
+
+        bytes[i * 3 + 0] = EncodeChannel(thresholds, pinned.x);
+        bytes[i * 3 + 1] = EncodeChannel(thresholds, pinned.y);
+        bytes[i * 3 + 2] = EncodeChannel(thresholds, pinned.z);
+    }
+
     // Open stream and write ppm headers, color bit's set to 255 per channel
-    //std::ofstream ofs(filename, std::ios::out | std::ios::binary);
-    std::ofstream ofs(filename, std::ios::out);
+    std::ofstream ofs(filename, std::ios::out | std::ios::binary);
 
     // write headers
     ofs << "P6"			  << '\n'
@@ -567,15 +578,7 @@ void Renderer::OutputToPPM(const std::string& filename) const
         << ScreenHeight   << '\n'
         << 255			  << '\n';
 
-    for (auto color : ColorBuffer)
-    {
-        glm::vec3 e = GammaEncode(color);
-        Pixel p = ColorToPixel(e);
-
-        ofs << Pixel_R(p)
-            << Pixel_G(p)
-            << Pixel_B(p);
-    }
+    ofs.write((const char*)bytes.data(), bytes.size());
 
     LOG(INFO) << "Finished outputting to " << filename << ", closing file.";
 }
@@ -597,6 +600,54 @@ glm::vec3 Renderer::GammaEncode(const glm::vec3& color) const
     return out;
 }
 
+const std::vector<float>& Renderer::GammaThresholds()
+{
+    // thresholds[b] is the smallest pinned value GammaEncode then ColorToPixel
+    // turns into b, found by bisecting over the float bit patterns so the
+    // lookup matches the pow version exactly. pow only runs while building it.
+    static const std::vector<float> thresholds = [] {
+        auto encode = [](float x) {
+            return (int)(std::min(1.0f, std::pow(x, 1.0f / 2.2f)) * 255.9999f);
+        };
+
+        std::vector<float> values(256, 0.0f);
+        for (int b = 1; b < 256; ++b)
+        {
+            float low = 0.0f, high = 1.0f;
+            uint32_t lowBits, highBits;
+            std::memcpy(&lowBits, &low, sizeof(float));
+            std::memcpy(&highBits, &high, sizeof(float));
+
+            while (highBits - lowBits > 1)
+            {
+                uint32_t middleBits = lowBits + (highBits - lowBits) / 2;
+                float middle;
+                std::memcpy(&middle, &middleBits, sizeof(float));
+                if (encode(middle) >= b)
+                    highBits = middleBits;
+                else
+                    lowBits = middleBits;
+            }
+            std::memcpy(&values[b], &highBits, sizeof(float));
+        }
+        return values;
+    }();
+
+    return thresholds;
+}
+
+uint8_t Renderer::EncodeChannel(const std::vector<float>& thresholds, float value)
+{
+    // Binary search over the 256 thresholds
+    int b = 0;
+    for (int step = 128; step > 0; step >>= 1)
+    {
+        if (value >= thresholds[b + step])
+            b += step;
+    }
+    return (uint8_t)b;
+}
+
 glm::vec3 Renderer::PinToUnit(const glm::vec3& color) const
 {
   float x = std::max(0.0f, std::min(1.0f, color.x));
@@ -17,6 +17,8 @@
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
@@ -140,6 +142,11 @@ private:
 
 	glm::vec3 GammaEncode(const glm::vec3& color) const;
 
+	// Smallest pinned value that encodes to each output byte, and the lookup
+	// that replaces GammaEncode and ColorToPixel when writing images
+	static const std::vector<float>& GammaThresholds();
+	static uint8_t EncodeChannel(const std::vector<float>& thresholds, float value);
+
 	Pixel ColorToPixel(const glm::vec3& color) const;
 
 	glm::vec3 PinToUnit(const glm::vec3& color) const;
@@ -0,0 +1,203 @@
+/**
+ *  filename : async_frames.cpp
+ *  author   : Do Won Cha
+ *  content  : Drives RayTracer::RenderAsync the way an interactive client
+ *             would. Supersedes a frame, moves the camera and the light
+ *             and draws new shadow maps under frames in flight, and checks
+ *             every finished frame against the blocking progressive render.
+ */
+
+#include <Eigen/Core>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "easylogging++.h"
+#include "scene.hpp"
+#include "scene_io.hpp"
+#include "ray_tracer.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+using namespace Eigen;
+using namespace raytracer;
+
+namespace
+{
+
+void PrintUsage()
+{
+  printf("usage: async_frames [options]\n"
+         "  --scene <file>        scene description (../assets/spheres.scene)\n"
+         "  --width <n>           image width (512)\n"
+         "  --height <n>          image height (512)\n"
+         "  --samples <n>         random samples per pixel (64)\n"
+         "  --threads <n>         worker threads, 0 for one per core (0)\n"
+         "  --shadow-maps <n>     cube shadow map size, 0 to trace every shadow ray (256)\n"
+         "  --interrupt <ms>      how long a frame runs before it is interrupted (100)\n");
+}
+
+// Pixels where the colors differ at all, alpha aside
+long long CountDiffering(const std::vector<Vector4f>& a, const std::vector<Vector4f>& b)
+{
+  long long differing = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+    differing += (a[i] - b[i]).head<3>().cwiseAbs().maxCoeff() > 0.0f ? 1 : 0;
+  return differing;
+}
+
+// Tiles whose futures say they were dropped
+int CountDropped(const AsyncFrame& frame)
+{
+  int dropped = 0;
+  for (size_t t = 0; t < frame.tiles().size(); ++t)
+    dropped += frame.tile((int)t).get() ? 0 : 1;
+  return dropped;
+}
+
+/**
+ *  Let a frame finish and compare it with what Render adds up for the same
+ *  settings. Only the frame buffer of the tracer is touched, the frame has
+ *  its own image.
+ */
+bool CheckFrame(const char* what, RayTracer& tracer, const AsyncFrame& frame)
+{
+  using namespace std::chrono;
+
+  steady_clock::time_point start = steady_clock::now();
+  bool complete = frame.wait();
+  float waitMs = duration<float, std::milli>(steady_clock::now() - start).count();
+  if (!complete)
+  {
+    printf("%s: frame was cancelled, %d of %d tiles\n", what, frame.tiles_done(), (int)frame.tiles().size());
+    return false;
+  }
+
+  tracer.reset_accumulation();
+  while (!tracer.converged())
+    tracer.Render();
+
+  long long differing = CountDiffering(frame.image(), tracer.frame_buffer());
+  printf("%s: done %.1f ms later, %lld pixels differ from Render\n", what, waitMs, differing);
+  return differing == 0;
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace std::chrono;
+
+  std::string sceneFile = "../assets/spheres.scene";
+  int width = 512, height = 512, samples = 64, threads = 0, shadowMaps = 256, interruptMs = 100;
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc;
+    if (std::strcmp(argv[i], "--scene") == 0 && hasValue)
+      sceneFile = argv[++i];
+    else if (std::strcmp(argv[i], "--width") == 0 && hasValue)
+      width = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--height") == 0 && hasValue)
+      height = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--samples") == 0 && hasValue)
+      samples = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--threads") == 0 && hasValue)
+      threads = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--shadow-maps") == 0 && hasValue)
+      shadowMaps = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--interrupt") == 0 && hasValue)
+      interruptMs = std::atoi(argv[++i]);
+    else
+    {
+      PrintUsage();
+      return std::strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (width <= 0 || height <= 0 || samples <= 0 || interruptMs < 0)
+  {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  // Logs go to file only, stdout is for the results
+  el::Configurations conf;
+  conf.setToDefault();
+  conf.set(el::Level::Global, el::ConfigurationType::ToStandardOutput, "false");
+  el::Loggers::reconfigureLogger("default", conf);
+
+  // Kept here as well, the light is edited between frames
+  std::shared_ptr<Scene> scene(LoadScene(sceneFile));
+  if (!scene)
+  {
+    fprintf(stderr, "Failed to load scene %s\n", sceneFile.c_str());
+    return EXIT_FAILURE;
+  }
+  scene->build();
+
+  RayTracer tracer(&argc, argv);
+  tracer.initialize(scene);
+  tracer.resize(width, height);
+  tracer.set_thread_count(threads);
+  tracer.set_sampling_type(PostProcess::RandomSampling);
+  tracer.set_samples_per_pixel(samples);
+  tracer.set_shadow_maps(shadowMaps);
+
+  const std::chrono::milliseconds interrupt(interruptMs);
+  std::atomic<int> landed(0);
+  auto tileDone = [&landed](const AsyncFrame&, int) { ++landed; };
+  bool ok = true;
+
+  // A new frame supersedes the one in flight, which drains on its own
+  std::shared_ptr<AsyncFrame> first = tracer.RenderAsync(tileDone);
+  std::this_thread::sleep_for(interrupt);
+  std::shared_ptr<AsyncFrame> second = tracer.RenderAsync(tileDone);
+  first->wait();
+  printf("superseded: %d of %d tiles, %d dropped\n", first->tiles_done(), (int)first->tiles().size(),
+         CountDropped(*first));
+  ok = CheckFrame("superseding frame", tracer, *second) && ok;
+
+  // Moving the camera cancels the frame and waits for it to let go
+  std::shared_ptr<AsyncFrame> moving = tracer.RenderAsync(tileDone);
+  std::this_thread::sleep_for(interrupt);
+  steady_clock::time_point start = steady_clock::now();
+  tracer.set_camera_position(tracer.camera().position() + Vector3f(0.5f, 0.0f, 0.0f));
+  float moveMs = duration<float, std::milli>(steady_clock::now() - start).count();
+  printf("camera moved in %.1f ms, %d of %d tiles dropped\n", moveMs, CountDropped(*moving),
+         (int)moving->tiles().size());
+  ok = CheckFrame("after the camera move", tracer, *tracer.RenderAsync(tileDone)) && ok;
+
+  // Scene edits wait for the frames in flight, the next frame draws the
+  // shadow maps again
+  std::shared_ptr<AsyncFrame> lit = tracer.RenderAsync(tileDone);
+  std::this_thread::sleep_for(interrupt);
+  tracer.cancel_async();
+  if (scene->light_tree().size() > 0)
+  {
+    Light* light = scene->light_tree().light(0);
+    light->set_position(light->position() + Vector3f(1.0f, 0.0f, 0.0f));
+    scene->build();
+  }
+  printf("light moved, %d of %d tiles dropped\n", CountDropped(*lit), (int)lit->tiles().size());
+  ok = CheckFrame("after the light move", tracer, *tracer.RenderAsync(tileDone)) && ok;
+
+  // New shadow maps wait for the superseded frame, it reads the old ones
+  if (shadowMaps > 0)
+  {
+    std::shared_ptr<AsyncFrame> mapped = tracer.RenderAsync(tileDone);
+    std::this_thread::sleep_for(interrupt);
+    tracer.set_shadow_maps(shadowMaps / 2);
+    std::shared_ptr<AsyncFrame> remapped = tracer.RenderAsync(tileDone);
+    printf("shadow maps drawn again, %d of %d tiles dropped\n", CountDropped(*mapped), (int)mapped->tiles().size());
+    ok = CheckFrame("with the new shadow maps", tracer, *remapped) && ok;
+  }
+
+  printf("%d tiles landed in all\n", landed.load());
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,231 @@
+/**
+ *  filename : fixed_scene.cpp
+ *  author   : Do Won Cha
+ *  content  : The scene of spheres.cpp fixed at compile time. Renders it
+ *             with the StaticScene tracer and with RayTracer on the same
+ *             scene built at runtime, and compares time and image.
+ */
+
+#include <Eigen/Core>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "easylogging++.h"
+#include "ray_buffer.hpp"
+#include "ray_tracer.h"
+#include "static_scene.hpp"
+#include "thread_pool.hpp"
+#include "image_output.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+using namespace Eigen;
+using namespace raytracer;
+
+namespace
+{
+
+// Materials, surfaces and light of spheres.cpp and assets/spheres.scene
+struct Red : StaticMaterial
+{
+  static constexpr const char* name() { return "red"; }
+  static constexpr StaticVector ambient() { return { 0.2f, 0.0f, 0.0f }; }
+  static constexpr StaticVector diffuse() { return { 1.0f, 0.0f, 0.0f }; }
+};
+
+struct Green : StaticMaterial
+{
+  static constexpr const char* name() { return "green"; }
+  static constexpr StaticVector ambient() { return { 0.0f, 0.2f, 0.0f }; }
+  static constexpr StaticVector diffuse() { return { 0.0f, 0.5f, 0.0f }; }
+  static constexpr StaticVector specular() { return { 0.5f, 0.5f, 0.5f }; }
+  static constexpr float specular_power() { return 32.0f; }
+};
+
+struct Blue : StaticMaterial
+{
+  static constexpr const char* name() { return "blue"; }
+  static constexpr StaticVector ambient() { return { 0.0f, 0.0f, 0.2f }; }
+  static constexpr StaticVector diffuse() { return { 0.0f, 0.0f, 1.0f }; }
+  static constexpr float reflectivity() { return 32.0f; }
+};
+
+struct White : StaticMaterial
+{
+  static constexpr const char* name() { return "white"; }
+  static constexpr StaticVector ambient() { return { 0.2f, 0.2f, 0.2f }; }
+  static constexpr StaticVector diffuse() { return { 1.0f, 1.0f, 1.0f }; }
+  static constexpr float reflectivity() { return 0.5f; }
+};
+
+struct RedSphere : StaticSphere<RedSphere, Red>
+{
+  static constexpr StaticVector center() { return { -4.0f, 0.0f, -7.0f }; }
+  static constexpr float radius() { return 1.0f; }
+};
+
+struct GreenSphere : StaticSphere<GreenSphere, Green>
+{
+  static constexpr StaticVector center() { return { 0.0f, 0.0f, -7.0f }; }
+  static constexpr float radius() { return 2.0f; }
+};
+
+struct BlueSphere : StaticSphere<BlueSphere, Blue>
+{
+  static constexpr StaticVector center() { return { 4.0f, 0.0f, -7.0f }; }
+  static constexpr float radius() { return 1.0f; }
+};
+
+struct Floor : StaticPlane<Floor, White>
+{
+  static constexpr StaticVector point() { return { 0.0f, -2.0f, 0.0f }; }
+  static constexpr StaticVector normal() { return { 0.0f, 1.0f, 0.0f }; }
+};
+
+struct KeyLight : StaticLight<KeyLight>
+{
+  static constexpr StaticVector position() { return { -4.0f, 4.0f, -3.0f }; }
+};
+
+typedef StaticScene<TypeList<RedSphere, GreenSphere, BlueSphere, Floor>, TypeList<KeyLight>> Spheres;
+
+// Rows a worker takes at a time, as many rays as a tile of RayTracer
+const int kStripRows = 2;
+
+void PrintUsage()
+{
+  printf("usage: fixed_scene [options]\n"
+         "  --width <n>           image width (512)\n"
+         "  --height <n>          image height (512)\n"
+         "  --samples <n>         random samples per pixel (16)\n"
+         "  --threads <n>         worker threads, 0 for one per core (0)\n"
+         "  --output <file>       write the fixed scene image here as well\n");
+}
+
+/**
+ *  Trace every sample of every pixel the way RayTracer does with random
+ *  sampling, same rays, same order of the sums, so the images match.
+ */
+void RenderFixed(const Camera& camera, int samples, ThreadPool* pool, std::vector<Vector4f>& image)
+{
+  const int width = camera.screen_width(), height = camera.screen_height();
+  image.assign((size_t)width * height, Vector4f::Zero());
+
+  ForEachStrip(height, kStripRows, pool, [&](int first, int last) {
+    RayBuffer rays;
+    std::vector<Vector3f> sums;
+    for (int y = first; y < last; ++y)
+    {
+      sums.assign(width, Vector3f::Zero());
+      for (int sample = 0; sample < samples; ++sample)
+      {
+        rays.resize(width);
+        for (int x = 0; x < width; ++x)
+        {
+          uint32_t seed = Utility::sample_seed(x, y, sample);
+          rays.pixel_x[x] = x;
+          rays.pixel_y[x] = y;
+          rays.sample[x] = sample;
+          rays.offset_x[x] = Utility::random_unit(seed, 0);
+          rays.offset_y[x] = Utility::random_unit(seed, 1);
+        }
+        camera.GenerateRays(rays);
+
+        for (int x = 0; x < width; ++x)
+          sums[x] += Spheres::Trace(rays.ray(x));
+      }
+
+      for (int x = 0; x < width; ++x)
+        image[(size_t)y * width + x] << sums[x] / (float)samples, 0.0f;
+    }
+  });
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace std::chrono;
+
+  int width = 512, height = 512, samples = 16, threads = 0;
+  std::string output;
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc;
+    if (std::strcmp(argv[i], "--width") == 0 && hasValue)
+      width = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--height") == 0 && hasValue)
+      height = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--samples") == 0 && hasValue)
+      samples = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--threads") == 0 && hasValue)
+      threads = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--output") == 0 && hasValue)
+      output = argv[++i];
+    else
+    {
+      PrintUsage();
+      return std::strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (width <= 0 || height <= 0 || samples <= 0)
+  {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  // The dynamic path, the same scene in containers behind virtual calls
+  std::shared_ptr<Scene> scene = Spheres::MakeScene();
+  RayTracer tracer(&argc, argv);
+  tracer.initialize(scene);
+  tracer.resize(width, height);
+  tracer.set_thread_count(threads);
+  tracer.set_sampling_type(PostProcess::RandomSampling);
+  tracer.set_samples_per_pixel(samples);
+
+  steady_clock::time_point start = steady_clock::now();
+  while (!tracer.converged())
+    tracer.Render();
+  float dynamicMs = duration<float, std::milli>(steady_clock::now() - start).count();
+
+  // The fixed scene on a pool of the same size
+  ThreadPool pool(threads);
+  std::vector<Vector4f> image;
+  start = steady_clock::now();
+  RenderFixed(tracer.camera(), samples, &pool, image);
+  float fixedMs = duration<float, std::milli>(steady_clock::now() - start).count();
+
+  // Colors only, RayTracer sums the material alpha as well
+  const std::vector<Vector4f>& reference = tracer.frame_buffer();
+  float maxError = 0.0f;
+  long long differing = 0;
+  for (size_t i = 0; i < image.size(); ++i)
+  {
+    float error = (image[i] - reference[i]).head<3>().cwiseAbs().maxCoeff();
+    maxError = (std::max)(maxError, error);
+    differing += error > 0.0f ? 1 : 0;
+  }
+
+  double rays = (double)width * height * samples;
+  printf("%dx%d, %d spp, %d primitives, %d light(s)\n", width, height, samples, Spheres::kPrimitives,
+         Spheres::kLights);
+  printf("dynamic: %.1f ms, %.2f Msamples/s\n", dynamicMs, rays / (dynamicMs * 1000.0));
+  printf("fixed:   %.1f ms, %.2f Msamples/s, %.2fx\n", fixedMs, rays / (fixedMs * 1000.0), dynamicMs / fixedMs);
+  printf("%lld pixels differ, by at most %g\n", differing, maxError);
+
+  if (!output.empty())
+  {
+    for (Vector4f& pixel : image)
+      pixel.w() = 1.0f;
+    if (!WriteImage(output, image, width, height, ImageOutputOptions()))
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
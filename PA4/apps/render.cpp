@@ -0,0 +1,971 @@
+/**
+ *  filename : render.cpp
+ *  author   : Do Won Cha
+ *  content  : Headless batch renderer. Renders a scene file straight to image
+ *             files, needs no display or GPU.
+ */
+
+#include <Eigen/Core>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <future>
+#include <memory>
+#include <csignal>
+#include <climits>
+#include <cstdlib>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "easylogging++.h"
+#include "scene.hpp"
+#include "scene_io.hpp"
+#include "ray_tracer.h"
+#include "image_output.h"
+#include "tiled_frame_buffer.hpp"
+#include "render_farm.h"
+#include "render_cache.h"
+#include "render_service.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+using namespace Eigen;
+using namespace raytracer;
+
+static void Usage(const char* program)
+{
+  printf("usage: %s [options]\n"
+         "  --scene <file>        scene description (../assets/spheres.scene)\n"
+         "  --output <file>       image to write, .ppm .png .qoi or .pfm (out.ppm)\n"
+         "                        with several frames each one gets a number\n"
+         "  --gamma <type>        linear or srgb encoding of 8 bit images (linear)\n"
+         "  --checkpoint <file>   save progress here and resume from it if it exists\n"
+         "  --checkpoint-every <s> seconds between checkpoints (60)\n"
+         "  --workers <n>         render on n local worker processes\n"
+         "  --serve <address>     coordinate workers connecting to unix:/path or host:port\n"
+         "  --worker <address>    work for the coordinator at address until it is done\n"
+         "  --daemon <address>    serve render requests on address until interrupted\n"
+         "  --cache <n>           scenes the daemon keeps loaded (8)\n"
+         "  --scene-root <dir>    the daemon only loads scenes under dir, needed on TCP\n"
+         "  --cache-dir <dir>     reuse frames and tiles rendered before, stored here,\n"
+         "                        whole frames only, not with --checkpoint\n"
+         "  --cache-size <mb>     most the cache directory holds (1024)\n"
+         "  --client <address>    have the daemon at address render instead\n"
+         "  --priority <class>    low, normal or high priority on the daemon (normal)\n"
+         "  --framebuffer <file>  render out of core into this memory mapped file and\n"
+         "                        stream the image out band by band, for huge images\n"
+         "  --width <n>           image width (512)\n"
+         "  --height <n>          image height (512)\n"
+         "  --sampler <type>      none, uniform or random (none)\n"
+         "  --rate <n>            anti-aliasing rate, rate * rate samples per pixel (1)\n"
+         "  --samples <n>         samples per pixel, overrides the rate\n"
+         "  --threads <n>         worker threads, 0 for one per core (0)\n"
+         "  --frames <n>          number of frames to render (1)\n"
+         "  --camera <x> <y> <z>  camera position (0 0 0)\n"
+         "  --views <set>         render several views from the camera in one job,\n"
+         "                        stereo[:<separation>], cube or turntable:<n>[:<distance>],\n"
+         "                        each image gets the name of its view\n"
+         "  --sequential          with --views, also render them one after the other\n"
+         "                        and report how much faster the single job was\n"
+         "  --light-samples <n>   lights shaded per hit, picked at random, 0 for all (0)\n"
+         "  --denoise             filter the image with the edge avoiding wavelet denoiser,\n"
+         "                        a few samples per pixel then go a long way, plain frame\n"
+         "                        loops only, not with the cache, checkpoints, farm or daemon\n"
+         "  --raster-primary      rasterize what the camera sees first instead of tracing\n"
+         "                        it, only shadow and reflection rays are traced\n"
+         "  --shadow-maps <n>     answer most shadow rays from n by n cube shadow maps\n"
+         "                        of every light, only those near shadow edges are traced\n"
+         "  --preview <n>         trace a quick preview at 1/n resolution, one sample per\n"
+         "                        pixel, and upscale it guided by depth and normals\n"
+         "  --camera-path <file>  render a frame per line of file, x y z of the camera\n"
+         "                        and optionally x y z it looks at\n"
+         "  --reproject <n>       along a camera path, start pixels from the frame before\n"
+         "                        where it saw the same surface and trace n fresh\n"
+         "                        samples there, all of them if those disagree\n"
+         "--framebuffer, --cache-dir, --checkpoint, --preview, --views and --camera-path\n"
+         "each render frames their own way, only one of them can be given\n",
+         program);
+}
+
+static std::string ReadFile(const std::string& filename)
+{
+  std::ifstream file(filename, std::ios::in | std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// Hash of the file contents, a checkpoint only fits the scene it was made with
+static uint64_t FileFingerprint(const std::string& filename)
+{
+  std::string contents = ReadFile(filename);
+
+  uint64_t fingerprint = 1469598103934665603ULL;
+  for (char c : contents)
+    fingerprint = (fingerprint ^ (uint8_t)c) * 1099511628211ULL;
+  return fingerprint;
+}
+
+// out.ppm, 3 -> out0003.ppm
+static std::string FrameFilename(const std::string& output, int frame, int frames)
+{
+  if (frames <= 1)
+    return output;
+
+  char number[16];
+  snprintf(number, sizeof(number), "%04d", frame);
+
+  size_t dot = output.rfind('.');
+  if (dot == std::string::npos)
+    return output + number;
+  return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// out.ppm and left give out-left.ppm
+static std::string ViewFilename(const std::string& output, const std::string& view)
+{
+  size_t dot = output.rfind('.');
+  if (dot == std::string::npos)
+    return output + "-" + view;
+  return output.substr(0, dot) + "-" + view + output.substr(dot);
+}
+
+/**
+ *  Cameras of a --views set, all at position and looking down -z unless
+ *  the set turns them. Stereo pairs sit separation apart, 0.2 by default.
+ *  Cube map faces look down every axis, the camera already has the 90
+ *  degree field of view they need. Turntable views circle the point
+ *  distance ahead of the camera, 7 by default.
+ */
+static bool MakeViews(const std::string& set, const Vector3f& position, int width, int height,
+                      std::vector<RenderView>& views, std::vector<std::string>& names)
+{
+  std::string type = set.substr(0, set.find(':'));
+  std::vector<float> values;
+  for (size_t colon = set.find(':'); colon != std::string::npos; colon = set.find(':', colon + 1))
+    values.push_back(std::stof(set.substr(colon + 1)));
+
+  Camera camera(width, height);
+  camera.set_position(position);
+
+  if (type == "stereo" && values.size() <= 1)
+  {
+    float separation = values.empty() ? 0.2f : values[0];
+    const char* eyes[] = { "left", "right" };
+    for (int eye = 0; eye < 2; ++eye)
+    {
+      camera.set_position(position + Vector3f((eye - 0.5f) * separation, 0.0f, 0.0f));
+      views.push_back(RenderView(camera));
+      names.push_back(eyes[eye]);
+    }
+  }
+  else if (type == "cube" && values.empty())
+  {
+    const char* faces[] = { "px", "nx", "py", "ny", "pz", "nz" };
+    for (int face = 0; face < 6; ++face)
+    {
+      Vector3f axis = Vector3f::Zero();
+      axis(face / 2) = face % 2 ? -1.0f : 1.0f;
+
+      // Looking straight up or down, up can't be y
+      Vector3f up = face / 2 == 1 ? Vector3f(0.0f, 0.0f, -axis.y()) : Vector3f(0.0f, 1.0f, 0.0f);
+      camera.look_at(position + axis, up);
+      views.push_back(RenderView(camera));
+      names.push_back(faces[face]);
+    }
+  }
+  else if (type == "turntable" && (values.size() == 1 || values.size() == 2) && values[0] >= 1.0f)
+  {
+    int count = (int)values[0];
+    float distance = values.size() > 1 ? values[1] : 7.0f;
+    Vector3f center = position - Vector3f(0.0f, 0.0f, distance);
+    for (int i = 0; i < count; ++i)
+    {
+      float angle = 2.0f * (float)M_PI * i / count;
+      camera.set_position(center + distance * Vector3f(std::sin(angle), 0.0f, std::cos(angle)));
+      camera.look_at(center);
+      views.push_back(RenderView(camera));
+
+      char name[16];
+      snprintf(name, sizeof(name), "%03d", i);
+      names.push_back(name);
+    }
+  }
+  else
+    return false;
+
+  return true;
+}
+
+// Render a --views set as one job, and one view at a time when asked to compare
+static void RenderViewSet(RayTracer& tracer, std::vector<RenderView>& views, const std::vector<std::string>& names,
+                          bool sequential, const std::string& output, const ImageOutputOptions& imageOptions)
+{
+  tracer.reset_ray_stats();
+  FrameStats batch = tracer.RenderViews(views);
+  RayStats stats = tracer.ray_stats();
+  long long rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+
+  for (size_t v = 0; v < views.size(); ++v)
+  {
+    std::string filename = ViewFilename(output, names[v]);
+    if (!WriteImage(filename, views[v].image, views[v].camera.screen_width(),
+                    views[v].camera.screen_height(), imageOptions))
+    {
+      fprintf(stderr, "Failed to write %s\n", filename.c_str());
+      exit(EXIT_FAILURE);
+    }
+    printf("view %s -> %s\n", names[v].c_str(), filename.c_str());
+  }
+
+  printf("%d views in one job: %.1f ms, %lld rays, %.2f Mrays/s\n",
+         (int)views.size(), batch.elapsed_ms, rays, rays / (batch.elapsed_ms * 1000.0));
+
+  if (!sequential)
+    return;
+
+  // The same views as separate jobs, each one waits for the last tile of
+  // the one before
+  double sequentialMs = 0.0;
+  for (const RenderView& view : views)
+  {
+    std::vector<RenderView> single(1, RenderView(view.camera));
+    sequentialMs += tracer.RenderViews(single).elapsed_ms;
+  }
+
+  printf("%d views one at a time: %.1f ms, %.2f Mrays/s, the single job is %.2fx as fast\n",
+         (int)views.size(), sequentialMs, rays / (sequentialMs * 1000.0), sequentialMs / batch.elapsed_ms);
+}
+
+/**
+ *  A camera path has a line per frame, the x y z the camera is at and
+ *  optionally the x y z it looks at, down -z if not. # starts a comment.
+ */
+static bool LoadCameraPath(const std::string& filename, int width, int height, std::vector<Camera>& path)
+{
+  std::ifstream file(filename);
+  if (!file)
+    return false;
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream values(line);
+    Vector3f position, target;
+    if (!(values >> position.x() >> position.y() >> position.z()))
+    {
+      if (line.find_first_not_of(" \t\r") != std::string::npos)
+        return false;
+      continue;
+    }
+
+    Camera camera(width, height);
+    camera.set_position(position);
+    if (values >> target.x() >> target.y() >> target.z())
+      camera.look_at(target);
+    path.push_back(camera);
+  }
+  return !path.empty();
+}
+
+/**
+ *  Render a frame per camera of path on the one resident scene. Frame N is
+ *  encoded and written while frame N + 1 traces. With reproject the frames
+ *  after the first start from the one before and trace that many fresh
+ *  samples where it could stand in, 0 traces every pixel in full.
+ */
+static void RenderSequence(RayTracer& tracer, const std::vector<Camera>& path, int reproject,
+                           const std::string& output, const ImageOutputOptions& imageOptions)
+{
+  using namespace std::chrono;
+
+  const int frames = (int)path.size();
+  const int samples = tracer.samples_per_pixel();
+
+  // This frame and the one before, which is being written meanwhile
+  RenderView views[2];
+  std::future<double> writing;      // Milliseconds it took, negative if it failed
+  std::string writingName;
+  double totalTraceMs = 0.0, totalWriteMs = 0.0;
+  long long totalRays = 0;
+
+  // Failures come back here, exiting on the writer would tear the process
+  // down under the tracing workers
+  auto finishWrite = [&]() {
+    double ms = writing.valid() ? writing.get() : 0.0;
+    if (ms < 0.0)
+    {
+      fprintf(stderr, "Failed to write %s\n", writingName.c_str());
+      exit(EXIT_FAILURE);
+    }
+    return ms;
+  };
+
+  steady_clock::time_point sequenceStart = steady_clock::now();
+  for (int frame = 0; frame < frames; ++frame)
+  {
+    RenderView& view = views[frame % 2];
+    const RenderView& previous = views[(frame + 1) % 2];
+    view.camera = path[frame];
+
+    tracer.reset_ray_stats();
+    FrameStats stats = reproject > 0 && frame > 0 ? tracer.RenderReprojected(view, previous, reproject)
+                                                  : tracer.RenderReprojected(view, RenderView(), samples);
+    RayStats rays = tracer.ray_stats();
+    long long rayCount = rays.primary_rays + rays.secondary_rays + rays.shadow_rays;
+    totalTraceMs += stats.elapsed_ms;
+    totalRays += rayCount;
+
+    // The one before has to be out before its buffers are traced into again
+    totalWriteMs += finishWrite();
+
+    std::string filename = FrameFilename(output, frame, frames);
+    writingName = filename;
+    writing = std::async(std::launch::async, [&view, filename, &imageOptions] {
+      steady_clock::time_point start = steady_clock::now();
+      if (!WriteImage(filename, view.image, view.camera.screen_width(), view.camera.screen_height(), imageOptions))
+        return -1.0;
+      return duration<double, std::milli>(steady_clock::now() - start).count();
+    });
+
+    long long pixels = (long long)view.image.size();
+    printf("frame %d: %.1f ms, %lld rays, %.2f Mrays/s, %.1f%% reprojected, %.2f spp traced -> %s\n",
+           frame, stats.elapsed_ms, rayCount, rayCount / (stats.elapsed_ms * 1000.0),
+           100.0 * stats.reprojected / pixels, (double)stats.samples / pixels, filename.c_str());
+  }
+  totalWriteMs += finishWrite();
+  double wallMs = duration<double, std::milli>(steady_clock::now() - sequenceStart).count();
+
+  printf("total: %.1f ms, %.1f ms/frame, trace %.1f ms/frame, %.2f Mrays/s, write %.1f ms/frame behind the tracing\n",
+         wallMs, wallMs / frames, totalTraceMs / frames, totalRays / (totalTraceMs * 1000.0), totalWriteMs / frames);
+}
+
+/**
+ *  Coordinate a render farm. Workers started here run this same program
+ *  with --worker, others can join from anywhere that reaches the address.
+ */
+static void RenderOnFarm(const std::string& sceneFile, const RenderSettings& settings,
+                         std::string address, int localWorkers, int threads,
+                         const std::string& output, int frames, const ImageOutputOptions& imageOptions)
+{
+  if (address.empty())
+    address = "unix:/tmp/raytracer-farm-" + std::to_string(getpid()) + ".sock";
+
+  RenderCoordinator coordinator(ReadFile(sceneFile), settings);
+  if (!coordinator.listen(address))
+  {
+    fprintf(stderr, "Failed to listen on %s\n", address.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // Threads are split between the local workers
+  std::string workerThreads = std::to_string(threads > 0 ? (std::max)(1, threads / (std::max)(1, localWorkers)) : 0);
+  std::vector<pid_t> children;
+  for (int i = 0; i < localWorkers; ++i)
+  {
+    pid_t child = fork();
+    if (child == 0)
+    {
+      execl("/proc/self/exe", "render", "--worker", address.c_str(), "--threads", workerThreads.c_str(), (char*)nullptr);
+      _exit(127);
+    }
+    if (child > 0)
+      children.push_back(child);
+  }
+
+  printf("coordinating on %s, %d local worker(s)\n", address.c_str(), (int)children.size());
+
+  using namespace std::chrono;
+  double totalMs = 0.0;
+  std::vector<Vector4f> frame;
+  for (int f = 0; f < frames; ++f)
+  {
+    steady_clock::time_point start = steady_clock::now();
+    if (!coordinator.RenderFrame(frame))
+      exit(EXIT_FAILURE);
+    double ms = duration<double, std::milli>(steady_clock::now() - start).count();
+    totalMs += ms;
+
+    std::string filename = FrameFilename(output, f, frames);
+    if (!WriteImage(filename, frame, settings.width, settings.height, imageOptions))
+    {
+      fprintf(stderr, "Failed to write %s\n", filename.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    printf("frame %d: %.1f ms, %d worker(s), %d joined and %d left so far -> %s\n",
+           f, ms, coordinator.worker_count(), coordinator.workers_joined(),
+           coordinator.workers_left(), filename.c_str());
+  }
+
+  coordinator.Shutdown();
+  for (pid_t child : children)
+    waitpid(child, nullptr, 0);
+
+  printf("total: %.1f ms, %.1f ms/frame\n", totalMs, totalMs / frames);
+  exit(EXIT_SUCCESS);
+}
+
+static RenderService* runningService = nullptr;
+
+static void StopService(int)
+{
+  if (runningService)
+    runningService->Stop();
+}
+
+// Keep scenes loaded and serve requests until SIGINT or SIGTERM
+static void RunDaemon(const std::string& address, const std::string& sceneRoot, int threads, int cacheSize,
+                      RenderCache* results, int* argc, char** argv)
+{
+  // Scoped so the service closes its socket before exit
+  {
+    RenderService service(argc, argv, threads, cacheSize);
+    service.set_result_cache(results);
+    if (!sceneRoot.empty() && !service.set_scene_root(sceneRoot))
+    {
+      fprintf(stderr, "No scene root directory %s\n", sceneRoot.c_str());
+      exit(EXIT_FAILURE);
+    }
+    if (!service.listen(address))
+    {
+      fprintf(stderr, "Failed to listen on %s%s\n", address.c_str(),
+              sceneRoot.empty() && address.compare(0, 5, "unix:") != 0 ? ", TCP needs --scene-root" : "");
+      exit(EXIT_FAILURE);
+    }
+
+    runningService = &service;
+    std::signal(SIGINT, StopService);
+    std::signal(SIGTERM, StopService);
+
+    printf("serving render requests on %s, keeping up to %d scene(s)\n", address.c_str(), cacheSize);
+    fflush(stdout);
+    service.Run();
+    runningService = nullptr;
+
+    printf("served %lld request(s), %lld with the scene already loaded\n",
+           service.requests(), service.scene_hits());
+  }
+  exit(EXIT_SUCCESS);
+}
+
+// Send every frame to the daemon at address and write what comes back
+static void RenderOnDaemon(const std::string& address, RenderRequest request, const std::string& output,
+                           int frames, const ImageOutputOptions& imageOptions)
+{
+  // The daemon runs somewhere else, the scene has to be named in full
+  char resolved[PATH_MAX];
+  if (realpath(request.scene.c_str(), resolved))
+    request.scene = resolved;
+
+  int socket = ConnectSocket(address);
+  if (socket < 0)
+  {
+    fprintf(stderr, "No render daemon at %s\n", address.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  using namespace std::chrono;
+  double totalMs = 0.0;
+  std::vector<Vector4f> frame;
+  for (int f = 0; f < frames; ++f)
+  {
+    RenderReply reply;
+    std::string error;
+    steady_clock::time_point start = steady_clock::now();
+    if (!RequestRender(socket, request, frame, reply, error))
+    {
+      fprintf(stderr, "%s\n", error.c_str());
+      exit(EXIT_FAILURE);
+    }
+    double ms = duration<double, std::milli>(steady_clock::now() - start).count();
+    totalMs += ms;
+
+    std::string filename = FrameFilename(output, f, frames);
+    if (!WriteImage(filename, frame, request.settings.width, request.settings.height, imageOptions))
+    {
+      fprintf(stderr, "Failed to write %s\n", filename.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    printf("frame %d: %.1f ms, scene %s, render %.1f ms -> %s\n", f, ms,
+           reply.cached ? "cached" : ("loaded in " + std::to_string(reply.load_ms) + " ms").c_str(),
+           reply.render_ms, filename.c_str());
+  }
+
+  close(socket);
+  printf("total: %.1f ms, %.1f ms/frame\n", totalMs, totalMs / frames);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string sceneFile = "../assets/spheres.scene";
+  std::string output = "out.ppm";
+  std::string framebufferFile;
+  std::string checkpointFile;
+  std::string serveAddress, workerAddress;
+  std::string daemonAddress, clientAddress;
+  std::string sceneRoot;
+  std::string cacheDirectory;
+  std::string viewSet;
+  bool sequential = false;
+  std::string cameraPathFile;
+  int reproject = 0;
+  bool denoise = false;
+  int previewScale = 0;
+  bool rasterPrimary = false;
+  int shadowMapSize = 0;
+  int lightSamples = 0;
+  int localWorkers = 0, cacheSize = 8;
+  long long cacheMegabytes = 1024;
+  TaskPriority priority = PriorityNormal;
+  float checkpointSeconds = 60.0f;
+  int width = 512, height = 512;
+  int rate = 1, samples = 0, threads = 0, frames = 1;
+  PostProcess sampling = PostProcess::NoSampling;
+  Vector3f cameraPosition = Vector3f::Zero();
+  ImageOutputOptions imageOptions;
+
+  // Check arguments
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc;
+    if (std::strcmp(argv[i], "--scene") == 0 && hasValue)
+      sceneFile = argv[++i];
+    else if (std::strcmp(argv[i], "--output") == 0 && hasValue)
+      output = argv[++i];
+    else if (std::strcmp(argv[i], "--checkpoint") == 0 && hasValue)
+      checkpointFile = argv[++i];
+    else if (std::strcmp(argv[i], "--checkpoint-every") == 0 && hasValue)
+      checkpointSeconds = std::stof(argv[++i]);
+    else if (std::strcmp(argv[i], "--workers") == 0 && hasValue)
+      localWorkers = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--serve") == 0 && hasValue)
+      serveAddress = argv[++i];
+    else if (std::strcmp(argv[i], "--worker") == 0 && hasValue)
+      workerAddress = argv[++i];
+    else if (std::strcmp(argv[i], "--daemon") == 0 && hasValue)
+      daemonAddress = argv[++i];
+    else if (std::strcmp(argv[i], "--cache") == 0 && hasValue)
+      cacheSize = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--scene-root") == 0 && hasValue)
+      sceneRoot = argv[++i];
+    else if (std::strcmp(argv[i], "--cache-dir") == 0 && hasValue)
+      cacheDirectory = argv[++i];
+    else if (std::strcmp(argv[i], "--cache-size") == 0 && hasValue)
+      cacheMegabytes = std::stoll(argv[++i]);
+    else if (std::strcmp(argv[i], "--client") == 0 && hasValue)
+      clientAddress = argv[++i];
+    else if (std::strcmp(argv[i], "--priority") == 0 && hasValue)
+    {
+      std::string type = argv[++i];
+      if (type == "low")
+        priority = PriorityLow;
+      else if (type == "normal")
+        priority = PriorityNormal;
+      else if (type == "high")
+        priority = PriorityHigh;
+      else
+      {
+        fprintf(stderr, "Unknown priority: %s\n", type.c_str());
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (std::strcmp(argv[i], "--framebuffer") == 0 && hasValue)
+      framebufferFile = argv[++i];
+    else if (std::strcmp(argv[i], "--width") == 0 && hasValue)
+      width = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--height") == 0 && hasValue)
+      height = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--rate") == 0 && hasValue)
+      rate = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--samples") == 0 && hasValue)
+      samples = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--threads") == 0 && hasValue)
+      threads = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--frames") == 0 && hasValue)
+      frames = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--camera") == 0 && i + 3 < argc)
+    {
+      cameraPosition = Vector3f(std::stof(argv[i + 1]), std::stof(argv[i + 2]), std::stof(argv[i + 3]));
+      i += 3;
+    }
+    else if (std::strcmp(argv[i], "--views") == 0 && hasValue)
+      viewSet = argv[++i];
+    else if (std::strcmp(argv[i], "--sequential") == 0)
+      sequential = true;
+    else if (std::strcmp(argv[i], "--light-samples") == 0 && hasValue)
+      lightSamples = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--denoise") == 0)
+      denoise = true;
+    else if (std::strcmp(argv[i], "--raster-primary") == 0)
+      rasterPrimary = true;
+    else if (std::strcmp(argv[i], "--shadow-maps") == 0 && hasValue)
+      shadowMapSize = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--preview") == 0 && hasValue)
+      previewScale = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--camera-path") == 0 && hasValue)
+      cameraPathFile = argv[++i];
+    else if (std::strcmp(argv[i], "--reproject") == 0 && hasValue)
+      reproject = std::stoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--sampler") == 0 && hasValue)
+    {
+      std::string type = argv[++i];
+      if (type == "none")
+        sampling = PostProcess::NoSampling;
+      else if (type == "uniform")
+        sampling = PostProcess::UniformSampling;
+      else if (type == "random")
+        sampling = PostProcess::RandomSampling;
+      else
+      {
+        fprintf(stderr, "Unknown sampler: %s\n", type.c_str());
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (std::strcmp(argv[i], "--gamma") == 0 && hasValue)
+    {
+      std::string type = argv[++i];
+      if (type == "linear")
+        imageOptions.encoding = ImageEncoding::Linear;
+      else if (type == "srgb")
+        imageOptions.encoding = ImageEncoding::SRGB;
+      else
+      {
+        fprintf(stderr, "Unknown gamma: %s\n", type.c_str());
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      Usage(argv[0]);
+      exit(std::strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  // The denoiser filters the frame buffer of a plain render with the guides
+  // gathered alongside it, no other path keeps those
+  if (denoise && (!cacheDirectory.empty() || !checkpointFile.empty() || !framebufferFile.empty() ||
+                  !clientAddress.empty() || !daemonAddress.empty() || localWorkers > 0 || !serveAddress.empty() ||
+                  !viewSet.empty() || !cameraPathFile.empty() || previewScale > 0))
+  {
+    fprintf(stderr, "--denoise does not work with --cache-dir, --checkpoint, --framebuffer, --client, --daemon,\n"
+                    "--workers, --serve, --views, --camera-path or --preview\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Every one of these takes over the frame loop, the others would be dropped
+  std::vector<const char*> frameModes;
+  if (!framebufferFile.empty())
+    frameModes.push_back("--framebuffer");
+  if (!cacheDirectory.empty() && daemonAddress.empty())
+    frameModes.push_back("--cache-dir");
+  if (!checkpointFile.empty())
+    frameModes.push_back("--checkpoint");
+  if (previewScale > 0)
+    frameModes.push_back("--preview");
+  if (!viewSet.empty())
+    frameModes.push_back("--views");
+  if (!cameraPathFile.empty())
+    frameModes.push_back("--camera-path");
+  if (frameModes.size() > 1)
+  {
+    fprintf(stderr, "%s does not work with %s, each renders frames its own way\n", frameModes[0], frameModes[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Logs go to file only, stdout is for the timings
+  el::Configurations conf;
+  conf.setToDefault();
+  conf.set(el::Level::Global, el::ConfigurationType::ToStandardOutput, "false");
+  el::Loggers::reconfigureLogger("default", conf);
+
+  // Workers get everything else from their coordinator
+  if (!workerAddress.empty())
+    exit(RunRenderWorker(workerAddress, threads, &argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  RenderCache results;
+  if (!cacheDirectory.empty() && !results.open(cacheDirectory, cacheMegabytes << 20))
+  {
+    fprintf(stderr, "Failed to open the render cache in %s\n", cacheDirectory.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // The daemon loads scenes as requests name them
+  if (!daemonAddress.empty())
+    RunDaemon(daemonAddress, sceneRoot, threads, cacheSize, results.is_open() ? &results : nullptr, &argc, argv);
+
+  RenderSettings settings;
+  settings.width = width;
+  settings.height = height;
+  settings.sampling = sampling;
+  settings.sample_rate = rate;
+  settings.samples_per_pixel = samples;
+  settings.light_samples = lightSamples;
+  settings.camera = cameraPosition;
+
+  if (!clientAddress.empty())
+  {
+    RenderRequest request;
+    request.scene = sceneFile;
+    request.settings = settings;
+    request.priority = priority;
+    RenderOnDaemon(clientAddress, request, output, frames, imageOptions);
+  }
+
+  std::unique_ptr<Scene> scene = LoadScene(sceneFile);
+  if (!scene)
+  {
+    fprintf(stderr, "Failed to load scene %s\n", sceneFile.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  if (localWorkers > 0 || !serveAddress.empty())
+    RenderOnFarm(sceneFile, settings, serveAddress, localWorkers, threads, output, frames, imageOptions);
+
+  // Out of core frames never touch the in memory buffers, leave them small
+  bool outOfCore = !framebufferFile.empty();
+
+  // Taken before the tracer owns the scene
+  uint64_t sceneContents = results.is_open() ? scene->fingerprint() : 0;
+
+  RayTracer tracer(&argc, argv);
+  if (!outOfCore)
+    tracer.resize(width, height);
+  tracer.initialize(scene);
+  tracer.set_thread_count(threads);
+  tracer.set_sampling_type(sampling);
+  tracer.set_sample_rate(rate);
+  tracer.set_samples_per_pixel(samples);
+  tracer.set_camera_position(cameraPosition);
+  tracer.set_light_samples(lightSamples);
+  if (denoise)
+    tracer.set_feature_buffers(true);
+  tracer.set_raster_primary(rasterPrimary);
+  tracer.set_shadow_maps(shadowMapSize);
+
+  printf("%s: %dx%d, %d spp, %d frame(s)\n",
+         sceneFile.c_str(), width, height, tracer.samples_per_pixel(), frames);
+
+  if (!viewSet.empty())
+  {
+    std::vector<RenderView> views;
+    std::vector<std::string> names;
+    if (!MakeViews(viewSet, cameraPosition, width, height, views, names))
+    {
+      fprintf(stderr, "Unknown views: %s\n", viewSet.c_str());
+      exit(EXIT_FAILURE);
+    }
+    RenderViewSet(tracer, views, names, sequential, output, imageOptions);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (!cameraPathFile.empty())
+  {
+    std::vector<Camera> path;
+    if (!LoadCameraPath(cameraPathFile, width, height, path))
+    {
+      fprintf(stderr, "Failed to read camera path %s\n", cameraPathFile.c_str());
+      exit(EXIT_FAILURE);
+    }
+    RenderSequence(tracer, path, reproject, output, imageOptions);
+    exit(EXIT_SUCCESS);
+  }
+
+  // Checkpoints are taken between Render calls, the time budget sets how
+  // often those come
+  bool checkpointing = !checkpointFile.empty();
+  uint64_t sceneFingerprint = checkpointing ? FileFingerprint(sceneFile) : 0;
+  if (checkpointing)
+    tracer.set_max_trace_time(checkpointSeconds * 1000.0f);
+
+  // Encoding runs between frames while the tracer's workers are idle
+  ThreadPool encodePool(threads);
+  imageOptions.pool = &encodePool;
+
+  using namespace std::chrono;
+  double totalMs = 0.0, totalWriteMs = 0.0;
+  long long totalRays = 0;
+
+  for (int frame = 0; frame < frames; ++frame)
+  {
+    tracer.reset_accumulation();
+    tracer.reset_ray_stats();
+
+    std::string filename = FrameFilename(output, frame, frames);
+    double ms = 0.0, writeMs = 0.0;
+
+    if (outOfCore)
+    {
+      // Bands go to the encoder as they finish, writing overlaps tracing
+      TiledFrameBuffer framebuffer;
+      ImageStreamWriter stream;
+      ImageOutputOptions streamOptions = imageOptions;
+      streamOptions.pool = nullptr;
+      if (!framebuffer.open(framebufferFile, width, height, tracer.tile_size()) ||
+          !stream.open(filename, width, height, streamOptions))
+      {
+        fprintf(stderr, "Failed to open %s or %s\n", framebufferFile.c_str(), filename.c_str());
+        exit(EXIT_FAILURE);
+      }
+
+      std::vector<float> rows;
+      FrameStats frameStats = tracer.RenderTiled(framebuffer, [&](int band) {
+        steady_clock::time_point writeStart = steady_clock::now();
+        framebuffer.ReadBand(band, rows);
+        bool written = stream.write_rows(rows.data(), (int)(rows.size() / (width * 3)));
+        framebuffer.ReleaseBand(band);
+        writeMs += duration<double, std::milli>(steady_clock::now() - writeStart).count();
+        return written;
+      });
+      ms = frameStats.elapsed_ms;
+
+      if (!stream.close())
+      {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (results.is_open())
+    {
+      // Whole frames through the cache, stored tiles are never traced again
+      std::vector<Vector4f> image((size_t)width * height);
+      std::vector<Tile> tiles = MakeTiles(width, height, tracer.tile_size());
+      CacheResult cached;
+      ms = results.Render(tracer, sceneContents, width, height, tracer.tile_size(),
+                          [&](int index, const float* rgb) {
+        const Tile& rect = tiles[index];
+        for (int y = rect.y0; y < rect.y1; ++y)
+        {
+          for (int x = rect.x0; x < rect.x1; ++x, rgb += 3)
+            image[(size_t)y * width + x] = Vector4f(rgb[0], rgb[1], rgb[2], 1.0f);
+        }
+        return true;
+      }, &cached).elapsed_ms;
+
+      steady_clock::time_point start = steady_clock::now();
+      if (!WriteImage(filename, image, width, height, imageOptions))
+      {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+      }
+      writeMs = duration<double, std::milli>(steady_clock::now() - start).count();
+
+      printf("cache: %s, %d tiles reused, %d resumed, %d traced\n",
+             cached.hit ? "hit" : (cached.reused || cached.resumed) ? "partial hit" : "miss",
+             cached.reused, cached.resumed, cached.traced);
+    }
+    else if (previewScale > 0)
+    {
+      std::vector<Vector4f> preview;
+      ms = tracer.RenderPreview(previewScale, preview).elapsed_ms;
+
+      steady_clock::time_point start = steady_clock::now();
+      if (!WriteImage(filename, preview, width, height, imageOptions))
+      {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+      }
+      writeMs = duration<double, std::milli>(steady_clock::now() - start).count();
+    }
+    else
+    {
+      std::string checkpointName = FrameFilename(checkpointFile, frame, frames);
+      std::unique_ptr<CheckpointWriter> checkpoints;
+      if (checkpointing)
+      {
+        RenderState saved;
+        if (LoadCheckpoint(checkpointName, saved))
+        {
+          if (saved.scene == sceneFingerprint && tracer.restore_state(saved))
+            printf("resumed from %s at %d spp\n", checkpointName.c_str(), tracer.sample_count());
+          else
+            fprintf(stderr, "Ignoring %s, it was made with other settings\n", checkpointName.c_str());
+        }
+        checkpoints.reset(new CheckpointWriter(checkpointName));
+      }
+
+      steady_clock::time_point start = steady_clock::now();
+      float rasterMs = 0.0f;
+      while (!tracer.converged())
+      {
+        rasterMs += tracer.Render().raster_ms;
+
+        // The copy is all the tracer waits for, the disk write runs behind
+        if (checkpoints && !tracer.converged())
+        {
+          std::unique_ptr<RenderState> snapshot(new RenderState());
+          tracer.save_state(*snapshot);
+          snapshot->scene = sceneFingerprint;
+          checkpoints->Submit(std::move(snapshot));
+        }
+      }
+      ms = duration<double, std::milli>(steady_clock::now() - start).count();
+
+      if (rasterPrimary)
+      {
+        RayStats rays = tracer.ray_stats();
+        printf("visibility buffer: %.1f ms, %.1f%% of camera rays rasterized\n", rasterMs,
+               rays.primary_rays ? 100.0 * rays.rasterized / rays.primary_rays : 0.0);
+      }
+      if (shadowMapSize > 0)
+      {
+        RayStats rays = tracer.ray_stats();
+        long long queries = rays.shadow_rays + rays.mapped_shadows;
+        printf("shadow maps: %.1f ms, %.1f%% of shadow queries answered, %lld traced\n", tracer.shadow_map_ms(),
+               queries ? 100.0 * rays.mapped_shadows / queries : 0.0, rays.shadow_rays);
+      }
+
+      std::vector<Vector4f> denoised;
+      if (denoise)
+      {
+        start = steady_clock::now();
+        tracer.Denoise(denoised);
+        printf("denoise: %.1f ms\n", duration<double, std::milli>(steady_clock::now() - start).count());
+      }
+
+      start = steady_clock::now();
+      if (!WriteImage(filename, denoise ? denoised : tracer.frame_buffer(), width, height, imageOptions))
+      {
+        fprintf(stderr, "Failed to write %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+      }
+      writeMs = duration<double, std::milli>(steady_clock::now() - start).count();
+
+      // The image is out, the checkpoint has served its purpose
+      if (checkpoints)
+      {
+        checkpoints.reset();
+        std::remove(checkpointName.c_str());
+      }
+    }
+
+    RayStats stats = tracer.ray_stats();
+    long long rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+    totalMs += ms;
+    totalRays += rays;
+    totalWriteMs += writeMs;
+
+    printf("frame %d: %.1f ms, %lld rays, %.2f Mrays/s, write %.1f ms -> %s\n",
+           frame, ms, rays, rays / (ms * 1000.0), writeMs, filename.c_str());
+  }
+
+  printf("total: %.1f ms, %.1f ms/frame, %.2f Mrays/s, write %.1f ms/frame\n",
+         totalMs, totalMs / frames, totalRays / (totalMs * 1000.0), totalWriteMs / frames);
+
+  if (results.is_open())
+  {
+    CacheStats totals = results.stats();
+    printf("cache totals: %lld frames, %.1f%% frame hits, %lld partial, %.1f%% tile hit rate, %lld evicted\n",
+           totals.frames, 100.0f * totals.frame_hit_rate(), totals.partial_hits,
+           100.0f * totals.tile_hit_rate(), totals.evictions);
+  }
+
+  exit(EXIT_SUCCESS);
+}
@@ -4,6 +4,8 @@
  *  content  : Ray trace 3 spheres and a plane with reflection
  */
 
+#include <GL/glew.h>
+#include <GL/glut.h>
 #include <Eigen/Core>
 #include <cstdio>
 #include <cstring>
@@ -15,40 +17,147 @@
 
 #include "scene.hpp"
 #include "ray_tracer.h"
+#include "render_thread.hpp"
 #include "primitives/material.hpp"
 #include "primitives/surface_plane.hpp"
 #include "primitives/surface_sphere.hpp"
 #include "primitives/light.hpp"
 
+INITIALIZE_EASYLOGGINGPP
+
 using namespace Eigen;
 using namespace raytracer;
 
-std::unique_ptr<Scene> scene;
+std::shared_ptr<Scene> scene;
+Surface* red = nullptr;
 std::unique_ptr<RayTracer> ray;
+std::unique_ptr<RenderThread> renderer;
+
+// How often the window looks for a finished pass, about 60 times a second
+const unsigned int kPresentIntervalMs = 16;
+
+void Present(int)
+{
+	// Tracing happens on the render thread, only redraw when it finished
+	// a pass since the last time the window showed one.
+	if (renderer->frame_ready())
+		glutPostRedisplay();
+
+	glutTimerFunc(kPresentIntervalMs, Present, 0);
+}
+
+// How far a key press moves the camera or drags the light
+const float kMoveStep = 0.25f;
+
+// Record the hits of every sample only while edits can re-shade them,
+// switching it either way starts the image over
+void UseHitCache(RayTracer& tracer, bool enabled)
+{
+  if (tracer.hit_cache() != enabled)
+    tracer.set_hit_cache(enabled);
+}
 
-void Idle()
+// Slide the light along x while a or d is held, previews keep up with it
+void DragLight(float dx)
 {
-	ray->Render();
+  renderer->PostMotion([dx](RayTracer& tracer) {
+    UseHitCache(tracer, false);
+    Light* light = scene->light_tree().light(0);
+    Vector3f position = light->position();
+    position(0) += dx;
+    light->set_position(position);
+    scene->build();
+    tracer.reset_accumulation();
+  });
+}
+
+// m recolors the green sphere and l moves the light, both only re-shade
+// the samples traced so far, the tracer keeps what every one of them hit
+// from the first of these edits on. s moves the red sphere and traces
+// again just the pixels it affects. a and d drag the light, the arrow keys
+// the camera, at preview resolution. Dragging starts over every step, so
+// it stops recording.
+void Keyboard(unsigned char key, int, int)
+{
+  switch (key)
+  {
+    case 'a':
+      DragLight(-kMoveStep);
+      break;
+    case 'd':
+      DragLight(kMoveStep);
+      break;
+    case 'm':
+      renderer->Post([](RayTracer& tracer) {
+        static const Vector4f colors[] = {
+          Vector4f(0.0f, 0.5f, 0.0f, 1.0f),
+          Vector4f(0.8f, 0.6f, 0.1f, 1.0f),
+          Vector4f(0.5f, 0.1f, 0.7f, 1.0f)
+        };
+        static int color = 0;
+        color = (color + 1) % 3;
+        UseHitCache(tracer, true);
+        scene->material("green")->set_diffuse(colors[color]);
+        tracer.Reshade();
+      });
+      break;
+    case 'l':
+      renderer->Post([](RayTracer& tracer) {
+        Light* light = scene->light_tree().light(0);
+        Vector3f position = light->position();
+        position(0) = position(0) >= 4.0f ? -4.0f : position(0) + 2.0f;
+        light->set_position(position);
+        scene->build();
+        UseHitCache(tracer, true);
+        tracer.Reshade({ 0 });
+      });
+      break;
+    case 's':
+      renderer->Post([](RayTracer& tracer) {
+        UseHitCache(tracer, true);
+        tracer.Rerender(red, [](Surface& sphere) {
+          Vector3f position = sphere.position();
+          position(1) = position(1) >= 1.0f ? -1.0f : position(1) + 0.5f;
+          sphere.set_position(position);
+        });
+      });
+      break;
+  }
+}
+
+// Arrow keys walk the camera, left and right along x, up and down along z
+void Special(int key, int, int)
+{
+  Vector3f step = Vector3f::Zero();
+  switch (key)
+  {
+    case GLUT_KEY_LEFT:  step(0) = -kMoveStep; break;
+    case GLUT_KEY_RIGHT: step(0) = kMoveStep; break;
+    case GLUT_KEY_UP:    step(2) = -kMoveStep; break;
+    case GLUT_KEY_DOWN:  step(2) = kMoveStep; break;
+    default: return;
+  }
+
+  renderer->PostMotion([step](RayTracer& tracer) {
+    tracer.set_camera_position(tracer.camera().position() + step);
+  });
 }
 
 void Display()
 {
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
-  glDrawPixels(camera_->screen_width(),
-               camera_->screen_height(),
-               GL_RGBA,
-               GL_FLOAT,
-               ray->frame_buffer_.data());
+  renderer->Present([](const std::vector<Vector4f>& pixels, int width, int height) {
+    glDrawPixels(width, height, GL_RGBA, GL_FLOAT, pixels.data());
+  });
 
   glutSwapBuffers();
-  glutPostRedisplay();
 }
 
 int main(int argc, char* argv[])
 {
 	// Glut initialization
-	glutInit(argc, argv);
+	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
 	glutInitWindowPosition(100, 100);
 	glutInitWindowSize(512, 512);
@@ -66,10 +175,12 @@ int main(int argc, char* argv[])
 	printf("Status: GLEW %s\n", glewGetString(GLEW_VERSION));
 
 	// glut funcs
-	glutIdleFunc(Idle);
+	glutTimerFunc(kPresentIntervalMs, Present, 0);
 	glutDisplayFunc(Display);
+	glutKeyboardFunc(Keyboard);
+	glutSpecialFunc(Special);
 
-	scene = std::make_unique<Scene>();
+	scene = std::make_shared<Scene>();
 
 	scene->add_material(std::make_unique<Material>(
 		Vector4f(0.2f, 0.0f, 0.0f, 1.0f),			// ambient
@@ -101,7 +212,9 @@ int main(int argc, char* argv[])
 	), "white");
 
 	// add 3 spheres(position, radius, material name) to the scene
-	scene->add_surface(std::make_unique<Sphere>(Vector3f(-4.0f, 0.0f, -7.0f), 1.0f, "red"));
+	std::unique_ptr<Surface> redSphere = std::make_unique<Sphere>(Vector3f(-4.0f, 0.0f, -7.0f), 1.0f, "red");
+	red = redSphere.get();
+	scene->add_surface(std::move(redSphere));
 	scene->add_surface(std::make_unique<Sphere>(Vector3f(0.0f, 0.0f, -7.0f), 2.0f, "green"));
 	scene->add_surface(std::make_unique<Sphere>(Vector3f(4.0f, 0.0f, -7.0f), 1.0f, "blue"));
 
@@ -116,8 +229,19 @@ int main(int argc, char* argv[])
 	));
 
   ray = std::make_unique<RayTracer>(&argc, argv);
+	scene->build();
 	ray->initialize(scene);
 
+	// A pass ends after ~30 frames worth of time, so the image refines
+	// at about the display rate while it converges
+	ray->set_max_trace_time(33.0f);
+
+	// The tracer belongs to the render thread from here on
+	renderer = std::make_unique<RenderThread>(*ray);
+
+	// Camera and light moves preview at whatever resolution keeps 30 fps
+	renderer->set_preview_rate(30.0f);
+
 	glutMainLoop();
 
   exit(EXIT_SUCCESS);
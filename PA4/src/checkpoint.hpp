@@ -0,0 +1,256 @@
+/**
+ *
+ *  filename : checkpoint.hpp
+ *  author   : Do Won Cha
+ *  content  : Saves the progress of a render to disk so it can be picked up
+ *             again after the process is gone.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_CHECKPOINT_
+#define _RAY_CHECKPOINT_
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <Eigen/Core>
+
+#include "easylogging++.h"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  Everything a progressive render has accumulated. Samples are seeded by
+ *  pixel and sample index and summed in sample order, so carrying on from
+ *  a restored state adds exactly what an uninterrupted render would have.
+ */
+struct RenderState
+{
+  uint64_t settings;                      // Fingerprint of the tracer settings
+  uint64_t scene;                         // Fingerprint of the scene, up to the caller
+  int width, height, tile_size;
+  int min_samples;
+
+  std::vector<Vector4f> accumulation;     // Sum of the samples of every pixel
+  std::vector<int> sample_counts;         // Samples of every pixel
+  std::vector<int> tile_samples;          // Samples every tile has, the tile map
+
+  RenderState() :
+    settings(0), scene(0), width(0), height(0), tile_size(0), min_samples(0)
+  {}
+};
+
+namespace checkpoint_detail
+{
+
+const char kMagic[4] = { 'R', 'T', 'C', 'K' };
+const uint32_t kVersion = 1;
+
+template<typename T>
+bool Write(FILE* file, const T* data, size_t count)
+{
+  return std::fwrite(data, sizeof(T), count, file) == count;
+}
+
+template<typename T>
+bool Read(FILE* file, T* data, size_t count)
+{
+  return std::fread(data, sizeof(T), count, file) == count;
+}
+
+} // end of namespace checkpoint_detail
+
+/**
+ *  Write the state next to filename and rename it over the old checkpoint
+ *  once it is safely on disk, a crash mid write leaves the previous one.
+ */
+inline bool SaveCheckpoint(const std::string& filename, const RenderState& state)
+{
+  using namespace checkpoint_detail;
+
+  std::string temporary = filename + ".tmp";
+  FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    LOG(ERROR) << "Could not open checkpoint " << temporary << ": " << std::strerror(errno);
+    return false;
+  }
+
+  int32_t header[4] = { state.width, state.height, state.tile_size, state.min_samples };
+  uint64_t sizes[3] = { state.accumulation.size(), state.sample_counts.size(), state.tile_samples.size() };
+
+  bool ok = Write(file, kMagic, 4) && Write(file, &kVersion, 1) &&
+            Write(file, &state.settings, 1) && Write(file, &state.scene, 1) &&
+            Write(file, header, 4) && Write(file, sizes, 3) &&
+            Write(file, state.accumulation.data(), state.accumulation.size()) &&
+            Write(file, state.sample_counts.data(), state.sample_counts.size()) &&
+            Write(file, state.tile_samples.data(), state.tile_samples.size());
+
+  ok = ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = (std::fclose(file) == 0) && ok;
+  ok = ok && std::rename(temporary.c_str(), filename.c_str()) == 0;
+
+  if (!ok)
+  {
+    LOG(ERROR) << "Failed writing checkpoint " << filename << ": " << std::strerror(errno);
+    std::remove(temporary.c_str());
+  }
+  return ok;
+}
+
+// False without an error when there is no checkpoint yet
+inline bool LoadCheckpoint(const std::string& filename, RenderState& state)
+{
+  using namespace checkpoint_detail;
+
+  FILE* file = std::fopen(filename.c_str(), "rb");
+  if (!file)
+    return false;
+
+  char magic[4];
+  uint32_t version = 0;
+  int32_t header[4];
+  uint64_t sizes[3];
+
+  bool ok = Read(file, magic, 4) && std::memcmp(magic, kMagic, 4) == 0 &&
+            Read(file, &version, 1) && version == kVersion &&
+            Read(file, &state.settings, 1) && Read(file, &state.scene, 1) &&
+            Read(file, header, 4) && Read(file, sizes, 3);
+
+  // Bytes after the header, all of them belong to the buffers
+  long start = ok ? std::ftell(file) : -1;
+  ok = ok && start >= 0 && std::fseek(file, 0, SEEK_END) == 0;
+  long end = ok ? std::ftell(file) : -1;
+  ok = ok && end >= start && std::fseek(file, start, SEEK_SET) == 0;
+  const uint64_t left = ok ? (uint64_t)(end - start) : 0;
+
+  // Sizes have to agree with the header and the file before anything gets
+  // allocated. Both sides are below 2^31, so their product fits.
+  const uint64_t perPixel = sizeof(Vector4f) + sizeof(int);
+  ok = ok && header[0] > 0 && header[1] > 0 && header[2] > 0 &&
+       (uint64_t)header[0] * (uint64_t)header[1] <= left / perPixel;
+  uint64_t pixels = ok ? (uint64_t)header[0] * (uint64_t)header[1] : 0;
+  uint64_t tiles = ok ? (((uint64_t)header[0] + header[2] - 1) / header[2]) *
+                        (((uint64_t)header[1] + header[2] - 1) / header[2]) : 0;
+  ok = ok && sizes[0] == pixels && sizes[1] == pixels && sizes[2] == tiles &&
+       pixels * perPixel + tiles * sizeof(int) == left;
+
+  if (ok)
+  {
+    state.width = header[0];
+    state.height = header[1];
+    state.tile_size = header[2];
+    state.min_samples = header[3];
+    state.accumulation.resize(sizes[0]);
+    state.sample_counts.resize(sizes[1]);
+    state.tile_samples.resize(sizes[2]);
+
+    ok = Read(file, state.accumulation.data(), sizes[0]) &&
+         Read(file, state.sample_counts.data(), sizes[1]) &&
+         Read(file, state.tile_samples.data(), sizes[2]);
+  }
+  std::fclose(file);
+
+  if (!ok)
+    LOG(ERROR) << "Checkpoint " << filename << " is damaged or from another version";
+  return ok;
+}
+
+/**
+ *  Writes checkpoints on a thread of its own so tracing never waits for
+ *  the disk. A snapshot handed in while the previous one is still being
+ *  written takes the place of any snapshot waiting behind it, only the
+ *  newest state is worth keeping.
+ */
+class CheckpointWriter
+{
+public:
+  explicit CheckpointWriter(const std::string& filename) :
+    filename_(filename), busy_(false), stop_(false), failed_(false)
+  {
+    thread_ = std::thread([this] { WriterLoop(); });
+  }
+
+  // Finishes whatever is queued
+  ~CheckpointWriter()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  void Submit(std::unique_ptr<RenderState> state)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ = std::move(state);
+    }
+    wake_.notify_all();
+  }
+
+  // Block until every submitted snapshot is on disk
+  void Wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return !pending_ && !busy_; });
+  }
+
+  // True if any write went wrong
+  bool failed() const { return failed_; }
+private:
+  void WriterLoop()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+      wake_.wait(lock, [this] { return stop_ || pending_; });
+      if (!pending_)
+        return;
+
+      std::unique_ptr<RenderState> state = std::move(pending_);
+      busy_ = true;
+      lock.unlock();
+
+      bool ok = SaveCheckpoint(filename_, *state);
+
+      lock.lock();
+      busy_ = false;
+      failed_ = failed_ || !ok;
+      if (!pending_)
+        idle_.notify_all();
+    }
+  }
+private:
+  std::string filename_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_, idle_;
+  std::unique_ptr<RenderState> pending_;
+  bool busy_, stop_;
+  std::atomic<bool> failed_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_CHECKPOINT_ */
@@ -0,0 +1,242 @@
+/**
+ *
+ *  filename : denoiser.cpp
+ *  author   : Do Won Cha
+ *  content  : Edge avoiding filters, see denoiser.h
+ *
+ */
+
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace raytracer
+{
+
+namespace
+{
+
+// B3 spline, the taps of every pass
+const float kKernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// Rows filtered together, the unit of work handed to the pool
+const int kStripRows = 16;
+
+// Past this the weight of a tap is not worth the exp
+const float kMaxExponent = 16.0f;
+
+// How far apart the samples of an upscale may be and still blend, in
+// 1 - cosine of their normals and relative distance from the camera
+const float kUpscaleNormalPower = 32.0f;
+const float kUpscaleDepthSigma = 0.1f;
+
+// What the guides say about one pixel, worked out once for every pass
+struct Guide
+{
+  Vector3f normal;            // Unit length, zero where nothing was hit
+  float distance;             // Average over the samples that hit
+  Vector4f albedo;            // rgb and coverage
+};
+
+// 1 for samples that saw the same surface at the same place, less the
+// further apart their normals and distances are, 0 if only one hit
+float Similarity(const Vector4f& a, const Vector4f& b)
+{
+  if ((a.w() > 0.0f) != (b.w() > 0.0f))
+    return 0.0f;
+  if (a.w() <= 0.0f)
+    return 1.0f;
+
+  float facing = a.head<3>().dot(b.head<3>());
+  if (facing <= 0.0f)
+    return 0.0f;
+  float exponent = kUpscaleNormalPower * (1.0f - facing) +
+                   2.0f * std::abs(a.w() - b.w()) / ((a.w() + b.w()) * kUpscaleDepthSigma);
+  return exponent > kMaxExponent ? 0.0f : std::exp(-exponent);
+}
+
+} // end of anonymous namespace
+
+void DenoiseImage(const std::vector<Vector4f>& color, const std::vector<Vector4f>& normals,
+                  const std::vector<Vector4f>& albedos, int width, int height,
+                  const DenoiseSettings& settings, ThreadPool* pool, std::vector<Vector4f>& out)
+{
+  const size_t pixels = (size_t)width * height;
+  out = color;
+  if (settings.iterations <= 0 || normals.size() != pixels || albedos.size() != pixels)
+    return;
+
+  std::vector<Guide> guides(pixels);
+  for (size_t p = 0; p < pixels; ++p)
+  {
+    Vector3f normal = normals[p].head<3>();
+    float length = normal.norm();
+    float coverage = albedos[p].w();
+    guides[p].normal = length > 0.0f ? Vector3f(normal / length) : Vector3f::Zero();
+    guides[p].distance = coverage > 0.0f ? normals[p].w() / coverage : 0.0f;
+    guides[p].albedo = albedos[p];
+  }
+
+  const float invAlbedo = 1.0f / (settings.albedo_sigma * settings.albedo_sigma);
+  std::vector<Vector4f> filtered(pixels);
+
+  float colorSigma = settings.color_sigma;
+  for (int pass = 0; pass < settings.iterations; ++pass, colorSigma *= 0.5f)
+  {
+    const int step = 1 << pass;
+    const float invColor = 1.0f / (colorSigma * colorSigma);
+    const float invDepth = 1.0f / (settings.depth_sigma * step);
+
+    ForEachStrip(height, kStripRows, pool, [&](int first, int last) {
+      for (int y = first; y < last; ++y)
+      {
+        for (int x = 0; x < width; ++x)
+        {
+          const size_t p = (size_t)y * width + x;
+          const Vector4f& center = out[p];
+          const Guide& guide = guides[p];
+          const bool hit = guide.albedo.w() > 0.0f;
+
+          Vector4f sum = Vector4f::Zero();
+          float weights = 0.0f;
+          for (int ky = 0; ky < 5; ++ky)
+          {
+            int qy = y + (ky - 2) * step;
+            if (qy < 0 || qy >= height)
+              continue;
+
+            for (int kx = 0; kx < 5; ++kx)
+            {
+              int qx = x + (kx - 2) * step;
+              if (qx < 0 || qx >= width)
+                continue;
+
+              const size_t q = (size_t)qy * width + qx;
+              const Guide& other = guides[q];
+
+              // Every edge stopping test in one exponent
+              float exponent = (out[q] - center).head<3>().squaredNorm() * invColor +
+                               (other.albedo - guide.albedo).squaredNorm() * invAlbedo;
+              if (hit && other.albedo.w() > 0.0f)
+              {
+                float facing = guide.normal.dot(other.normal);
+                if (facing <= 0.0f)
+                  continue;
+                exponent += settings.normal_power * (1.0f - facing) +
+                            std::abs(other.distance - guide.distance) * invDepth / guide.distance;
+              }
+              if (exponent > kMaxExponent)
+                continue;
+
+              float weight = kKernel[kx] * kKernel[ky] * std::exp(-exponent);
+              sum += out[q] * weight;
+              weights += weight;
+            }
+          }
+
+          // Normals of a pixel on a sharp crease can average out to nothing
+          filtered[p] = weights > 0.0f ? Vector4f(sum / weights) : center;
+        }
+      }
+    });
+
+    out.swap(filtered);
+  }
+}
+
+void UpscaleImage(const std::vector<Vector4f>& color, const std::vector<Vector4f>& normals,
+                  int low_width, int low_height, int width, int height, ThreadPool* pool,
+                  std::vector<Vector4f>& out)
+{
+  const size_t lowPixels = (size_t)low_width * low_height;
+  out.assign((size_t)width * height, Vector4f::Zero());
+  if (lowPixels == 0 || color.size() != lowPixels || normals.size() != lowPixels)
+    return;
+  if (low_width == width && low_height == height)
+  {
+    out = color;
+    return;
+  }
+
+  // How alike every sample is to the one to its right, below, below right
+  // and below left. Only those pairs ever meet, so the exps are taken
+  // once per sample instead of for every pixel.
+  std::vector<float> links(lowPixels * 4, 0.0f);
+  ForEachStrip(low_height, kStripRows, pool, [&](int first, int last) {
+    for (int y = first; y < last; ++y)
+    {
+      for (int x = 0; x < low_width; ++x)
+      {
+        const size_t p = (size_t)y * low_width + x;
+        float* link = &links[p * 4];
+        if (x + 1 < low_width)
+          link[0] = Similarity(normals[p], normals[p + 1]);
+        if (y + 1 < low_height)
+        {
+          link[1] = Similarity(normals[p], normals[p + low_width]);
+          if (x + 1 < low_width)
+            link[2] = Similarity(normals[p], normals[p + low_width + 1]);
+          if (x > 0)
+            link[3] = Similarity(normals[p], normals[p + low_width - 1]);
+        }
+      }
+    }
+  });
+
+  // Pairs of neighbouring samples by column and row, a sample with itself is 1
+  auto linked = [&](int ax, int ay, int bx, int by) {
+    if (by < ay || (by == ay && bx < ax))
+    {
+      std::swap(ax, bx);
+      std::swap(ay, by);
+    }
+    if (ax == bx && ay == by)
+      return 1.0f;
+    const float* link = &links[((size_t)ay * low_width + ax) * 4];
+    return by == ay ? link[0] : bx == ax ? link[1] : bx > ax ? link[2] : link[3];
+  };
+
+  const float scaleX = (float)low_width / width, scaleY = (float)low_height / height;
+
+  ForEachStrip(height, kStripRows, pool, [&](int first, int last) {
+    for (int y = first; y < last; ++y)
+    {
+      // Low resolution rows above and below the pixel center, and how far
+      // along between them it is
+      float fy = (y + 0.5f) * scaleY - 0.5f;
+      int y0 = (int)std::floor(fy);
+      fy -= y0;
+      const int rows[2] = { (std::max)(y0, 0), (std::min)(y0 + 1, low_height - 1) };
+
+      for (int x = 0; x < width; ++x)
+      {
+        float fx = (x + 0.5f) * scaleX - 0.5f;
+        int x0 = (int)std::floor(fx);
+        fx -= x0;
+        const int columns[2] = { (std::max)(x0, 0), (std::min)(x0 + 1, low_width - 1) };
+
+        // The nearest sample says which surface the pixel is on, the
+        // others count as much as they are like it
+        const int nearest = (fx >= 0.5f ? 1 : 0) + (fy >= 0.5f ? 2 : 0);
+        const int nx = columns[nearest & 1], ny = rows[nearest >> 1];
+
+        Vector4f sum = Vector4f::Zero();
+        float weights = 0.0f;
+        for (int corner = 0; corner < 4; ++corner)
+        {
+          const int cx = columns[corner & 1], cy = rows[corner >> 1];
+          float weight = ((corner & 1) ? fx : 1.0f - fx) * ((corner >> 1) ? fy : 1.0f - fy) *
+                         linked(nx, ny, cx, cy);
+          sum += color[(size_t)cy * low_width + cx] * weight;
+          weights += weight;
+        }
+
+        // The nearest sample weighs at least a quarter
+        out[(size_t)y * width + x] = sum / weights;
+      }
+    }
+  });
+}
+
+} // end of namespace raytracer
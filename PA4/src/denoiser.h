@@ -0,0 +1,75 @@
+/**
+ *
+ *  filename : denoiser.h
+ *  author   : Do Won Cha
+ *  content  : Edge avoiding filters guided by what the first hits saw. An
+ *             a-trous wavelet filter cleans up renders with few samples
+ *             per pixel, and an upscaler fills in low resolution previews.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_DENOISER_
+#define _RAY_DENOISER_
+
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "thread_pool.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+struct DenoiseSettings
+{
+  int iterations;             // Passes, each one twice as wide, 3 reach 14 pixels each way
+  float color_sigma;          // Color difference that still blends, halved every pass
+  float normal_power;         // Higher keeps creases sharper
+  float depth_sigma;          // Relative distance difference that still blends, per pixel of step
+  float albedo_sigma;         // Albedo and coverage difference that still blends
+
+  DenoiseSettings() :
+    iterations(3), color_sigma(1.6f), normal_power(64.0f), depth_sigma(0.05f), albedo_sigma(0.3f)
+  {}
+};
+
+/**
+ *  Filter a width by height image, top row first, into out. The guides
+ *  are per pixel averages over the samples of the first hit:
+ *
+ *  normals  xyz normal, w distance from the camera, 0 for samples that
+ *           escaped the scene
+ *  albedos  rgb diffuse color, w the fraction of samples that hit anything
+ *
+ *  Every pass is a 5 by 5 B3 spline kernel with its taps spread step
+ *  pixels apart, step doubling each pass. Taps whose color or guides
+ *  differ from the center's count for less, so silhouettes, creases and
+ *  texture stay put while noise inside flat regions averages out. The
+ *  color test gets stricter every pass, which keeps the wide passes off
+ *  reflections and shadow edges. Rows are split over pool when there is one.
+ */
+void DenoiseImage(const std::vector<Vector4f>& color, const std::vector<Vector4f>& normals,
+                  const std::vector<Vector4f>& albedos, int width, int height,
+                  const DenoiseSettings& settings, ThreadPool* pool, std::vector<Vector4f>& out);
+
+/**
+ *  Fill a width by height image, top row first, into out from color
+ *  traced at low_width by low_height over the same view, with normals
+ *  what each of its samples hit as DenoiseImage takes them.
+ *
+ *  Every pixel blends the four samples around it bilinearly, but only
+ *  those on the same surface as the nearest one by normal and distance,
+ *  so a pixel never picks up the color of something it is in front of or
+ *  behind. Edges come out as sharp as the low resolution, the shading in
+ *  between smooth. Rows are split over pool when there is one.
+ */
+void UpscaleImage(const std::vector<Vector4f>& color, const std::vector<Vector4f>& normals,
+                  int low_width, int low_height, int width, int height, ThreadPool* pool,
+                  std::vector<Vector4f>& out);
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_DENOISER_ */
@@ -0,0 +1,59 @@
+/**
+ *
+ *  filename : fingerprint.hpp
+ *  author   : Do Won Cha
+ *  content  : Stable 64 bit hash of values fed in one after the other, the
+ *             same on every run and machine.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_FINGERPRINT_
+#define _RAY_FINGERPRINT_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <Eigen/Core>
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// FNV-1a over the bytes of every value, floats go in by their bits
+class Fingerprint
+{
+public:
+  Fingerprint() : value_(1469598103934665603ULL) {}
+
+  void add_bytes(const void* data, size_t size)
+  {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+      value_ = (value_ ^ bytes[i]) * 1099511628211ULL;
+  }
+
+  void add(uint32_t value) { add_bytes(&value, sizeof(value)); }
+  void add(int value) { add((uint32_t)value); }
+  void add(uint64_t value) { add_bytes(&value, sizeof(value)); }
+  void add(float value) { add_bytes(&value, sizeof(value)); }
+  void add(const Vector3f& value) { add_bytes(value.data(), 3 * sizeof(float)); }
+  void add(const Vector4f& value) { add_bytes(value.data(), 4 * sizeof(float)); }
+
+  // Length first, "ab" "c" and "a" "bc" differ
+  void add(const std::string& text)
+  {
+    add((uint32_t)text.size());
+    add_bytes(text.data(), text.size());
+  }
+
+  uint64_t value() const { return value_; }
+private:
+  uint64_t value_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_FINGERPRINT_ */
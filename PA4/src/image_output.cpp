@@ -0,0 +1,739 @@
+/**
+ *
+ *  filename : image_output.cpp
+ *  author   : Do Won Cha
+ *  content  : Image writers, see image_output.h
+ *
+ */
+
+#include "image_output.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#ifdef RAYTRACER_WITH_PNG
+#include <zlib.h>
+#endif
+
+#include "easylogging++.h"
+#include "utility.h"
+
+namespace raytracer
+{
+
+namespace
+{
+
+// Rows encoded together, the unit of work handed to the pool
+const int kStripRows = 64;
+
+// Byte the sRGB curve gives a pinned linear value
+int EncodeSRGB(float linear)
+{
+  float encoded = (linear <= 0.0031308f) ? 12.92f * linear
+                                          : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+  return (int)(Utility::PinToUnit(encoded) * 255.99999f);
+}
+
+/**
+ *  thresholds[b] is the smallest pinned value EncodeSRGB turns into b. Found
+ *  by bisecting over the float bit patterns, so looking a value up gives
+ *  exactly what calling pow would have.
+ */
+const float* SRGBThresholds()
+{
+  static const std::vector<float> thresholds = [] {
+    std::vector<float> values(256, 0.0f);
+    for (int b = 1; b < 256; ++b)
+    {
+      uint32_t low = 0, high = 0x3f800000;      // 0.0f and 1.0f
+      while (high - low > 1)
+      {
+        uint32_t middle = low + (high - low) / 2;
+        float value;
+        std::memcpy(&value, &middle, sizeof(float));
+        if (EncodeSRGB(value) >= b)
+          high = middle;
+        else
+          low = middle;
+      }
+      std::memcpy(&values[b], &high, sizeof(float));
+    }
+    return values;
+  }();
+  return thresholds.data();
+}
+
+// Byte of i / kSRGBBuckets for every bucket, a lower bound for the whole
+// bucket since scaling by a power of two is exact
+const int kSRGBBuckets = 4096;
+
+const uint8_t* SRGBBucketTable()
+{
+  static const std::vector<uint8_t> table = [] {
+    const float* thresholds = SRGBThresholds();
+    std::vector<uint8_t> values(kSRGBBuckets + 1);
+    for (int i = 0, b = 0; i <= kSRGBBuckets; ++i)
+    {
+      while (b < 255 && i / float(kSRGBBuckets) >= thresholds[b + 1])
+        ++b;
+      values[i] = (uint8_t)b;
+    }
+    return values;
+  }();
+  return table.data();
+}
+
+// Bucket lookup, then step over the thresholds inside the bucket. Only the
+// steep dark end of the curve has any.
+inline uint8_t LookupSRGB(const uint8_t* buckets, const float* thresholds, float value)
+{
+  int b = buckets[(int)(value * kSRGBBuckets)];
+  while (b < 255 && value >= thresholds[b + 1])
+    ++b;
+  return (uint8_t)b;
+}
+
+// Runs body(strip) for every strip of rows, on the pool when there is one
+void ForEachStrip(int height, ThreadPool* pool, const std::function<void(int strip)>& body)
+{
+  int strips = (height + kStripRows - 1) / kStripRows;
+  if (pool && strips > 1)
+  {
+    pool->ParallelFor(strips, [&](int strip, int) { body(strip); return true; });
+    return;
+  }
+
+  for (int strip = 0; strip < strips; ++strip)
+    body(strip);
+}
+
+bool WriteFile(const std::string& filename, const std::string& header,
+               const std::vector<const std::vector<uint8_t>*>& blocks)
+{
+  std::ofstream ofs(filename, std::ios::out | std::ios::binary);
+  if (!ofs)
+  {
+    LOG(ERROR) << "Could not open " << filename << " for writing";
+    return false;
+  }
+
+  ofs.write(header.data(), header.size());
+  for (const std::vector<uint8_t>* block : blocks)
+    ofs.write((const char*)block->data(), block->size());
+
+  if (!ofs)
+  {
+    LOG(ERROR) << "Failed writing " << filename;
+    return false;
+  }
+  return true;
+}
+
+void PutBigEndian(uint8_t* out, uint32_t value)
+{
+  out[0] = (uint8_t)(value >> 24);
+  out[1] = (uint8_t)(value >> 16);
+  out[2] = (uint8_t)(value >> 8);
+  out[3] = (uint8_t)value;
+}
+
+/**
+ *  QOI encoding of rows [y0, y1). Strips start without a previous pixel
+ *  and with an empty index, and only use index entries they wrote
+ *  themselves. A decoder carries its state across the strip boundary but
+ *  holds the same value in every entry the strip refers to, so encoded
+ *  strips can simply be concatenated.
+ */
+void EncodeQOIStrip(const uint8_t* rgb, int width, int y0, int y1, std::vector<uint8_t>& out)
+{
+  uint8_t index[64][3];
+  bool indexed[64] = {};
+  uint8_t previous[3] = { 0, 0, 0 };
+  bool hasPrevious = false;
+  int run = 0;
+
+  const uint8_t* pixel = rgb + (size_t)y0 * width * 3;
+  const uint8_t* end = rgb + (size_t)y1 * width * 3;
+  out.clear();
+  out.reserve((end - pixel) / 2);
+
+  for (; pixel != end; pixel += 3)
+  {
+    if (hasPrevious && std::memcmp(pixel, previous, 3) == 0)
+    {
+      if (++run == 62)
+      {
+        out.push_back(0xc0 | (run - 1));      // QOI_OP_RUN
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0)
+    {
+      out.push_back(0xc0 | (run - 1));
+      run = 0;
+    }
+
+    // Alpha is always 255
+    int slot = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + 255 * 11) % 64;
+    if (indexed[slot] && std::memcmp(index[slot], pixel, 3) == 0)
+    {
+      out.push_back((uint8_t)slot);             // QOI_OP_INDEX
+    }
+    else
+    {
+      std::memcpy(index[slot], pixel, 3);
+      indexed[slot] = true;
+
+      int dr = hasPrevious ? (int8_t)(pixel[0] - previous[0]) : 1000;
+      int dg = hasPrevious ? (int8_t)(pixel[1] - previous[1]) : 1000;
+      int db = hasPrevious ? (int8_t)(pixel[2] - previous[2]) : 1000;
+      int drg = dr - dg;
+      int dbg = db - dg;
+
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+      {
+        out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));    // QOI_OP_DIFF
+      }
+      else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+      {
+        out.push_back(0x80 | (dg + 32));        // QOI_OP_LUMA
+        out.push_back(((drg + 8) << 4) | (dbg + 8));
+      }
+      else
+      {
+        out.push_back(0xfe);                    // QOI_OP_RGB
+        out.insert(out.end(), pixel, pixel + 3);
+      }
+    }
+
+    std::memcpy(previous, pixel, 3);
+    hasPrevious = true;
+  }
+
+  if (run > 0)
+    out.push_back(0xc0 | (run - 1));
+}
+
+// count pixels of stride floats each, the first three are RGB
+void EncodePixels(const float* source, int stride, size_t count, ImageEncoding encoding, uint8_t* target)
+{
+  const float* thresholds = SRGBThresholds();
+  const uint8_t* buckets = SRGBBucketTable();
+  bool srgb = encoding == ImageEncoding::SRGB;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    for (int c = 0; c < 3; ++c)
+    {
+      float value = Utility::PinToUnit(source[i * stride + c]);
+      target[i * 3 + c] = srgb ? LookupSRGB(buckets, thresholds, value) : (uint8_t)(value * 255.99999f);
+    }
+  }
+}
+
+// PNG Up filter of one row, above is null for the first row of the image
+void FilterUp(const uint8_t* row, const uint8_t* above, size_t stride, uint8_t* target)
+{
+  target[0] = 2;
+  for (size_t i = 0; i < stride; ++i)
+    target[i + 1] = (uint8_t)(row[i] - (above ? above[i] : 0));
+}
+
+} // end of anonymous namespace
+
+void EncodeRGB8(const std::vector<Vector4f>& buffer, int width, int height,
+                const ImageOutputOptions& options, std::vector<uint8_t>& out)
+{
+  out.resize((size_t)width * height * 3);
+
+  ForEachStrip(height, options.pool, [&](int strip) {
+    size_t begin = (size_t)strip * kStripRows * width;
+    size_t end = (std::min)((size_t)(strip + 1) * kStripRows, (size_t)height) * width;
+
+    EncodePixels(buffer[0].data() + begin * 4, 4, end - begin, options.encoding, &out[begin * 3]);
+  });
+}
+
+bool WritePPM(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options)
+{
+  std::vector<uint8_t> rgb;
+  EncodeRGB8(buffer, width, height, options, rgb);
+
+  std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+  return WriteFile(filename, header, { &rgb });
+}
+
+bool WritePFM(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height)
+{
+  // Rows go bottom to top, the negative scale marks little endian floats
+  std::vector<uint8_t> floats((size_t)width * height * 3 * sizeof(float));
+  float* target = (float*)floats.data();
+  for (int y = 0; y < height; ++y)
+  {
+    const Vector4f* row = &buffer[(size_t)(height - 1 - y) * width];
+    for (int x = 0; x < width; ++x)
+    {
+      target[0] = row[x](0);
+      target[1] = row[x](1);
+      target[2] = row[x](2);
+      target += 3;
+    }
+  }
+
+  std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+  return WriteFile(filename, header, { &floats });
+}
+
+bool WriteQOI(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options)
+{
+  std::vector<uint8_t> rgb;
+  EncodeRGB8(buffer, width, height, options, rgb);
+
+  int strips = (height + kStripRows - 1) / kStripRows;
+  std::vector<std::vector<uint8_t>> encoded(strips);
+  ForEachStrip(height, options.pool, [&](int strip) {
+    EncodeQOIStrip(rgb.data(), width, strip * kStripRows,
+                   (std::min)((strip + 1) * kStripRows, height), encoded[strip]);
+  });
+
+  uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+  PutBigEndian(header + 4, width);
+  PutBigEndian(header + 8, height);
+  header[12] = 3;
+  header[13] = options.encoding == ImageEncoding::SRGB ? 0 : 1;
+
+  std::vector<uint8_t> padding = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  std::vector<const std::vector<uint8_t>*> blocks;
+  for (const std::vector<uint8_t>& block : encoded)
+    blocks.push_back(&block);
+  blocks.push_back(&padding);
+
+  return WriteFile(filename, std::string((const char*)header, sizeof(header)), blocks);
+}
+
+#ifdef RAYTRACER_WITH_PNG
+
+bool WritePNG(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options)
+{
+  std::vector<uint8_t> rgb;
+  EncodeRGB8(buffer, width, height, options, rgb);
+
+  // Every row gets the Up filter, rows above the image count as zero
+  size_t stride = (size_t)width * 3;
+  std::vector<uint8_t> filtered((stride + 1) * height);
+  ForEachStrip(height, options.pool, [&](int strip) {
+    int y1 = (std::min)((strip + 1) * kStripRows, height);
+    for (int y = strip * kStripRows; y < y1; ++y)
+    {
+      const uint8_t* row = &rgb[y * stride];
+      FilterUp(row, (y > 0) ? row - stride : nullptr, stride, &filtered[y * (stride + 1)]);
+    }
+  });
+
+  /**
+   *  Strips are deflated on their own, each primed with the 32K of data
+   *  before it as the dictionary. Every strip but the last ends on a sync
+   *  flush so the raw streams join into one deflate stream, and the
+   *  checksums are combined afterwards.
+   */
+  int strips = (height + kStripRows - 1) / kStripRows;
+  std::vector<std::vector<uint8_t>> deflated(strips);
+  std::vector<uLong> checksums(strips);
+  std::vector<char> failed(strips, 0);    // Not vector<bool>, strips set theirs concurrently
+
+  ForEachStrip(height, options.pool, [&](int strip) {
+    size_t begin = (size_t)strip * kStripRows * (stride + 1);
+    size_t end = (std::min)((size_t)(strip + 1) * kStripRows, (size_t)height) * (stride + 1);
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, options.compression, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      failed[strip] = 1;
+      return;
+    }
+
+    size_t dictionary = (std::min)(begin, (size_t)32768);
+    if (dictionary > 0)
+      deflateSetDictionary(&stream, &filtered[begin - dictionary], (uInt)dictionary);
+
+    std::vector<uint8_t>& out = deflated[strip];
+    out.resize(deflateBound(&stream, end - begin) + 16);
+    stream.next_in = &filtered[begin];
+    stream.avail_in = (uInt)(end - begin);
+    stream.next_out = out.data();
+    stream.avail_out = (uInt)out.size();
+
+    int flush = (strip + 1 == strips) ? Z_FINISH : Z_SYNC_FLUSH;
+    int result = deflate(&stream, flush);
+    failed[strip] = (flush == Z_FINISH) ? result != Z_STREAM_END : result != Z_OK;
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    checksums[strip] = adler32(adler32(0, nullptr, 0), &filtered[begin], (uInt)(end - begin));
+  });
+
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+  {
+    LOG(ERROR) << "zlib failed compressing " << filename;
+    return false;
+  }
+
+  uLong adler = adler32(0, nullptr, 0);
+  size_t compressed = 0;
+  for (int strip = 0; strip < strips; ++strip)
+  {
+    size_t begin = (size_t)strip * kStripRows * (stride + 1);
+    size_t end = (std::min)((size_t)(strip + 1) * kStripRows, (size_t)height) * (stride + 1);
+    adler = adler32_combine(adler, checksums[strip], (z_off_t)(end - begin));
+    compressed += deflated[strip].size();
+  }
+
+  // Signature, IHDR and the head of the single IDAT chunk
+  std::vector<uint8_t> head = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  uint8_t ihdr[25] = { 0, 0, 0, 13, 'I', 'H', 'D', 'R' };
+  PutBigEndian(ihdr + 8, width);
+  PutBigEndian(ihdr + 12, height);
+  ihdr[16] = 8;     // Bits per channel
+  ihdr[17] = 2;     // RGB
+  PutBigEndian(ihdr + 21, crc32(crc32(0, nullptr, 0), ihdr + 4, 17));
+  head.insert(head.end(), ihdr, ihdr + sizeof(ihdr));
+
+  uint8_t idat[10] = { 0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x78, 0x9c };
+  PutBigEndian(idat, (uint32_t)(compressed + 6));
+  head.insert(head.end(), idat, idat + sizeof(idat));
+
+  uLong crc = crc32(crc32(0, nullptr, 0), idat + 4, 6);
+  for (const std::vector<uint8_t>& block : deflated)
+    crc = crc32(crc, block.data(), (uInt)block.size());
+
+  std::vector<uint8_t> tail(4);
+  PutBigEndian(tail.data(), (uint32_t)adler);
+  crc = crc32(crc, tail.data(), 4);
+  tail.resize(8);
+  PutBigEndian(tail.data() + 4, (uint32_t)crc);
+
+  uint8_t iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+  tail.insert(tail.end(), iend, iend + sizeof(iend));
+
+  std::vector<const std::vector<uint8_t>*> blocks;
+  for (const std::vector<uint8_t>& block : deflated)
+    blocks.push_back(&block);
+  blocks.push_back(&tail);
+
+  return WriteFile(filename, std::string(head.begin(), head.end()), blocks);
+}
+
+#else
+
+bool WritePNG(const std::string& filename, const std::vector<Vector4f>&, int, int,
+              const ImageOutputOptions&)
+{
+  LOG(ERROR) << "Built without zlib, can not write " << filename << ", use .ppm or .qoi";
+  return false;
+}
+
+#endif /* RAYTRACER_WITH_PNG */
+
+ImageFormat ImageFormatFromFilename(const std::string& filename)
+{
+  std::string extension;
+  size_t dot = filename.rfind('.');
+  if (dot != std::string::npos)
+    extension = filename.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+  if (extension == "ppm")
+    return ImageFormat::PPM;
+  if (extension == "pfm")
+    return ImageFormat::PFM;
+  if (extension == "qoi")
+    return ImageFormat::QOI;
+  if (extension == "png")
+    return ImageFormat::PNG;
+  return ImageFormat::Unknown;
+}
+
+bool WriteImage(const std::string& filename, const std::vector<Vector4f>& buffer,
+                int width, int height, const ImageOutputOptions& options)
+{
+  if (buffer.size() != (size_t)width * height)
+  {
+    LOG(ERROR) << "Buffer size " << buffer.size() << " does not match " << width << "x" << height;
+    return false;
+  }
+
+  switch (ImageFormatFromFilename(filename))
+  {
+  case ImageFormat::PPM: return WritePPM(filename, buffer, width, height, options);
+  case ImageFormat::PFM: return WritePFM(filename, buffer, width, height);
+  case ImageFormat::QOI: return WriteQOI(filename, buffer, width, height, options);
+  case ImageFormat::PNG: return WritePNG(filename, buffer, width, height, options);
+  default: break;
+  }
+
+  LOG(ERROR) << "Unknown image format: " << filename;
+  return false;
+}
+
+ImageStreamWriter::ImageStreamWriter() :
+  format_(ImageFormat::Unknown), width_(0), height_(0), rows_written_(0), header_size_(0),
+  deflate_(nullptr)
+{}
+
+ImageStreamWriter::~ImageStreamWriter()
+{
+  if (file_.is_open())
+    close();
+}
+
+bool ImageStreamWriter::open(const std::string& filename, int width, int height,
+                             const ImageOutputOptions& options)
+{
+  if (file_.is_open())
+    close();
+
+  filename_ = filename;
+  format_ = ImageFormatFromFilename(filename);
+  options_ = options;
+  width_ = width;
+  height_ = height;
+  rows_written_ = 0;
+
+  if (format_ == ImageFormat::Unknown)
+  {
+    LOG(ERROR) << "Unknown image format: " << filename;
+    return false;
+  }
+#ifndef RAYTRACER_WITH_PNG
+  if (format_ == ImageFormat::PNG)
+  {
+    LOG(ERROR) << "Built without zlib, can not write " << filename << ", use .ppm or .qoi";
+    return false;
+  }
+#endif
+
+  file_.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file_)
+  {
+    LOG(ERROR) << "Could not open " << filename << " for writing";
+    return false;
+  }
+
+  std::string header;
+  switch (format_)
+  {
+  case ImageFormat::PPM:
+    header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    break;
+  case ImageFormat::PFM:
+    header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    break;
+  case ImageFormat::QOI:
+  {
+    uint8_t qoi[14] = { 'q', 'o', 'i', 'f' };
+    PutBigEndian(qoi + 4, width);
+    PutBigEndian(qoi + 8, height);
+    qoi[12] = 3;
+    qoi[13] = options.encoding == ImageEncoding::SRGB ? 0 : 1;
+    header.assign((const char*)qoi, sizeof(qoi));
+    break;
+  }
+  default:
+    break;
+  }
+  file_.write(header.data(), header.size());
+  header_size_ = header.size();
+
+#ifdef RAYTRACER_WITH_PNG
+  if (format_ == ImageFormat::PNG)
+  {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    file_.write((const char*)signature, sizeof(signature));
+
+    uint8_t ihdr[13] = {};
+    PutBigEndian(ihdr, width);
+    PutBigEndian(ihdr + 4, height);
+    ihdr[8] = 8;      // Bits per channel
+    ihdr[9] = 2;      // RGB
+    WritePNGChunk("IHDR", ihdr, sizeof(ihdr));
+
+    // One zlib stream runs through every band
+    deflate_ = new z_stream();
+    if (deflateInit(deflate_, options.compression) != Z_OK)
+    {
+      LOG(ERROR) << "zlib failed to start for " << filename;
+      delete deflate_;
+      deflate_ = nullptr;
+      file_.close();
+      return false;
+    }
+    previous_row_.clear();
+  }
+#endif
+
+  return bool(file_);
+}
+
+bool ImageStreamWriter::write_rows(const float* rgb, int rows)
+{
+  if (!file_.is_open() || rows_written_ + rows > height_)
+  {
+    LOG(ERROR) << "Too many rows written to " << filename_;
+    return false;
+  }
+
+  size_t stride = (size_t)width_ * 3;
+  if (format_ != ImageFormat::PFM)
+  {
+    rgb_.resize(stride * rows);
+    EncodePixels(rgb, 3, (size_t)width_ * rows, options_.encoding, rgb_.data());
+  }
+
+  switch (format_)
+  {
+  case ImageFormat::PPM:
+    file_.write((const char*)rgb_.data(), rgb_.size());
+    break;
+  case ImageFormat::PFM:
+  {
+    // These rows end up as one block of the file, last row first
+    flipped_.resize(stride * rows);
+    for (int y = 0; y < rows; ++y)
+      std::memcpy(&flipped_[(rows - 1 - y) * stride], rgb + y * stride, stride * sizeof(float));
+
+    size_t row = height_ - (rows_written_ + rows);
+    file_.seekp(header_size_ + row * stride * sizeof(float));
+    file_.write((const char*)flipped_.data(), flipped_.size() * sizeof(float));
+    break;
+  }
+  case ImageFormat::QOI:
+    // Bands are independent strips, see EncodeQOIStrip
+    EncodeQOIStrip(rgb_.data(), width_, 0, rows, encoded_);
+    file_.write((const char*)encoded_.data(), encoded_.size());
+    break;
+#ifdef RAYTRACER_WITH_PNG
+  case ImageFormat::PNG:
+  {
+    std::vector<uint8_t> filtered((stride + 1) * rows);
+    for (int y = 0; y < rows; ++y)
+    {
+      const uint8_t* above = (y > 0) ? &rgb_[(y - 1) * stride]
+                                     : (previous_row_.empty() ? nullptr : previous_row_.data());
+      FilterUp(&rgb_[y * stride], above, stride, &filtered[y * (stride + 1)]);
+    }
+    previous_row_.assign(rgb_.end() - stride, rgb_.end());
+
+    if (!DeflateRows(filtered.data(), filtered.size(), false))
+      return false;
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  rows_written_ += rows;
+  if (!file_)
+  {
+    LOG(ERROR) << "Failed writing " << filename_;
+    return false;
+  }
+  return true;
+}
+
+bool ImageStreamWriter::close()
+{
+  if (!file_.is_open())
+    return false;
+
+  bool ok = true;
+  if (rows_written_ != height_)
+  {
+    LOG(ERROR) << filename_ << " closed with " << rows_written_ << " of " << height_ << " rows";
+    ok = false;
+  }
+
+  if (format_ == ImageFormat::QOI)
+  {
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    file_.write((const char*)padding, sizeof(padding));
+  }
+
+#ifdef RAYTRACER_WITH_PNG
+  if (deflate_)
+  {
+    ok = DeflateRows(nullptr, 0, true) && ok;
+    WritePNGChunk("IEND", nullptr, 0);
+    deflateEnd(deflate_);
+    delete deflate_;
+    deflate_ = nullptr;
+  }
+#endif
+
+  file_.close();
+  if (!file_)
+  {
+    LOG(ERROR) << "Failed writing " << filename_;
+    ok = false;
+  }
+  return ok;
+}
+
+#ifdef RAYTRACER_WITH_PNG
+// Only PNG files need these, open turns those away without zlib
+bool ImageStreamWriter::WritePNGChunk(const char* type, const uint8_t* data, size_t size)
+{
+  uint8_t length[4], crc[4];
+  PutBigEndian(length, (uint32_t)size);
+  uLong checksum = crc32(crc32(0, nullptr, 0), (const Bytef*)type, 4);
+  if (size > 0)
+    checksum = crc32(checksum, data, (uInt)size);
+  PutBigEndian(crc, (uint32_t)checksum);
+
+  file_.write((const char*)length, 4);
+  file_.write(type, 4);
+  file_.write((const char*)data, size);
+  file_.write((const char*)crc, 4);
+  return bool(file_);
+}
+
+bool ImageStreamWriter::DeflateRows(const uint8_t* data, size_t size, bool finish)
+{
+  deflate_->next_in = (Bytef*)data;
+  deflate_->avail_in = (uInt)size;
+
+  // Whatever zlib hands back becomes one IDAT chunk
+  encoded_.clear();
+  uint8_t out[1 << 16];
+  int result;
+  do
+  {
+    deflate_->next_out = out;
+    deflate_->avail_out = sizeof(out);
+    result = deflate(deflate_, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (result == Z_STREAM_ERROR)
+    {
+      LOG(ERROR) << "zlib failed compressing " << filename_;
+      return false;
+    }
+    encoded_.insert(encoded_.end(), out, out + sizeof(out) - deflate_->avail_out);
+  } while (deflate_->avail_out == 0 || (finish && result != Z_STREAM_END));
+
+  if (!encoded_.empty())
+    return WritePNGChunk("IDAT", encoded_.data(), encoded_.size());
+  return true;
+}
+#endif /* RAYTRACER_WITH_PNG */
+
+} // end of namespace raytracer
@@ -0,0 +1,135 @@
+/**
+ *
+ *  filename : image_output.h
+ *  author   : Do Won Cha
+ *  content  : Writes frame buffers to disk. 8 bit formats go through a lookup
+ *             table encoder and one bulk write, PFM keeps the full floats.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_IMAGE_OUTPUT_
+#define _RAY_IMAGE_OUTPUT_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "thread_pool.hpp"
+
+struct z_stream_s;
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// How linear buffer values map to 8 bit channels
+enum class ImageEncoding
+{
+  Linear,     // Clamp and scale, what the viewer shows
+  SRGB        // sRGB transfer curve
+};
+
+enum class ImageFormat
+{
+  Unknown,
+  PPM,
+  PFM,
+  QOI,
+  PNG
+};
+
+// Format by file extension, case does not matter
+ImageFormat ImageFormatFromFilename(const std::string& filename);
+
+struct ImageOutputOptions
+{
+  ImageEncoding encoding;
+  ThreadPool* pool;       // Encodes strips of rows in parallel when set
+  int compression;        // zlib level for PNG, 0 - 9
+
+  ImageOutputOptions() :
+    encoding(ImageEncoding::Linear), pool(nullptr), compression(6)
+  {}
+};
+
+/**
+ *  Convert a top row first buffer to packed 8 bit RGB.
+ *  @param out resized to width * height * 3
+ */
+void EncodeRGB8(const std::vector<Vector4f>& buffer, int width, int height,
+                const ImageOutputOptions& options, std::vector<uint8_t>& out);
+
+// Binary P6
+bool WritePPM(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options = ImageOutputOptions());
+
+// Portable float map, unclamped linear RGB for the accumulated result
+bool WritePFM(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height);
+
+// Quite OK image format, lossless and a lot faster to encode than PNG
+bool WriteQOI(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options = ImageOutputOptions());
+
+// Fails with an error when built without zlib
+bool WritePNG(const std::string& filename, const std::vector<Vector4f>& buffer,
+              int width, int height, const ImageOutputOptions& options = ImageOutputOptions());
+
+// Picks the format from the extension: .ppm, .pfm, .qoi or .png
+bool WriteImage(const std::string& filename, const std::vector<Vector4f>& buffer,
+                int width, int height, const ImageOutputOptions& options = ImageOutputOptions());
+
+/**
+ *  Writes an image a band of rows at a time, for frames that are never in
+ *  memory whole. Rows have to come top to bottom, and are encoded on the
+ *  calling thread, options.pool is not used.
+ */
+class ImageStreamWriter
+{
+public:
+  ImageStreamWriter();
+  ~ImageStreamWriter();
+
+  ImageStreamWriter(const ImageStreamWriter&) = delete;
+  ImageStreamWriter& operator=(const ImageStreamWriter&) = delete;
+
+  // Format by extension, same as WriteImage. Writes the header.
+  bool open(const std::string& filename, int width, int height,
+            const ImageOutputOptions& options = ImageOutputOptions());
+
+  // The next rows of the image, rows * width RGB floats
+  bool write_rows(const float* rgb, int rows);
+
+  // Finish the file, false if anything failed or rows are missing
+  bool close();
+
+  int rows_written() const { return rows_written_; }
+private:
+  bool WritePNGChunk(const char* type, const uint8_t* data, size_t size);
+
+  // Deflate whatever is queued, finish ends the zlib stream
+  bool DeflateRows(const uint8_t* data, size_t size, bool finish);
+private:
+  std::string filename_;
+  std::ofstream file_;
+  ImageFormat format_;
+  ImageOutputOptions options_;
+  int width_, height_;
+  int rows_written_;
+  size_t header_size_;
+
+  std::vector<uint8_t> rgb_;              // Rows of the current call in 8 bit
+  std::vector<uint8_t> encoded_;          // Bytes on their way to the file
+  std::vector<uint8_t> previous_row_;     // PNG filters against the row above
+  std::vector<float> flipped_;            // PFM stores rows bottom up
+  z_stream_s* deflate_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_IMAGE_OUTPUT_ */
@@ -0,0 +1,157 @@
+/**
+ *
+ *  filename : light_tree.hpp
+ *  author   : Do Won Cha
+ *  content  : Bounding volume hierarchy over the influence spheres of the
+ *             point lights, finds the lights that can reach a point.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_LIGHT_TREE_
+#define _RAY_LIGHT_TREE_
+
+#include <algorithm>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "primitives/light.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+class LightTree
+{
+  struct TreeNode
+  {
+    Vector3f min, max;        // Bounds of every influence sphere below
+    int left, right;          // Children, -1 for leaves
+    int first, count;         // Range of bounded_ for leaves
+  };
+
+  // Leaves hold at most this many lights
+  static const int kLeafSize = 4;
+public:
+  LightTree() {}
+
+  /**
+   *  Index every light. Lights without a range reach everything and are
+   *  always returned, the others go in the tree.
+   */
+  void build(const std::list<std::unique_ptr<Light>>& lights)
+  {
+    lights_.clear();
+    global_.clear();
+    bounded_.clear();
+    nodes_.clear();
+
+    for (const std::unique_ptr<Light>& light : lights)
+    {
+      int index = (int)lights_.size();
+      lights_.push_back(light.get());
+
+      if (light->bounded())
+        bounded_.push_back(index);
+      else
+        global_.push_back(index);
+    }
+
+    if (!bounded_.empty())
+      BuildNode(0, (int)bounded_.size());
+  }
+
+  int size() const { return (int)lights_.size(); }
+  Light* light(int index) const { return lights_[index]; }
+
+  // Indices of every light whose influence reaches point
+  void Query(const Vector3f& point, std::vector<int>& out) const
+  {
+    out.assign(global_.begin(), global_.end());
+    if (nodes_.empty())
+      return;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+      const TreeNode& node = nodes_[stack[--top]];
+
+      if ((point.array() < node.min.array()).any() ||
+          (point.array() > node.max.array()).any())
+        continue;
+
+      if (node.left < 0)
+      {
+        for (int i = node.first; i < node.first + node.count; ++i)
+        {
+          const Light* light = lights_[bounded_[i]];
+          if ((light->position() - point).squaredNorm() < light->range_ * light->range_)
+            out.push_back(bounded_[i]);
+        }
+      }
+      else
+      {
+        stack[top++] = node.left;
+        stack[top++] = node.right;
+      }
+    }
+  }
+private:
+  // Builds the node for bounded_[first, last), returns its index
+  int BuildNode(int first, int last)
+  {
+    int index = (int)nodes_.size();
+    nodes_.push_back(TreeNode());
+
+    Vector3f min = Vector3f::Constant(std::numeric_limits<float>::max());
+    Vector3f max = Vector3f::Constant(-std::numeric_limits<float>::max());
+    for (int i = first; i < last; ++i)
+    {
+      const Light* light = lights_[bounded_[i]];
+      min = min.cwiseMin(light->position() - Vector3f::Constant(light->range_));
+      max = max.cwiseMax(light->position() + Vector3f::Constant(light->range_));
+    }
+
+    nodes_[index].min = min;
+    nodes_[index].max = max;
+    nodes_[index].left = nodes_[index].right = -1;
+    nodes_[index].first = first;
+    nodes_[index].count = last - first;
+
+    if (last - first <= kLeafSize)
+      return index;
+
+    // Median split of the light positions along the longest axis
+    int axis;
+    (max - min).maxCoeff(&axis);
+    int middle = (first + last) / 2;
+    std::nth_element(bounded_.begin() + first, bounded_.begin() + middle, bounded_.begin() + last,
+      [this, axis](int a, int b) {
+        return lights_[a]->position()(axis) < lights_[b]->position()(axis);
+      });
+
+    int left = BuildNode(first, middle);
+    int right = BuildNode(middle, last);
+    nodes_[index].left = left;
+    nodes_[index].right = right;
+
+    return index;
+  }
+private:
+  std::vector<Light*> lights_;      // Every light, in scene order
+  std::vector<int> global_;         // Lights without a range
+  std::vector<int> bounded_;        // Lights in the tree, leaves own ranges of it
+  std::vector<TreeNode> nodes_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_LIGHT_TREE_ */
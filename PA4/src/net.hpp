@@ -0,0 +1,316 @@
+/**
+ *
+ *  filename : net.hpp
+ *  author   : Do Won Cha
+ *  content  : Sockets and length prefixed messages, just enough for render
+ *             processes to talk to each other.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_NET_
+#define _RAY_NET_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "easylogging++.h"
+
+namespace raytracer
+{
+
+/**
+ *  Addresses are "unix:/path/to/socket" for processes on one machine, or
+ *  "host:port" for TCP. Listening on TCP with an empty host takes every
+ *  interface.
+ */
+namespace net_detail
+{
+
+inline bool IsUnix(const std::string& address)
+{
+  return address.compare(0, 5, "unix:") == 0;
+}
+
+inline bool FillUnix(const std::string& address, sockaddr_un& unixAddress)
+{
+  std::string path = address.substr(5);
+  std::memset(&unixAddress, 0, sizeof(unixAddress));
+  unixAddress.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(unixAddress.sun_path))
+  {
+    LOG(ERROR) << "Bad unix socket path: " << address;
+    return false;
+  }
+  std::memcpy(unixAddress.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// getaddrinfo for host:port, the caller frees the list
+inline addrinfo* Resolve(const std::string& address, bool passive)
+{
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos)
+  {
+    LOG(ERROR) << "Address needs a port: " << address;
+    return nullptr;
+  }
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+  addrinfo* list = nullptr;
+  int result = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list);
+  if (result != 0)
+  {
+    LOG(ERROR) << "Could not resolve " << address << ": " << gai_strerror(result);
+    return nullptr;
+  }
+  return list;
+}
+
+// Small messages go out right away instead of waiting for Nagle
+inline void SetNoDelay(int socket)
+{
+  int on = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+} // end of namespace net_detail
+
+// Socket accepting connections on address, -1 on failure
+inline int ListenSocket(const std::string& address)
+{
+  using namespace net_detail;
+
+  if (IsUnix(address))
+  {
+    sockaddr_un unixAddress;
+    if (!FillUnix(address, unixAddress))
+      return -1;
+
+    // A socket file left behind by an earlier run would block the bind
+    unlink(unixAddress.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&unixAddress, sizeof(unixAddress)) != 0 || listen(fd, 64) != 0)
+    {
+      LOG(ERROR) << "Could not listen on " << address << ": " << std::strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo* list = Resolve(address, true);
+  for (addrinfo* entry = list; entry; entry = entry->ai_next)
+  {
+    int fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, entry->ai_addr, entry->ai_addrlen) == 0 && listen(fd, 64) == 0)
+    {
+      freeaddrinfo(list);
+      return fd;
+    }
+    close(fd);
+  }
+
+  LOG(ERROR) << "Could not listen on " << address << ": " << std::strerror(errno);
+  if (list)
+    freeaddrinfo(list);
+  return -1;
+}
+
+// Connected socket, -1 on failure
+inline int ConnectSocket(const std::string& address)
+{
+  using namespace net_detail;
+
+  if (IsUnix(address))
+  {
+    sockaddr_un unixAddress;
+    if (!FillUnix(address, unixAddress))
+      return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&unixAddress, sizeof(unixAddress)) != 0)
+    {
+      LOG(ERROR) << "Could not connect to " << address << ": " << std::strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo* list = Resolve(address, false);
+  for (addrinfo* entry = list; entry; entry = entry->ai_next)
+  {
+    int fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    if (connect(fd, entry->ai_addr, entry->ai_addrlen) == 0)
+    {
+      freeaddrinfo(list);
+      SetNoDelay(fd);
+      return fd;
+    }
+    close(fd);
+  }
+
+  LOG(ERROR) << "Could not connect to " << address << ": " << std::strerror(errno);
+  if (list)
+    freeaddrinfo(list);
+  return -1;
+}
+
+// Accept a pending connection, -1 on failure
+inline int AcceptSocket(int listener)
+{
+  int fd = accept(listener, nullptr, nullptr);
+  if (fd >= 0)
+    net_detail::SetNoDelay(fd);     // Fails harmlessly on unix sockets
+  return fd;
+}
+
+/**
+ *  Payload of a message, values are appended and read back in the same
+ *  order. Everything is sent in host byte order, every machine of a render
+ *  farm is expected to be little endian.
+ */
+class MessageBuffer
+{
+public:
+  MessageBuffer() : read_(0) {}
+
+  template<typename T>
+  void put(const T& value) { put_bytes(&value, sizeof(T)); }
+
+  void put_bytes(const void* data, size_t size)
+  {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+
+  void put_string(const std::string& text)
+  {
+    put<uint32_t>((uint32_t)text.size());
+    put_bytes(text.data(), text.size());
+  }
+
+  // False once the payload runs out, the value is left alone then
+  template<typename T>
+  bool get(T& value) { return get_bytes(&value, sizeof(T)); }
+
+  bool get_bytes(void* data, size_t size)
+  {
+    if (read_ + size > data_.size())
+      return false;
+    std::memcpy(data, data_.data() + read_, size);
+    read_ += size;
+    return true;
+  }
+
+  bool get_string(std::string& text)
+  {
+    uint32_t size = 0;
+    if (!get(size) || read_ + size > data_.size())
+      return false;
+    text.assign((const char*)data_.data() + read_, size);
+    read_ += size;
+    return true;
+  }
+
+  std::vector<uint8_t>& data() { return data_; }
+  const std::vector<uint8_t>& data() const { return data_; }
+
+  void clear() { data_.clear(); read_ = 0; }
+private:
+  std::vector<uint8_t> data_;
+  size_t read_;
+};
+
+namespace net_detail
+{
+
+inline bool SendAll(int socket, const void* data, size_t size)
+{
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0)
+  {
+    ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+inline bool ReceiveAll(int socket, void* data, size_t size)
+{
+  char* bytes = static_cast<char*>(data);
+  while (size > 0)
+  {
+    ssize_t received = recv(socket, bytes, size, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+// Anything bigger is a corrupt stream, not a message
+const uint32_t kMaxMessageSize = 1u << 30;
+
+} // end of namespace net_detail
+
+// Message is a type and a payload, false when the connection is gone
+inline bool SendMessage(int socket, uint32_t type, const MessageBuffer& payload)
+{
+  uint32_t header[2] = { type, (uint32_t)payload.data().size() };
+  return net_detail::SendAll(socket, header, sizeof(header)) &&
+         net_detail::SendAll(socket, payload.data().data(), payload.data().size());
+}
+
+inline bool ReceiveMessage(int socket, uint32_t& type, MessageBuffer& payload)
+{
+  uint32_t header[2];
+  if (!net_detail::ReceiveAll(socket, header, sizeof(header)) || header[1] > net_detail::kMaxMessageSize)
+    return false;
+
+  type = header[0];
+  payload.clear();
+  payload.data().resize(header[1]);
+  return net_detail::ReceiveAll(socket, payload.data().data(), header[1]);
+}
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_NET_ */
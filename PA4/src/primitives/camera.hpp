@@ -11,9 +11,11 @@
 #define _RAY_CAMERA_
 
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <cassert>
 
 #include "ray.hpp"
+#include "../ray_buffer.hpp"
 #include "../utility.h"
 
 namespace raytracer
@@ -25,17 +27,19 @@ class Camera
 {
 public:
   Camera() :
-    position  (0.0f, 0.0f, 0.0f),
+    position_  (0.0f, 0.0f, 0.0f),
     target_    (0.0f, 0.0f, -1.0f),
     right_     (1.0f, 0.0f, 0.0f),
     up_        (0.0f, 1.0f, 0.0f),
     forward_   (0.0f, 0.0f, 1.0f),
-    l(-0.1f), r(0.1f), t(0.1f), b(-0.1f), d(0.1f)
+    l(-0.1f), r(0.1f), t(0.1f), b(-0.1f), d(0.1f),
+    screen_width_(0),
+    screen_height_(0)
   {
   }
 
   Camera(int width, int height) :
-    position  (0.0f, 0.0f, 0.0f),
+    position_  (0.0f, 0.0f, 0.0f),
     target_    (0.0f, 0.0f, -1.0f),
     right_     (1.0f, 0.0f, 0.0f),
     up_        (0.0f, 1.0f, 0.0f),
@@ -61,7 +65,7 @@ public:
     // forward_ is also negative
   	Vector3f dir = ((right_ * u) - (up_ * v) - (forward_ * d)).normalized();
 
-  	return Ray(position, dir);
+  	return Ray(position_, dir);
   }
 
   //
@@ -81,7 +85,98 @@ public:
 
     Vector3f dir = ((right_ * u) - (up_ * v) - (forward_ * d)).normalized();
 
-  	return Ray(position, dir);
+  	return Ray(position_, dir);
+  }
+
+  /**
+   *  Batch version of GetRayFromEye. The caller fills in pixel_x, pixel_y and
+   *  the offsets of the first buffer.size() rays in any sample pattern, this
+   *  fills in their origins, directions and inverse directions in one pass.
+   */
+  void GenerateRays(RayBuffer& buffer) const
+  {
+    const int count = buffer.size();
+
+    // Everything that doesn't change per ray is worked out once per batch
+    const float su = (r - l) / screen_width_;
+    const float sv = (t - b) / screen_height_;
+    const Vector3f toPlane = -forward_ * d;
+
+    const float* __restrict px = buffer.offset_x.data();
+    const float* __restrict py = buffer.offset_y.data();
+    float* __restrict ox = buffer.origin_x.data();
+    float* __restrict oy = buffer.origin_y.data();
+    float* __restrict oz = buffer.origin_z.data();
+    float* __restrict dx = buffer.direction_x.data();
+    float* __restrict dy = buffer.direction_y.data();
+    float* __restrict dz = buffer.direction_z.data();
+    float* __restrict ix = buffer.inverse_x.data();
+    float* __restrict iy = buffer.inverse_y.data();
+    float* __restrict iz = buffer.inverse_z.data();
+    const int* __restrict pixelx = buffer.pixel_x.data();
+    const int* __restrict pixely = buffer.pixel_y.data();
+
+    for (int i = 0; i < count; ++i)
+    {
+      float u = l + su * (pixelx[i] + (std::min)(1.0f, (std::max)(0.0f, px[i])));
+      float v = b + sv * (pixely[i] + (std::min)(1.0f, (std::max)(0.0f, py[i])));
+
+      // NOTE: same as GetRayFromEye, up is negated to put y = 0 at the top
+      float x = right_.x() * u - up_.x() * v + toPlane.x();
+      float y = right_.y() * u - up_.y() * v + toPlane.y();
+      float z = right_.z() * u - up_.z() * v + toPlane.z();
+      float invLength = 1.0f / std::sqrt(x * x + y * y + z * z);
+
+      dx[i] = x * invLength;
+      dy[i] = y * invLength;
+      dz[i] = z * invLength;
+      ix[i] = 1.0f / dx[i];
+      iy[i] = 1.0f / dy[i];
+      iz[i] = 1.0f / dz[i];
+      ox[i] = position_.x();
+      oy[i] = position_.y();
+      oz[i] = position_.z();
+    }
+  }
+
+  /**
+   *  Where point lands on the screen, inverse of GetRayFromEye. x and y are
+   *  in pixels with pixel centers at .5, false if point is behind us.
+   */
+  bool Project(const Vector3f& point, float& x, float& y) const
+  {
+    Vector3f view = ToView(point);
+    if (view.z() <= 0.0f)
+      return false;
+
+    ViewToScreen(view, x, y);
+    return true;
+  }
+
+  // point relative to the camera, x to the right, y down the screen and z
+  // the depth in front of us
+  Vector3f ToView(const Vector3f& point) const
+  {
+    Vector3f toPoint = point - position_;
+    return Vector3f(toPoint.dot(right_), -toPoint.dot(up_), -toPoint.dot(forward_));
+  }
+
+  // Where a point in view space with a positive depth lands, as Project
+  void ViewToScreen(const Vector3f& view, float& x, float& y) const
+  {
+    float scale = d / view.z();
+    float u = view.x() * scale;
+    float v = view.y() * scale;
+    x = (u - l) * screen_width_ / (r - l);
+    y = (v - b) * screen_height_ / (t - b);
+  }
+
+  // The screen position of a view space point times its depth, and the
+  // depth. Linear in the point, so lines can be cut before the divide.
+  Vector3f ViewToClip(const Vector3f& view) const
+  {
+    return Vector3f((view.x() * d - l * view.z()) * screen_width_ / (r - l),
+                    (view.y() * d - b * view.z()) * screen_height_ / (t - b), view.z());
   }
 
   void resize(int width, int height)
@@ -90,11 +185,24 @@ public:
     screen_height_ = height;
   }
 
+  // Moving the camera invalidates anything accumulated by the ray tracer
+  Vector3f position() const { return position_; }
+  void set_position(Vector3f position) { position_ = position; }
+
+  // Turn to face target from where we are, up only has to be roughly up
+  void look_at(const Vector3f& target, const Vector3f& up = Vector3f(0.0f, 1.0f, 0.0f))
+  {
+    target_ = target;
+    forward_ = (position_ - target).normalized();
+    right_ = up.cross(forward_).normalized();
+    up_ = forward_.cross(right_);
+  }
+
   int screen_width()  const { return screen_width_; }
   int screen_height() const { return screen_height_; }
 
 private:
-  Vector3f position;                // position vector
+  Vector3f position_;                // position vector
   Vector3f target_;                  // What are we looking at
   Vector3f forward_;                 // forward_ vector
   Vector3f up_;                      // up_ vector, typically y-axis
@@ -23,16 +23,35 @@ class Light : public Node
 public:
   Vector3f ambient_, diffuse_;
   float intensity_;
+  float range_;       // Influence radius, 0 lights the whole scene
 public:
   Light(Vector3f position,
         Vector3f ambient,
         Vector3f diffuse,
-        float intensity = 1.0f) :
-    Node(position_),
+        float intensity = 1.0f,
+        float range = 0.0f) :
+    Node(position),
     ambient_(ambient),
     diffuse_(diffuse),
-    intensity_(intensity)
+    intensity_(intensity),
+    range_(range)
   {}
+
+  bool bounded() const { return range_ > 0.0f; }
+
+  // Smooth falloff that reaches 0 at the range, lights without one don't fade
+  float attenuation(float distance) const
+  {
+    if (!bounded())
+      return 1.0f;
+
+    float x = distance / range_;
+    if (x >= 1.0f)
+      return 0.0f;
+
+    float falloff = 1.0f - x * x;
+    return falloff * falloff;
+  }
 };
 
 } // end of namespace raytracer
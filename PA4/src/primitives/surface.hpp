@@ -11,6 +11,9 @@
 
 #include <Eigen/Core>
 #include <string>
+#include <vector>
+
+#include "../fingerprint.hpp"
 
 namespace raytracer
 {
@@ -20,6 +23,9 @@ using namespace Eigen;
 class Surface;
 class Ray;
 
+// Hits closer than this are the surface the ray started from
+const float kRayEpsilon = 1e-4f;
+
 /**
  *	Hit data is returned upon call to IntersectSurfaces.
  */
@@ -70,7 +76,26 @@ public:
 
   virtual bool Intersect(const Ray& ray, HitData& hit) = 0;
 
-  virtual Vector3f normal() const;
+  // Surface normal at a point on the surface
+  virtual Vector3f normal(const Vector3f& point) const = 0;
+
+  // Add the kind of surface and everything that shapes it
+  virtual void fingerprint(Fingerprint& print) const = 0;
+
+  // Box around all of the surface, false if it has no end
+  virtual bool bounds(Vector3f& min, Vector3f& max) const = 0;
+
+  /**
+   *  Add triangles for the rasterizer, three corners each, as seen from
+   *  eye. Every ray from eye that hits the surface within the default
+   *  tMax crosses a bounds triangle no further than the hit, and every ray
+   *  that crosses a solid triangle has hit the surface by then. Solid may
+   *  be left empty. False if the surface cannot be drawn that way.
+   */
+  virtual bool tessellate(const Vector3f&, std::vector<Vector3f>&, std::vector<Vector3f>&) const
+  {
+    return false;
+  }
 
   void set_material(std::string material_name) { material_name_ = material_name; }
   std::string material() const { return material_name_; }
@@ -2,6 +2,9 @@
 #ifndef _RAY_SURFACE_
 #define _RAY_SURFACE_
 
+#include <cmath>
+#include <vector>
+
 #include <Eigen/Core>
 #include "surface.hpp"
 #include "ray.hpp"
@@ -34,11 +37,12 @@ public:
     {
       // Time of intersection with the plane
       float planeHitTime = normal_.dot(position_ - ray.position()) / denom;
-      if (planeHitTime >= 0.0f)
+      if (planeHitTime > kRayEpsilon && planeHitTime < hit.tMax)
       {
-        hit.hit_surface = dynamic_cast<Surface*>(this);
-        hit.hit_point = ray.evaluate(hit.t);
+        hit.hit_surface = this;
         hit.t = planeHitTime;
+        hit.hit_point = ray.evaluate(hit.t);
+        hit.normal = normal_;
         return true;
       }
     }
@@ -46,10 +50,39 @@ public:
     return false;
   }
 
-  Vector3f normal() const override
+  Vector3f normal(const Vector3f& point) const override
   {
     return normal_;
   }
+
+  void fingerprint(Fingerprint& print) const override
+  {
+    print.add(std::string("plane"));
+    print.add(position_);
+    print.add(normal_);
+    print.add(material_name_);
+  }
+
+  bool bounds(Vector3f&, Vector3f&) const override
+  {
+    return false;
+  }
+
+  // A square around the point below eye, twice the default tMax either way,
+  // wider than anything a ray reaches before it gives up
+  bool tessellate(const Vector3f& eye, std::vector<Vector3f>& bounds, std::vector<Vector3f>& solid) const override
+  {
+    const float extent = 2.0f * HitData().tMax;
+    Vector3f side = normal_.cross(std::fabs(normal_.x()) < 0.9f ? Vector3f::UnitX() : Vector3f::UnitY());
+    Vector3f u = side.normalized() * extent, v = normal_.cross(side.normalized()) * extent;
+    Vector3f center = eye - normal_ * normal_.dot(eye - position_);
+
+    Vector3f a = center - u - v, b = center + u - v;
+    Vector3f c = center - u + v, d = center + u + v;
+    bounds.insert(bounds.end(), { a, b, c, c, b, d });
+    solid.insert(solid.end(), { a, b, c, c, b, d });
+    return true;
+  }
 private:
   Vector3f normal_;
 };
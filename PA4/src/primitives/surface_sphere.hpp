@@ -2,7 +2,12 @@
 #ifndef _RAY_SPHERE_
 #define _RAY_SPHERE_
 
+#include <cmath>
+#include <vector>
+
 #include <Eigen/Core>
+#include "surface.hpp"
+#include "ray.hpp"
 
 using namespace Eigen;
 
@@ -36,20 +41,78 @@ public:
       {
         float q = std::sqrt(radius2_ - m2);
 
-        hit.t = (length2 > radius2_) ? s - q : s + q;
-        hit.hit_point = ray.evaluate(hit.t);
+        float t = (length2 > radius2_) ? s - q : s + q;
+        if (t <= kRayEpsilon || t >= hit.tMax)
+          return false;
+
+        hit.t = t;
+        hit.hit_point = ray.evaluate(t);
+        hit.normal = normal(hit.hit_point);
+        hit.hit_surface = this;
 
-        return (hit.t > 0.0f && hit.t < hit.tMax);
+        return true;
       }
     }
 
     return false;
   }
 
-  Vector3f normal(const Vector3f& point) const
+  Vector3f normal(const Vector3f& point) const override
   {
     return (point - position_).normalized();
   }
+
+  void fingerprint(Fingerprint& print) const override
+  {
+    print.add(std::string("sphere"));
+    print.add(position_);
+    print.add(radius_);
+    print.add(material_name_);
+  }
+
+  bool bounds(Vector3f& min, Vector3f& max) const override
+  {
+    min = position_ - Vector3f::Constant(radius_);
+    max = position_ + Vector3f::Constant(radius_);
+    return true;
+  }
+
+  bool tessellate(const Vector3f& eye, std::vector<Vector3f>& bounds, std::vector<Vector3f>& solid) const override
+  {
+    const int kRings = 12, kSegments = 24;
+    const float pi = 3.14159265f;
+    const float ringStep = pi / kRings, segmentStep = 2.0f * pi / kSegments;
+
+    // Bounds far enough out that the flat faces clear the sphere, no point
+    // of a face is further from its corners than the cell diagonal. Solid
+    // has its corners on the sphere and stays inside.
+    const float outside = radius_ / std::cos(std::sqrt(ringStep * ringStep + segmentStep * segmentStep));
+
+    // From inside the bounds a ray leaves through a face behind its hit
+    if ((eye - position_).norm() <= outside)
+      return false;
+
+    auto mesh = [&](float radius, std::vector<Vector3f>& triangles) {
+      auto corner = [&](int ring, int segment) {
+        float theta = ring * ringStep, phi = segment * segmentStep;
+        return Vector3f(position_ + radius * Vector3f(std::sin(theta) * std::cos(phi), std::cos(theta),
+                                                      std::sin(theta) * std::sin(phi)));
+      };
+
+      for (int ring = 0; ring < kRings; ++ring)
+      {
+        for (int segment = 0; segment < kSegments; ++segment)
+        {
+          Vector3f a = corner(ring, segment), b = corner(ring, segment + 1);
+          Vector3f c = corner(ring + 1, segment), d = corner(ring + 1, segment + 1);
+          triangles.insert(triangles.end(), { a, c, b, b, c, d });
+        }
+      }
+    };
+    mesh(outside, bounds);
+    mesh(radius_, solid);
+    return true;
+  }
 private:
   float radius_, radius2_;
 };
@@ -0,0 +1,306 @@
+/**
+ *
+ *  filename : rasterizer.cpp
+ *  author   : Do Won Cha
+ *  content  : Software rasterizer for primary visibility, see rasterizer.h
+ *
+ */
+
+#include "rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace raytracer
+{
+
+namespace
+{
+
+// Triangles are cut where they come closer to the camera than this
+const float kNearDepth = 1e-3f;
+
+// Pixels past the edges of the screen triangles are cut at, keeps screen
+// coordinates small enough for float edge functions
+const float kGuardBand = 1.0f;
+
+// Share of a pixel that coverage tests give away to rounding, and of a
+// depth that depth tests do
+const float kEdgeSlack = 0.01f;
+const float kDepthSlack = 1e-3f;
+
+// Rows drawn together, the unit of work handed to the pool
+const int kStripRows = 16;
+
+// A triangle projected to the screen, ready for its edge functions
+struct ScreenTriangle
+{
+  Vector2f corners[3];
+  float margins[3];           // Most an edge function changes from a pixel center to a corner
+  Vector3f inverse_depth;     // 1 / depth = x * x() + y * y() + z(), linear across the screen
+  float depth_margin;
+  float min_x, max_x, min_y, max_y;
+  int surface;
+};
+
+// Twice the signed area of a, b, c, positive when they turn clockwise on
+// the screen. Zero on the edge a b.
+float Orient2D(const Vector2f& a, const Vector2f& b, const Vector2f& c)
+{
+  return (b.x() - a.x()) * (c.y() - a.y()) - (b.y() - a.y()) * (c.x() - a.x());
+}
+
+// Cut the polygon of count corners, screen position times depth and depth
+// as Camera::ViewToClip gives them, to where plane is not negative
+int ClipPolygon(const Vector3f* in, int count, const Vector3f& plane, float offset, Vector3f* out)
+{
+  int kept = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    const Vector3f& a = in[i];
+    const Vector3f& b = in[(i + 1) % count];
+    float da = plane.dot(a) + offset, db = plane.dot(b) + offset;
+    if (da >= 0.0f)
+      out[kept++] = a;
+    if ((da >= 0.0f) != (db >= 0.0f))
+      out[kept++] = a + (b - a) * (da / (da - db));
+  }
+  return kept;
+}
+
+// Project a, b, c and add them if they are on the screen at all
+void AddTriangle(const Vector3f& a, const Vector3f& b, const Vector3f& c, int surface, int width, int height,
+                 std::vector<ScreenTriangle>& triangles)
+{
+  ScreenTriangle triangle;
+  const Vector3f* corners[3] = { &a, &b, &c };
+  float inverseDepths[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    inverseDepths[i] = 1.0f / corners[i]->z();
+    triangle.corners[i] = corners[i]->head<2>() * inverseDepths[i];
+  }
+
+  float area = Orient2D(triangle.corners[0], triangle.corners[1], triangle.corners[2]);
+  if (area == 0.0f)
+    return;
+
+  // Either way around, a triangle seen from behind still hides what is
+  // behind it
+  if (area < 0.0f)
+  {
+    std::swap(triangle.corners[1], triangle.corners[2]);
+    std::swap(inverseDepths[1], inverseDepths[2]);
+    area = -area;
+  }
+
+  const Vector2f* p = triangle.corners;
+  for (int i = 0; i < 3; ++i)
+  {
+    Vector2f edge = p[(i + 2) % 3] - p[(i + 1) % 3];
+    triangle.margins[i] = 0.5f * (std::abs(edge.x()) + std::abs(edge.y()));
+  }
+
+  // The plane through the three inverse depths
+  float d1 = inverseDepths[1] - inverseDepths[0], d2 = inverseDepths[2] - inverseDepths[0];
+  Vector2f e1 = p[1] - p[0], e2 = p[2] - p[0];
+  float dx = (d1 * e2.y() - d2 * e1.y()) / area;
+  float dy = (d2 * e1.x() - d1 * e2.x()) / area;
+  triangle.inverse_depth = Vector3f(dx, dy, inverseDepths[0] - dx * p[0].x() - dy * p[0].y());
+  triangle.depth_margin = 0.5f * (std::abs(dx) + std::abs(dy));
+
+  triangle.min_x = (std::max)(0.0f, (std::min)({ p[0].x(), p[1].x(), p[2].x() }));
+  triangle.max_x = (std::min)((float)width, (std::max)({ p[0].x(), p[1].x(), p[2].x() }));
+  triangle.min_y = (std::max)(0.0f, (std::min)({ p[0].y(), p[1].y(), p[2].y() }));
+  triangle.max_y = (std::min)((float)height, (std::max)({ p[0].y(), p[1].y(), p[2].y() }));
+  if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y)
+    return;
+
+  triangle.surface = surface;
+  triangles.push_back(triangle);
+}
+
+// Cut the polygon of count corners to where every one of planes, with
+// its offset, is not negative. Returns the corners left.
+int ClipPolygon(Vector3f* polygon, int count, const Vector3f* planes, const float* offsets, int planeCount)
+{
+  Vector3f cut[8];
+  for (int k = 0; k < planeCount && count >= 3; ++k)
+  {
+    count = ClipPolygon(polygon, count, planes[k], offsets[k], cut);
+    std::copy(cut, cut + count, polygon);
+  }
+  return count;
+}
+
+// Cut the world space triangles of surface to the screen and add them,
+// false if one is on screen closer than the cut
+bool AddTriangles(const std::vector<Vector3f>& corners, int surface, const Camera& camera,
+                  std::vector<ScreenTriangle>& triangles)
+{
+  const float width = (float)camera.screen_width(), height = (float)camera.screen_height();
+
+  // Left, right, top and bottom past the guard band, then in front of and
+  // behind the near plane
+  const Vector3f planes[6] = { Vector3f(1.0f, 0.0f, kGuardBand), Vector3f(-1.0f, 0.0f, width + kGuardBand),
+                               Vector3f(0.0f, 1.0f, kGuardBand), Vector3f(0.0f, -1.0f, height + kGuardBand),
+                               Vector3f(0.0f, 0.0f, 1.0f), Vector3f(0.0f, 0.0f, -1.0f) };
+  const float offsets[6] = { 0.0f, 0.0f, 0.0f, 0.0f, -kNearDepth, kNearDepth };
+
+  for (size_t i = 0; i + 2 < corners.size(); i += 3)
+  {
+    // Every cut adds at most one corner
+    Vector3f polygon[8], sliver[8];
+    for (int k = 0; k < 3; ++k)
+      polygon[k] = camera.ViewToClip(camera.ToView(corners[i + k]));
+
+    // Rays could hit what the near plane cuts off, unless it is off screen
+    if ((std::min)({ polygon[0].z(), polygon[1].z(), polygon[2].z() }) < kNearDepth)
+    {
+      std::copy(polygon, polygon + 3, sliver);
+      const float front[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, kNearDepth };
+      if (ClipPolygon(sliver, 3, planes, front, 6) >= 3)
+        return false;
+    }
+
+    int count = ClipPolygon(polygon, 3, planes, offsets, 5);
+
+    for (int k = 1; k + 1 < count; ++k)
+      AddTriangle(polygon[0], polygon[k], polygon[k + 1], surface, camera.screen_width(), camera.screen_height(),
+                  triangles);
+  }
+  return true;
+}
+
+// Call covered(triangle, pixel, depth) for every pixel of the strip that
+// the triangle covers all of when inside, any of otherwise. depth is the
+// furthest the triangle is over the pixel when inside, the nearest otherwise.
+template <typename Covered>
+void DrawStrip(const std::vector<ScreenTriangle>& triangles, bool inside, int width, int first, int last,
+               Covered covered)
+{
+  const float side = inside ? -(1.0f + kEdgeSlack) : 1.0f + kEdgeSlack;
+  for (const ScreenTriangle& triangle : triangles)
+  {
+    if (triangle.max_y < first || triangle.min_y > last)
+      continue;
+
+    // Pixels whose squares meet the bounding box, rows of this strip only
+    int x0 = (std::max)(0, (int)std::floor(triangle.min_x) - 1);
+    int x1 = (std::min)(width - 1, (int)std::ceil(triangle.max_x));
+    int y0 = (std::max)(first, (int)std::floor(triangle.min_y) - 1);
+    int y1 = (std::min)(last - 1, (int)std::ceil(triangle.max_y));
+
+    const Vector2f* c = triangle.corners;
+    for (int y = y0; y <= y1; ++y)
+    {
+      for (int x = x0; x <= x1; ++x)
+      {
+        // Edge functions at the center, pushed out to the corner furthest
+        // inside or pulled in to the one furthest outside
+        Vector2f center(x + 0.5f, y + 0.5f);
+        if (Orient2D(c[1], c[2], center) + side * triangle.margins[0] < 0.0f ||
+            Orient2D(c[2], c[0], center) + side * triangle.margins[1] < 0.0f ||
+            Orient2D(c[0], c[1], center) + side * triangle.margins[2] < 0.0f)
+          continue;
+
+        float inverseDepth = triangle.inverse_depth.x() * center.x() + triangle.inverse_depth.y() * center.y() +
+                             triangle.inverse_depth.z();
+        inverseDepth += inside ? -triangle.depth_margin : triangle.depth_margin;
+
+        // Up to the horizon of its plane, the far corner may be past it
+        float depth = inside ? std::numeric_limits<float>::infinity() : 0.0f;
+        if (inverseDepth > 0.0f)
+          depth = 1.0f / inverseDepth;
+        covered(triangle, (size_t)y * width + x, depth);
+      }
+    }
+  }
+}
+
+} // end of anonymous namespace
+
+bool RasterizeVisibility(const std::vector<Surface*>& surfaces, const Camera& camera, ThreadPool* pool,
+                         VisibilityBuffer& out)
+{
+  const int width = camera.screen_width(), height = camera.screen_height();
+  out = VisibilityBuffer();
+
+  // Every surface as triangles cut to the screen and projected
+  std::vector<ScreenTriangle> bounds, solid;
+  std::vector<Vector3f> boundCorners, solidCorners;
+  for (int s = 0; s < (int)surfaces.size(); ++s)
+  {
+    boundCorners.clear();
+    solidCorners.clear();
+    if (!surfaces[s]->tessellate(camera.position(), boundCorners, solidCorners) ||
+        !AddTriangles(boundCorners, s, camera, bounds))
+      return false;
+    AddTriangles(solidCorners, s, camera, solid);
+  }
+
+  const size_t pixels = (size_t)width * height;
+  const float infinity = std::numeric_limits<float>::infinity();
+  out.width = width;
+  out.height = height;
+  out.near_depths.assign(pixels, infinity);
+  out.solid_depths.assign(pixels, infinity);
+  out.solid_surfaces.assign(pixels, -1);
+  out.candidates.assign(pixels * kMaxCandidates, -1);
+  out.candidate_depths.assign(pixels * kMaxCandidates, infinity);
+  out.counts.assign(pixels, 0);
+
+  ForEachStrip(height, kStripRows, pool, [&](int first, int last) {
+    // A ray through a pixel a solid triangle covers has hit something by
+    // the time it gets to its far corner
+    DrawStrip(solid, true, width, first, last, [&](const ScreenTriangle& triangle, size_t p, float depth) {
+      if (depth < out.solid_depths[p])
+      {
+        out.solid_depths[p] = depth;
+        out.solid_surfaces[p] = triangle.surface;
+      }
+    });
+
+    // Then everything that may be hit in front of that
+    DrawStrip(bounds, false, width, first, last, [&](const ScreenTriangle& triangle, size_t p, float depth) {
+      if (depth > out.solid_depths[p] * (1.0f + kDepthSlack))
+        return;
+      out.near_depths[p] = (std::min)(out.near_depths[p], depth);
+
+      int8_t& count = out.counts[p];
+      if (count < 0)
+        return;
+      int* candidates = &out.candidates[p * kMaxCandidates];
+      float* depths = &out.candidate_depths[p * kMaxCandidates];
+      int i = (int)(std::find(candidates, candidates + count, triangle.surface) - candidates);
+      if (i == kMaxCandidates)
+      {
+        count = -1;
+        return;
+      }
+      if (i == count)
+        candidates[count++] = triangle.surface;
+      depths[i] = (std::min)(depths[i], depth);
+    });
+
+    // Tested in the order a trace would, so ties go the same way
+    for (size_t p = (size_t)first * width; p < (size_t)last * width; ++p)
+    {
+      int* candidates = &out.candidates[p * kMaxCandidates];
+      float* depths = &out.candidate_depths[p * kMaxCandidates];
+      for (int i = 1; i < out.counts[p]; ++i)
+      {
+        for (int j = i; j > 0 && candidates[j - 1] > candidates[j]; --j)
+        {
+          std::swap(candidates[j - 1], candidates[j]);
+          std::swap(depths[j - 1], depths[j]);
+        }
+      }
+    }
+  });
+
+  return true;
+}
+
+} // end of namespace raytracer
@@ -0,0 +1,75 @@
+/**
+ *
+ *  filename : rasterizer.h
+ *  author   : Do Won Cha
+ *  content  : Software rasterizer for primary visibility. Draws the
+ *             surfaces of a scene as triangles with edge functions, the
+ *             way the PA2 rasterizer does, to find what a ray anywhere in
+ *             a pixel can hit first without tracing it.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RASTERIZER_
+#define _RAY_RASTERIZER_
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "primitives/camera.hpp"
+#include "primitives/surface.hpp"
+#include "thread_pool.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// Most surfaces a pixel tests before it gives up and traces
+const int kMaxCandidates = 4;
+
+/**
+ *  What the camera sees through every pixel, surfaces by index in the list
+ *  they were drawn from. Depths are along the view, 0 to infinity.
+ */
+struct VisibilityBuffer
+{
+  int width, height;
+
+  // Per pixel the least depth a ray through it may hit anything at, the
+  // depth by which it has surely hit something and that surface, -1 for
+  // none. Depths are infinite where nothing is.
+  std::vector<float> near_depths, solid_depths;
+  std::vector<int> solid_surfaces;
+
+  // Surfaces a ray anywhere in the pixel can hit first, every one that
+  // may be hit up to a little past the solid depth, in list order, and the
+  // least depth each may be hit at. counts is -1 where there are
+  // more than kMaxCandidates and the pixel has to be traced, and 0 where
+  // nothing is there at all.
+  std::vector<int> candidates;        // kMaxCandidates per pixel
+  std::vector<float> candidate_depths;
+  std::vector<int8_t> counts;
+
+  VisibilityBuffer() : width(0), height(0) {}
+
+  const int* pixel_candidates(int pixel) const { return &candidates[(size_t)pixel * kMaxCandidates]; }
+  const float* pixel_candidate_depths(int pixel) const { return &candidate_depths[(size_t)pixel * kMaxCandidates]; }
+};
+
+/**
+ *  Draw surfaces as camera sees them into out, with rows split over pool
+ *  when there is one. Pixels are tested as whole squares, not at their
+ *  centers, so nothing a ray through them can hit is ever left out, however
+ *  small. A surface is dropped from a pixel where something solid covers
+ *  all of it in front. False, and out left empty, if any surface cannot be
+ *  tessellated, there would be no telling what it hides.
+ */
+bool RasterizeVisibility(const std::vector<Surface*>& surfaces, const Camera& camera, ThreadPool* pool,
+                         VisibilityBuffer& out);
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RASTERIZER_ */
@@ -0,0 +1,108 @@
+/**
+ *
+ *  filename : ray_buffer.hpp
+ *  author   : Do Won Cha
+ *  content  : Structure of arrays block of camera rays for a tile, the input
+ *             every renderer takes its primary rays from.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RAY_BUFFER_
+#define _RAY_RAY_BUFFER_
+
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "primitives/ray.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// Allocator that lines every array up on a cache line so SIMD loads never split
+template<typename T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t count)
+  {
+    void* memory = nullptr;
+    if (posix_memalign(&memory, Alignment, count * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(memory);
+  }
+
+  void deallocate(T* memory, size_t) { free(memory); }
+
+  template<typename U>
+  bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+  template<typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> aligned_floats_t;
+
+/**
+ *  One entry per pixel sample. Origins, directions and inverse directions
+ *  are stored per component so a batch can be filled and consumed with
+ *  vector instructions.
+ */
+class RayBuffer
+{
+public:
+  RayBuffer() : size_(0) {}
+
+  // Grows the arrays if needed, never shrinks them
+  void resize(int count)
+  {
+    size_ = count;
+    if ((int)origin_x.size() >= count)
+      return;
+
+    for (aligned_floats_t* array : { &origin_x, &origin_y, &origin_z,
+                                     &direction_x, &direction_y, &direction_z,
+                                     &inverse_x, &inverse_y, &inverse_z,
+                                     &offset_x, &offset_y })
+      array->resize(count);
+
+    pixel_x.resize(count);
+    pixel_y.resize(count);
+    sample.resize(count);
+  }
+
+  int size() const { return size_; }
+
+  Ray ray(int i) const
+  {
+    return Ray(Vector3f(origin_x[i], origin_y[i], origin_z[i]),
+               Vector3f(direction_x[i], direction_y[i], direction_z[i]));
+  }
+public:
+  aligned_floats_t origin_x, origin_y, origin_z;
+  aligned_floats_t direction_x, direction_y, direction_z;
+  aligned_floats_t inverse_x, inverse_y, inverse_z;    // 1 / direction, for slab tests
+
+  // Where each ray came from
+  aligned_floats_t offset_x, offset_y;                 // Offset inside the pixel
+  std::vector<int> pixel_x, pixel_y, sample;
+private:
+  int size_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RAY_BUFFER_ */
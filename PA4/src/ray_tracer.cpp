@@ -3,143 +3,1732 @@
 using namespace Eigen;
 using namespace raytracer;
 
+namespace
+{
+
+// Random dimensions of a sample. The pixel offset takes the first two, then
+// every bounce has a block of its own, roulette first and then one for each
+// light it picks, so no two decisions of a path share a number.
+const uint32_t kPixelDimensions = 2;
+
+uint32_t BounceDimension(int depth, int lightSamples)
+{
+  return kPixelDimensions + (uint32_t)depth * (1 + (std::max)(lightSamples, 0));
+}
+
+} // end of anonymous namespace
+
 RayTracer::RayTracer(int* argc, char** argv) :
   scene_(nullptr),
   camera_(new Camera(512, 512)),
+  frame_buffer_(512 * 512, Vector4f::Zero()),
   size_(512 * 512),
-  frame_buffer_(size_),
+  accumulation_buffer_(512 * 512, Vector4f::Zero()),
+  sample_counts_(512 * 512, 0),
+  tiles_(MakeTiles(512, 512, 32)),
+  tile_samples_(tiles_.size(), 0),
+  tile_size_(32),
+  min_samples_(0),
+  thread_count_(0),
+  priority_(PriorityNormal),
+  tile_hits_complete_(false),
+  touched_built_(false),
   sample_rate_(1),
+  samples_per_pixel_(0),
+  sampler(&RayTracer::NoSampling),
+  max_trace_time_(0.0f),
   max_trace_depth_(2),
-  sampler(&RayTracer::NoSampling)
+  min_throughput_(0.01f),
+  russian_roulette_(false),
+  shadow_cache_(true),
+  hit_cache_(false),
+  feature_buffers_(false),
+  light_samples_(0),
+  raster_primary_(false),
+  visibility_stale_(true),
+  shadow_map_size_(0),
+  shadow_maps_print_(0),
+  shadow_map_ms_(0.0f)
 {
 }
 
 RayTracer::~RayTracer()
-{}
+{
+  // Workers of a frame in flight still point back at us
+  cancel_async();
+}
+
+AsyncFrame::AsyncFrame(const std::vector<Tile>& tiles, int width, int height) :
+  tiles_(tiles),
+  width_(width),
+  height_(height),
+  image_((size_t)width * height, Vector4f::Zero()),
+  tile_promises_(tiles.size()),
+  tile_resolved_(tiles.size(), 0),
+  finished_(finished_promise_.get_future().share()),
+  cancelled_(false),
+  tiles_done_(0)
+{
+  for (std::promise<bool>& promise : tile_promises_)
+    tile_futures_.push_back(promise.get_future().share());
+}
+
+void AsyncFrame::Finish()
+{
+  for (size_t t = 0; t < tiles_.size(); ++t)
+  {
+    if (!tile_resolved_[t])
+      tile_promises_[t].set_value(false);
+  }
+  finished_promise_.set_value(tiles_done_ == (int)tiles_.size());
+}
 
 void RayTracer::initialize(std::unique_ptr<Scene>& scene)
+{
+  if (scene)
+    scene->build();
+  initialize(std::shared_ptr<Scene>(std::move(scene)));
+}
+
+void RayTracer::initialize(std::shared_ptr<Scene> scene)
 {
   scene_ = std::move(scene);
+  reset_accumulation();
+
+  // Cached occluders point into the old scene
+  for (TraceContext& context : contexts_)
+    context.last_occluder.clear();
 }
 
 void RayTracer::resize(int width, int height)
 {
     LOG(INFO) << "Resize called with width: " << width << ", height: " << height;
 
+    // Frames in flight read the camera and the tiles
+    cancel_async();
+
     // Resize the camera
     camera_->resize(width, height);
 
-    // Compare the new frame buffer size to the old one and allocate as neccessary
-    frame_buffer_size_t oldsize = size_;
+    // Both buffers always hold exactly one entry per pixel
     size_ = width * height;
-    if (size_ < oldsize)
+    frame_buffer_.resize(size_);
+    accumulation_buffer_.resize(size_);
+    sample_counts_.resize(size_);
+
+    tiles_ = MakeTiles(width, height, tile_size_);
+    tile_samples_.resize(tiles_.size());
+
+    reset_accumulation();
+}
+
+void RayTracer::set_thread_count(int threads)
+{
+  cancel_async();
+  thread_count_ = threads;
+  pool_.reset();
+}
+
+void RayTracer::set_thread_pool(std::shared_ptr<ThreadPool> pool)
+{
+  cancel_async();
+  pool_ = std::move(pool);
+  StartPool();
+}
+
+void RayTracer::set_max_trace_depth(int depth)
+{
+  max_trace_depth_ = depth;
+  reset_accumulation();
+}
+
+void RayTracer::set_path_termination(float epsilon, bool russian_roulette)
+{
+  min_throughput_ = epsilon;
+  russian_roulette_ = russian_roulette;
+  reset_accumulation();
+}
+
+void RayTracer::set_light_samples(int samples)
+{
+  light_samples_ = samples;
+  reset_accumulation();
+}
+
+void RayTracer::set_hit_cache(bool enabled)
+{
+  hit_cache_ = enabled;
+  if (!enabled)
+    std::vector<std::vector<HitSamples>>().swap(tile_hits_);
+  reset_accumulation();
+}
+
+void RayTracer::set_raster_primary(bool enabled)
+{
+  raster_primary_ = enabled;
+  visibility_stale_ = true;
+}
+
+void RayTracer::set_feature_buffers(bool enabled)
+{
+  feature_buffers_ = enabled;
+  reset_accumulation();
+}
+
+RayStats RayTracer::ray_stats() const
+{
+  RayStats total;
+  for (const TraceContext& context : contexts_)
+    total += context.stats;
+  return total;
+}
+
+void RayTracer::reset_ray_stats()
+{
+  for (TraceContext& context : contexts_)
+    context.stats = RayStats();
+}
+
+void RayTracer::set_camera_position(Vector3f position)
+{
+  camera_->set_position(position);
+  reset_accumulation();
+}
+
+void RayTracer::reset_accumulation()
+{
+  // Every caller is about to change what samples trace to
+  cancel_async();
+
+  // The frame buffer keeps the old image until new samples overwrite it
+  std::fill(accumulation_buffer_.begin(), accumulation_buffer_.end(), Vector4f::Zero());
+  std::fill(sample_counts_.begin(), sample_counts_.end(), 0);
+  std::fill(tile_samples_.begin(), tile_samples_.end(), 0);
+  min_samples_ = 0;
+  visibility_stale_ = true;
+  normal_buffer_.assign(feature_buffers_ ? size_ : 0, Vector4f::Zero());
+  albedo_buffer_.assign(feature_buffers_ ? size_ : 0, Vector4f::Zero());
+
+  // Every sample from here on is recorded, the old records are reused
+  tile_hits_.resize(hit_cache_ ? tiles_.size() : 0);
+  tile_hits_complete_ = hit_cache_;
+
+  // Built from the records on the first Rerender, the surfaces may be new ones
+  touched_built_ = false;
+}
+
+void RayTracer::BuildTouched()
+{
+  if (touched_built_)
+    return;
+
+  int bits = 0;
+  tile_bits_.resize(tiles_.size());
+  for (size_t t = 0; t < tiles_.size(); ++t)
+  {
+    tile_bits_[t] = bits;
+    bits += (tiles_[t].size() + 63) / 64 * 64;
+  }
+
+  surface_ids_.clear();
+  for (const std::unique_ptr<Surface>& surface : scene_->surfaces_)
+    surface_ids_.emplace(surface.get(), (int)surface_ids_.size());
+
+  // Same sizes as last time unless the scene or the frame changed
+  touched_.resize(surface_ids_.size());
+  for (std::vector<uint64_t>& pixels : touched_)
+    pixels.assign(bits / 64, 0);
+
+  StartPool();
+  pool_->ParallelFor((int)tiles_.size(), [&](int t, int) {
+    for (int sample = 0; sample < tile_samples_[t]; ++sample)
+    {
+      for (int i = 0; i < tiles_[t].size(); ++i)
+        MarkTouched(t, i, tile_hits_[t][sample], i);
+    }
+    return true;
+  }, priority_);
+  touched_built_ = true;
+}
+
+FrameStats RayTracer::Reshade(const std::vector<int>& lights)
+{
+  using namespace std::chrono;
+
+  // Frames in flight trace the scene that is being edited
+  cancel_async();
+
+  // Samples the cache does not have can only be traced again
+  if (!scene_ || !tile_hits_complete_)
+  {
+    reset_accumulation();
+    FrameStats stats = FrameStats();
+    MeasureCoverage(stats);
+    return stats;
+  }
+
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
+
+  std::vector<uint8_t> dirty(scene_->light_tree().size(), 0);
+  for (int light : lights)
+  {
+    if (light >= 0 && light < (int)dirty.size())
+      dirty[light] = 1;
+  }
+
+  const int width = camera_->screen_width();
+  std::atomic<int> tileSamples(0);
+  std::atomic<long long> samples(0);
+
+  pool_->ParallelFor((int)tiles_.size(), [&](int t, int slot) {
+    TraceContext& context = contexts_[slot];
+    const Tile& rect = tiles_[t];
+
+    // Summed again from the first sample on, in the order Render added them
+    context.sums.assign(rect.size(), Vector4f::Zero());
+    context.normal_sums.assign(feature_buffers_ ? rect.size() : 0, Vector4f::Zero());
+    context.albedo_sums.assign(feature_buffers_ ? rect.size() : 0, Vector4f::Zero());
+    context.dirty_lights = &dirty;
+    for (int sample = 0; sample < tile_samples_[t]; ++sample)
+    {
+      HitSamples& hits = tile_hits_[t][sample];
+      context.replay = &hits;
+      context.record = &context.reshaded;
+      TraceTileSample(rect, sample, context);
+      std::swap(hits, context.reshaded);
+
+      // Lights traced again can have new blockers, the old ones stay noted
+      for (int i = 0; i < rect.size(); ++i)
+      {
+        context.sums[i] += context.colors[i];
+        if (touched_built_)
+          MarkTouched(t, i, hits, i);
+      }
+
+      // Albedos follow material edits
+      for (int i = 0; i < (int)context.normal_sums.size(); ++i)
+      {
+        context.normal_sums[i] += context.first_normals[i];
+        context.albedo_sums[i] += context.first_albedos[i];
+      }
+    }
+    context.replay = nullptr;
+    context.record = nullptr;
+    context.dirty_lights = nullptr;
+
+    int i = 0;
+    for (int y = rect.y0; y < rect.y1; ++y)
+    {
+      for (int x = rect.x0; x < rect.x1; ++x, ++i)
+      {
+        int index = y * width + x;
+        accumulation_buffer_[index] = context.sums[i];
+        frame_buffer_[index] = context.sums[i] / (float)sample_counts_[index];
+        if (feature_buffers_)
+        {
+          normal_buffer_[index] = context.normal_sums[i];
+          albedo_buffer_[index] = context.albedo_sums[i];
+        }
+      }
+    }
+
+    tileSamples += tile_samples_[t];
+    samples += (long long)rect.size() * tile_samples_[t];
+    return true;
+  }, priority_);
+
+  FrameStats stats = FrameStats();
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = tileSamples;
+  stats.samples = samples;
+  MeasureCoverage(stats);
+  return stats;
+}
+
+FrameStats RayTracer::Rerender(Surface* surface, const std::function<void(Surface& surface)>& edit)
+{
+  using namespace std::chrono;
+
+  // Frames in flight trace the surface that is being edited
+  cancel_async();
+
+  Vector3f oldMin, oldMax, newMin, newMax;
+  bool bounded = surface->bounds(oldMin, oldMax);
+  edit(*surface);
+  bounded = surface->bounds(newMin, newMax) && bounded;
+  if (scene_)
+    scene_->build();
+  visibility_stale_ = true;
+
+  // Without the records or the bounds there is no telling what changed
+  if (tile_hits_complete_ && scene_)
+    BuildTouched();
+  std::unordered_map<const Surface*, int>::const_iterator id = surface_ids_.find(surface);
+  if (!tile_hits_complete_ || !bounded || id == surface_ids_.end())
+  {
+    reset_accumulation();
+    FrameStats stats = FrameStats();
+    MeasureCoverage(stats);
+    return stats;
+  }
+
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
+
+  // Rays that only graze the box at the end of a segment count as through it
+  const Vector3f slack = Vector3f::Constant(kRayEpsilon);
+  newMin -= slack;
+  newMax += slack;
+
+  const std::vector<uint64_t>& before = touched_[id->second];
+  const int width = camera_->screen_width();
+  std::atomic<int> tileSamples(0);
+  std::atomic<long long> samples(0);
+
+  pool_->ParallelFor((int)tiles_.size(), [&](int t, int slot) {
+    TraceContext& context = contexts_[slot];
+    const Tile& rect = tiles_[t];
+    const int count = tile_samples_[t];
+    std::vector<HitSamples>& tileHits = tile_hits_[t];
+
+    // Pixels that involved the surface where it was, then the ones with a
+    // ray through where it is now
+    std::vector<char> dirty(rect.size(), 0);
+    for (int i = 0; i < rect.size(); ++i)
+    {
+      int bit = tile_bits_[t] + i;
+      dirty[i] = (before[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    RayBuffer& rays = context.rays;
+    rays.resize(rect.size());
+    for (int sample = 0; sample < count; ++sample)
+    {
+      int i = 0;
+      for (int y = rect.y0; y < rect.y1; ++y)
+      {
+        for (int x = rect.x0; x < rect.x1; ++x, ++i)
+        {
+          rays.pixel_x[i] = x;
+          rays.pixel_y[i] = y;
+          rays.sample[i] = sample;
+          ((*this).*(sampler))(x, y, sample, rays.offset_x[i], rays.offset_y[i]);
+        }
+      }
+      camera_->GenerateRays(rays);
+
+      for (i = 0; i < rect.size(); ++i)
+      {
+        if (!dirty[i])
+          dirty[i] = CrossesBounds(rays.ray(i), tileHits[sample], i, newMin, newMax);
+      }
+    }
+
+    std::vector<int>& pixels = context.pixels;
+    pixels.clear();
+    for (int i = 0; i < rect.size(); ++i)
+    {
+      if (dirty[i])
+        pixels.push_back(i);
+    }
+    if (pixels.empty())
+      return true;
+
+    // What those pixels depended on is about to change
+    for (int i : pixels)
     {
-      frame_buffer_.resize(size_);
+      int bit = tile_bits_[t] + i;
+      for (std::vector<uint64_t>& touched : touched_)
+        touched[bit / 64] &= ~(1ULL << (bit % 64));
     }
-    else if (size_ > oldsize)
+
+    // Every sample again in order, merged into the records of the others
+    context.sums.assign(pixels.size(), Vector4f::Zero());
+    context.normal_sums.assign(feature_buffers_ ? pixels.size() : 0, Vector4f::Zero());
+    context.albedo_sums.assign(feature_buffers_ ? pixels.size() : 0, Vector4f::Zero());
+    for (int sample = 0; sample < count; ++sample)
+    {
+      context.record = &context.retraced;
+      TraceTileSample(rect, sample, context, &pixels);
+      context.record = nullptr;
+
+      HitSamples& merged = context.reshaded;
+      merged.clear();
+      for (int i = 0, k = 0; i < rect.size(); ++i)
+      {
+        if (k < (int)pixels.size() && pixels[k] == i)
+          merged.append_path(context.retraced, k++);
+        else
+          merged.append_path(tileHits[sample], i);
+      }
+      merged.finish();
+      std::swap(tileHits[sample], merged);
+
+      for (size_t k = 0; k < pixels.size(); ++k)
+      {
+        context.sums[k] += context.colors[k];
+        MarkTouched(t, pixels[k], tileHits[sample], pixels[k]);
+      }
+      for (size_t k = 0; k < context.normal_sums.size(); ++k)
+      {
+        context.normal_sums[k] += context.first_normals[k];
+        context.albedo_sums[k] += context.first_albedos[k];
+      }
+    }
+
+    for (size_t k = 0; k < pixels.size(); ++k)
     {
-      frame_buffer_.reserve(size_);
+      int index = (rect.y0 + pixels[k] / rect.width()) * width + rect.x0 + pixels[k] % rect.width();
+      accumulation_buffer_[index] = context.sums[k];
+      frame_buffer_[index] = context.sums[k] / (float)sample_counts_[index];
+      if (feature_buffers_)
+      {
+        normal_buffer_[index] = context.normal_sums[k];
+        albedo_buffer_[index] = context.albedo_sums[k];
+      }
     }
+
+    tileSamples += count;
+    samples += (long long)pixels.size() * count;
+    return true;
+  }, priority_);
+
+  FrameStats stats = FrameStats();
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = tileSamples;
+  stats.samples = samples;
+  MeasureCoverage(stats);
+  return stats;
 }
 
-void RayTracer::Render()
- {
-  LOG(INFO) << "Starting rendering to image";
+void RayTracer::MarkTouched(int tile, int pixel, const HitSamples& hits, int path)
+{
+  int bit = tile_bits_[tile] + pixel;
+  uint64_t mask = 1ULL << (bit % 64);
+  auto mark = [&](const Surface* surface) {
+    std::unordered_map<const Surface*, int>::const_iterator id = surface_ids_.find(surface);
+    if (id != surface_ids_.end())
+      touched_[id->second][bit / 64] |= mask;
+  };
 
-  // Most expensive thing ive ever seen.
-  int index = 0;
-  for (int y = 0; y < camera_->screen_height(); ++y)
+  for (int h = hits.paths[path]; h < hits.paths[path + 1]; ++h)
   {
-    for (int x = 0; x < camera_->screen_width(); ++x, ++index)
+    mark(hits.hits[h].surface);
+    for (int s = hits.hits[h].first_shadow; s < hits.shadow_end(h); ++s)
     {
-      Vector4f result = ((*this).*(sampler))(x, y);
-      frame_buffer_.at(index);
+      if (hits.blockers[s])
+        mark(hits.blockers[s]);
     }
   }
 }
 
-Vector4f RayTracer::Trace(const Ray& ray, int depth) const
+bool RayTracer::CrossesBounds(const Ray& ray, const HitSamples& hits, int path,
+                              const Vector3f& min, const Vector3f& max) const
 {
-    // Trace recursion base case
-    // depth should stop if bigger than the max trace depth
-    if (depth > max_trace_depth_)
-        return Vector4f(0.0f);
+  // Slab test of the part of current between 0 and length
+  auto crosses = [&](const Ray& current, float length) {
+    float tNear = 0.0f, tFar = length;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      float origin = current.position()(axis), direction = current.direction()(axis);
+      if (direction == 0.0f)
+      {
+        if (origin < min(axis) || origin > max(axis))
+          return false;
+        continue;
+      }
 
-    // Hit data from the ray trace
-    HitData data;
-    bool bHit = scene_->IntersectSurfaces(ray, data);
+      float t0 = (min(axis) - origin) / direction, t1 = (max(axis) - origin) / direction;
+      if (t0 > t1)
+        std::swap(t0, t1);
+      tNear = (std::max)(tNear, t0);
+      tFar = (std::min)(tFar, t1);
+      if (tNear > tFar)
+        return false;
+    }
+    return true;
+  };
 
-    // If nothing was hit return black
-    if (bHit)
-      return Vector4f(0.0f);
+  const float kForever = std::numeric_limits<float>::infinity();
+  const LightTree& lights = scene_->light_tree();
 
-    // Local illumination calculation (ambient, specular, diffuse)
-    // Additionally calculates shadows
-    Vector4f local = LocalShading(ray, data);
+  // Rebuilt the way Trace made them, from the hits they ended at
+  Ray current = ray;
+  for (int h = hits.paths[path]; h < hits.paths[path + 1]; ++h)
+  {
+    const CachedHit& hit = hits.hits[h];
+    if (crosses(current, (hit.point - current.position()).dot(current.direction())))
+      return true;
 
-    // If the surface material has a reflection value
-    // Do another ray trace for reflection surface
-    float reflectionCoef = scene_->materials_.at(data.hit_surface->material())->reflectivity();
-    if (reflectionCoef > 0.0f)
+    // Blocked lights stay blocked, only the lit ones can be shadowed now
+    for (int s = hit.first_shadow; s < hits.shadow_end(h); ++s)
     {
-        // Calculate the reflection ray
-        Vector3f incident = -ray.direction();
-        Vector3f dir = incident - data.normal * (2.0f * data.normal.dot(incident));
-        Ray reflectionRay(data.hit_point, dir.normalized());
+      if (!(hits.shadows[s] & 1) || hits.shadows[s] / 2 >= lights.size())
+        continue;
 
-        Vector4f reflect = Trace(reflectionRay, depth + 1);
+      Vector3f toLight = lights.light(hits.shadows[s] / 2)->position() - hit.point;
+      float distance = toLight.norm();
+      if (crosses(Ray(hit.point, toLight / distance), distance))
+        return true;
+    }
 
-        local = Utility::lerp(local, reflect, reflectionCoef);
+    Vector3f incident = -current.direction();
+    Vector3f dir = incident - hit.normal * (2.0f * hit.normal.dot(incident));
+    current = Ray(hit.point, dir.normalized());
+  }
+
+  // A path that was cut short traced no ray past its last hit
+  return hits.escaped[path] && crosses(current, kForever);
+}
+
+FrameStats RayTracer::RenderPreview(int scale, std::vector<Vector4f>& image)
+{
+  using namespace std::chrono;
+
+  FrameStats stats = FrameStats();
+  const int width = camera_->screen_width(), height = camera_->screen_height();
+  if (!scene_)
+  {
+    image.assign(size_, Vector4f::Zero());
+    return stats;
+  }
+
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
+
+  // The same view through fewer, bigger pixels
+  scale = (std::max)(1, scale);
+  Camera preview(*camera_);
+  preview.resize((width + scale - 1) / scale, (height + scale - 1) / scale);
+  const int previewWidth = preview.screen_width();
+  std::vector<Tile> tiles = MakeTiles(previewWidth, preview.screen_height(), tile_size_);
+  std::vector<Vector4f> colors((size_t)previewWidth * preview.screen_height());
+  std::vector<Vector4f> normals(colors.size());
+
+  pool_->ParallelFor((int)tiles.size(), [&](int index, int slot) {
+    TraceContext& context = contexts_[slot];
+    const Tile& rect = tiles[index];
+    context.camera = &preview;
+    context.features = true;
+    context.centered = true;
+    TraceTileSample(rect, 0, context);
+    context.camera = nullptr;
+    context.features = false;
+    context.centered = false;
+
+    int i = 0;
+    for (int y = rect.y0; y < rect.y1; ++y)
+    {
+      for (int x = rect.x0; x < rect.x1; ++x, ++i)
+      {
+        colors[(size_t)y * previewWidth + x] = context.colors[i];
+        normals[(size_t)y * previewWidth + x] = context.first_normals[i];
+      }
     }
+    return true;
+  }, priority_);
 
-    return local;
+  UpscaleImage(colors, normals, previewWidth, preview.screen_height(), width, height, pool_.get(), image);
+
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = (int)tiles.size();
+  stats.samples = (long long)colors.size();
+  return stats;
 }
 
-Vector4f RayTracer::LocalShading(const Ray& ray, const HitData& data) const
+void RayTracer::Denoise(std::vector<Vector4f>& image, const DenoiseSettings& settings)
 {
-  using namespace std;
+  if (!feature_buffers_)
+  {
+    image = frame_buffer_;
+    return;
+  }
+
+  // The guides are averages over the samples the colors have
+  std::vector<Vector4f> normals(size_), albedos(size_);
+  for (frame_buffer_size_t i = 0; i < size_; ++i)
+  {
+    float scale = sample_counts_[i] > 0 ? 1.0f / sample_counts_[i] : 0.0f;
+    normals[i] = normal_buffer_[i] * scale;
+    albedos[i] = albedo_buffer_[i] * scale;
+  }
+
+  StartPool();
+  DenoiseImage(frame_buffer_, normals, albedos, camera_->screen_width(), camera_->screen_height(),
+               settings, pool_.get(), image);
+}
+
+void RayTracer::save_state(RenderState& state) const
+{
+  state.settings = SettingsFingerprint();
+  state.width = camera_->screen_width();
+  state.height = camera_->screen_height();
+  state.tile_size = tile_size_;
+  state.min_samples = min_samples_;
+  state.accumulation = accumulation_buffer_;
+  state.sample_counts = sample_counts_;
+  state.tile_samples = tile_samples_;
+}
+
+bool RayTracer::restore_state(const RenderState& state)
+{
+  if (state.settings != SettingsFingerprint() ||
+      state.width != camera_->screen_width() || state.height != camera_->screen_height() ||
+      state.tile_size != tile_size_ || state.tile_samples.size() != tiles_.size() ||
+      state.accumulation.size() != size_ || state.sample_counts.size() != size_)
+  {
+    LOG(ERROR) << "Saved render state does not match the current settings";
+    return false;
+  }
+
+  accumulation_buffer_ = state.accumulation;
+  sample_counts_ = state.sample_counts;
+  tile_samples_ = state.tile_samples;
+  min_samples_ = state.min_samples;
+
+  // Those samples were never recorded, Reshade has to start over, and
+  // they have no features
+  tile_hits_complete_ = false;
+  normal_buffer_.assign(feature_buffers_ ? size_ : 0, Vector4f::Zero());
+  albedo_buffer_.assign(feature_buffers_ ? size_ : 0, Vector4f::Zero());
+
+  // Same division RenderTile does, the frame buffer comes back bit for bit
+  for (frame_buffer_size_t i = 0; i < size_; ++i)
+  {
+    frame_buffer_[i] = sample_counts_[i] > 0 ? Vector4f(accumulation_buffer_[i] / (float)sample_counts_[i])
+                                             : Vector4f(Vector4f::Zero());
+  }
+
+  return true;
+}
+
+uint64_t RayTracer::SettingsFingerprint(bool resolution) const
+{
+  uint64_t fingerprint = 1469598103934665603ULL;
+  auto mix = [&fingerprint](uint32_t value) {
+    fingerprint = (fingerprint ^ Utility::hash(value)) * 1099511628211ULL;
+  };
+  auto mixFloat = [&mix](float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    mix(bits);
+  };
+
+  int samplerType = (sampler == &RayTracer::UniformSampling) ? 1 :
+                    (sampler == &RayTracer::RandomSampling) ? 2 : 0;
+  if (resolution)
+  {
+    mix(camera_->screen_width());
+    mix(camera_->screen_height());
+  }
+  mix(samplerType);
+  mix(sample_rate_);
+  mix(max_trace_depth_);
+  mixFloat(min_throughput_);
+  mix(russian_roulette_);
+  mix(light_samples_);
+  for (int i = 0; i < 3; ++i)
+    mixFloat(camera_->position()(i));
+
+  return fingerprint;
+}
+
+int RayTracer::samples_per_pixel() const
+{
+  if (samples_per_pixel_ > 0)
+    return samples_per_pixel_;
+
+  if (sampler == &RayTracer::NoSampling)
+    return 1;
+
+  return sample_rate_ * sample_rate_;
+}
+
+FrameStats RayTracer::Render()
+{
+  using namespace std::chrono;
+
+  FrameStats stats = FrameStats();
+
+  // Nothing changed since the image converged, keep showing it
+  if (scene_ && !converged())
+  {
+    StartPool();
+
+    bool budgeted = max_trace_time_ > 0.0f;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = start +
+      duration_cast<steady_clock::duration>(duration<float, std::milli>(max_trace_time_));
+
+    // What the camera sees, for as long as neither it nor the scene moves
+    if (raster_primary_ && visibility_stale_)
+    {
+      visibility_surfaces_.clear();
+      for (const std::unique_ptr<Surface>& surface : scene_->surfaces_)
+        visibility_surfaces_.push_back(surface.get());
+      RasterizeVisibility(visibility_surfaces_, *camera_, pool_.get(), visibility_);
+      visibility_stale_ = false;
+      stats.raster_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+    }
+
+    std::atomic<int> tiles(0);
+    std::atomic<long long> samples(0);
+    std::atomic<bool> deadline_hit(false);
+
+    // One level is every tile that has the fewest samples, each tile shows
+    // up once per level so no two threads ever touch the same pixels.
+    do
+    {
+      std::vector<int> level;
+      for (int t = 0; t < (int)tiles_.size(); ++t)
+      {
+        if (tile_samples_[t] == min_samples_)
+          level.push_back(t);
+      }
+
+      pool_->ParallelFor((int)level.size(), [&](int index, int slot) {
+        if (budgeted && steady_clock::now() >= deadline)
+        {
+          deadline_hit = true;
+          return false;
+        }
+
+        RenderTile(level[index], contexts_[slot]);
+        ++tiles;
+        samples += tiles_[level[index]].size();
+        return true;
+      }, priority_);
+
+      min_samples_ = *std::min_element(tile_samples_.begin(), tile_samples_.end());
+    } while (budgeted && !deadline_hit && !converged());
+
+    stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+    stats.tiles = tiles;
+    stats.samples = samples;
+    stats.deadline_hit = deadline_hit;
+  }
+
+  MeasureCoverage(stats);
+  return stats;
+}
+
+void RayTracer::MeasureCoverage(FrameStats& stats) const
+{
+  // How much of the frame is at the quality the settings ask for
+  int target = samples_per_pixel();
+  long long done = 0;
+  for (int t = 0; t < (int)tiles_.size(); ++t)
+  {
+    if (tile_samples_[t] >= target)
+      done += tiles_[t].size();
+  }
+  stats.min_samples = min_samples_;
+  stats.target_coverage = size_ ? (float)done / size_ : 1.0f;
+}
+
+FrameStats RayTracer::RenderTiled(TiledFrameBuffer& target, const std::function<bool(int band)>& band_done)
+{
+  if (!target.is_open())
+    return FrameStats();
+
+  const int perBand = target.tiles_per_band();
+
+  // Tiles left in every band, and the first band not handed out yet
+  std::vector<std::atomic<int>> remaining(target.bands());
+  for (std::atomic<int>& count : remaining)
+    count = perBand;
+  std::vector<char> finished(target.bands(), 0);
+  int nextBand = 0;
+  std::mutex bandMutex;
+
+  FrameStats stats = RenderRects(target.tiles(), target.width(), target.height(),
+                                 [&](int t, const float* rgb) {
+    const Tile& rect = target.tiles()[t];
+    std::memcpy(target.tile(t), rgb, rect.size() * 3 * sizeof(float));
+
+    // Whoever finishes a band hands out every band that is ready, in order
+    int band = t / perBand;
+    if (--remaining[band] == 0)
+    {
+      std::lock_guard<std::mutex> lock(bandMutex);
+      finished[band] = 1;
+      while (nextBand < (int)finished.size() && finished[nextBand])
+      {
+        if (!band_done(nextBand++))
+          return false;
+      }
+    }
+    return true;
+  });
+
+  if (stats.min_samples == 0)
+    stats.target_coverage = (float)nextBand / target.bands();
+  return stats;
+}
+
+FrameStats RayTracer::RenderRects(const std::vector<Tile>& rects, int width, int height,
+                                  const std::function<bool(int index, const float* rgb)>& done)
+{
+  return RenderRects(rects, width, height, nullptr, [&](int index, const Vector4f*, const float* rgb) {
+    return done(index, rgb);
+  });
+}
+
+FrameStats RayTracer::RenderRects(const std::vector<Tile>& rects, int width, int height,
+                                  const std::function<int(int index, Vector4f* sums)>& resume,
+                                  const std::function<bool(int index, const Vector4f* sums, const float* rgb)>& done)
+{
+  using namespace std::chrono;
+
+  FrameStats stats = FrameStats();
+  if (!scene_)
+    return stats;
+
+  // Frames in flight read the camera this resizes for a while
+  cancel_async();
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
+
+  // The camera covers the whole image while its rects are traced
+  int cameraWidth = camera_->screen_width(), cameraHeight = camera_->screen_height();
+  camera_->resize(width, height);
+
+  const int samples = samples_per_pixel();
+  std::atomic<int> traced(0);                 // Tile samples, as in Render
+  std::atomic<long long> tracedSamples(0);
+  std::atomic<bool> stopped(false);
+
+  pool_->ParallelFor((int)rects.size(), [&](int index, int slot) {
+    TraceContext& context = contexts_[slot];
+    const Tile& rect = rects[index];
+
+    // Same sums in the same order as progressive rendering, the pixels come
+    // out identical
+    context.sums.assign(rect.size(), Vector4f::Zero());
+    int first = resume ? Utility::clamp(0, resume(index, context.sums.data()), samples) : 0;
+    for (int sample = first; sample < samples; ++sample)
+    {
+      TraceTileSample(rect, sample, context);
+      for (int i = 0; i < rect.size(); ++i)
+        context.sums[i] += context.colors[i];
+    }
+
+    context.rgb.resize(rect.size() * 3);
+    for (int i = 0; i < rect.size(); ++i)
+    {
+      Vector4f color = context.sums[i] / (float)samples;
+      context.rgb[i * 3 + 0] = color(0);
+      context.rgb[i * 3 + 1] = color(1);
+      context.rgb[i * 3 + 2] = color(2);
+    }
+    traced += samples - first;
+    tracedSamples += (long long)rect.size() * (samples - first);
+
+    if (!done(index, context.sums.data(), context.rgb.data()))
+      stopped = true;
+    return !stopped.load();
+  }, priority_);
+
+  camera_->resize(cameraWidth, cameraHeight);
+
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = traced;
+  stats.samples = tracedSamples;
+  stats.min_samples = stopped ? 0 : samples;
+  stats.target_coverage = stopped ? 0.0f : 1.0f;
+
+  return stats;
+}
+
+FrameStats RayTracer::RenderViews(std::vector<RenderView>& views)
+{
+  using namespace std::chrono;
+
+  FrameStats stats = FrameStats();
+  if (!scene_)
+    return stats;
+
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
 
+  // Tile t of every view before tile t + 1 of any, views of other sizes
+  // just run out of tiles sooner
+  std::vector<std::vector<Tile>> viewTiles(views.size());
+  std::vector<std::pair<int, int>> jobs;      // View and tile
+  size_t mostTiles = 0;
+  for (size_t v = 0; v < views.size(); ++v)
+  {
+    const Camera& camera = views[v].camera;
+    viewTiles[v] = MakeTiles(camera.screen_width(), camera.screen_height(), tile_size_);
+    const size_t pixels = (size_t)camera.screen_width() * camera.screen_height();
+    views[v].image.assign(pixels, Vector4f::Zero());
+    views[v].surfaces.assign(pixels, nullptr);
+    views[v].points.assign(pixels, Vector3f::Zero());
+    mostTiles = (std::max)(mostTiles, viewTiles[v].size());
+  }
+  for (size_t t = 0; t < mostTiles; ++t)
+  {
+    for (size_t v = 0; v < views.size(); ++v)
+    {
+      if (t < viewTiles[v].size())
+        jobs.push_back(std::make_pair((int)v, (int)t));
+    }
+  }
+
+  const int samples = samples_per_pixel();
+  std::atomic<long long> tracedSamples(0);
+
+  pool_->ParallelFor((int)jobs.size(), [&](int index, int slot) {
+    TraceContext& context = contexts_[slot];
+    RenderView& view = views[jobs[index].first];
+    const Tile& rect = viewTiles[jobs[index].first][jobs[index].second];
+
+    RenderViewTile(view, rect, nullptr, samples, 0.0f, context);
+    tracedSamples += (long long)rect.size() * samples;
+    return true;
+  }, priority_);
+
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = (int)jobs.size() * samples;
+  stats.samples = tracedSamples;
+  stats.min_samples = samples;
+  stats.target_coverage = 1.0f;
+
+  return stats;
+}
+
+FrameStats RayTracer::RenderReprojected(RenderView& view, const RenderView& previous, int fresh_samples,
+                                         float tolerance)
+{
+  using namespace std::chrono;
+
+  FrameStats stats = FrameStats();
+  if (!scene_)
+    return stats;
+
+  StartPool();
+  steady_clock::time_point start = steady_clock::now();
+
+  const Camera& camera = view.camera;
+  const size_t pixels = (size_t)camera.screen_width() * camera.screen_height();
+  std::vector<Tile> tiles = MakeTiles(camera.screen_width(), camera.screen_height(), tile_size_);
+  view.image.assign(pixels, Vector4f::Zero());
+  view.surfaces.assign(pixels, nullptr);
+  view.points.assign(pixels, Vector3f::Zero());
+
+  const int samples = samples_per_pixel();
+  const int fresh = Utility::clamp(1, fresh_samples, samples);
+  const bool reusable = previous.surfaces.size() ==
+                        (size_t)previous.camera.screen_width() * previous.camera.screen_height() &&
+                        previous.image.size() == previous.surfaces.size();
+  std::atomic<long long> tracedSamples(0), reprojected(0);
+
+  pool_->ParallelFor((int)tiles.size(), [&](int index, int slot) {
+    const Tile& rect = tiles[index];
+    int reused = RenderViewTile(view, rect, reusable ? &previous : nullptr, fresh, tolerance, contexts_[slot]);
+    tracedSamples += (long long)rect.size() * samples - (long long)reused * (samples - fresh);
+    reprojected += reused;
+    return true;
+  }, priority_);
+
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.tiles = (int)tiles.size() * samples;
+  stats.samples = tracedSamples;
+  stats.min_samples = samples;
+  stats.target_coverage = 1.0f;
+  stats.reprojected = reprojected;
+
+  return stats;
+}
+
+int RayTracer::RenderViewTile(RenderView& view, const Tile& rect, const RenderView* previous, int fresh_samples,
+                              float tolerance, TraceContext& context)
+{
+  const int samples = samples_per_pixel();
+  const int width = view.camera.screen_width();
+  context.camera = &view.camera;
+  context.sums.assign(rect.size(), Vector4f::Zero());
+
+  // The first sample keeps what it hit, for reprojecting this frame and the next
+  HitSamples& first = context.first_hits;
+  context.record = &first;
+  TraceTileSample(rect, 0, context);
+  context.record = nullptr;
+
+  // Pixels previous may stand in for get its color for now, the others
+  // trace every sample
+  std::vector<int>& traced = context.pixels;
+  traced.clear();
+  int i = 0;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    for (int x = rect.x0; x < rect.x1; ++x, ++i)
+    {
+      size_t index = (size_t)y * width + x;
+      context.sums[i] += context.colors[i];
+
+      bool hit = first.paths[i] < first.paths[i + 1];
+      view.surfaces[index] = hit ? first.hits[first.paths[i]].surface : nullptr;
+      view.points[index] = hit ? first.hits[first.paths[i]].point : Vector3f::Zero();
+
+      if (!previous || !Reproject(view, (int)index, *previous, view.image[index]))
+        traced.push_back(i);
+    }
+  }
+  if ((int)traced.size() == rect.size())
+    fresh_samples = samples;
+
+  // Fresh samples for every pixel, same sums in the same order as
+  // RenderRects
+  for (int sample = 1; sample < fresh_samples; ++sample)
+  {
+    TraceTileSample(rect, sample, context);
+    for (i = 0; i < rect.size(); ++i)
+      context.sums[i] += context.colors[i];
+  }
+
+  // Reprojection failed where the fresh samples disagree with it, a
+  // reflection or highlight that moved with the camera
+  if (fresh_samples < samples)
+  {
+    size_t next = 0, count = traced.size();
+    i = 0;
+    for (int y = rect.y0; y < rect.y1; ++y)
+    {
+      for (int x = rect.x0; x < rect.x1; ++x, ++i)
+      {
+        if (next < count && traced[next] == i)
+        {
+          ++next;
+          continue;
+        }
+        Vector4f difference = context.sums[i] / (float)fresh_samples - view.image[(size_t)y * width + x];
+        if (difference.head<3>().cwiseAbs().maxCoeff() > tolerance)
+          traced.push_back(i);
+      }
+    }
+    std::inplace_merge(traced.begin(), traced.begin() + count, traced.end());
+  }
+  const int reused = rect.size() - (int)traced.size();
+
+  for (int sample = fresh_samples; sample < samples && !traced.empty(); ++sample)
+  {
+    TraceTileSample(rect, sample, context, &traced);
+    for (i = 0; i < (int)traced.size(); ++i)
+      context.sums[traced[i]] += context.colors[i];
+  }
+  context.camera = nullptr;
+
+  // Reused colors count as the samples they stand in for
+  const float reusedWeight = (float)(samples - fresh_samples);
+  size_t next = 0;
+  i = 0;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    for (int x = rect.x0; x < rect.x1; ++x, ++i)
+    {
+      Vector4f& color = view.image[(size_t)y * width + x];
+      if (next < traced.size() && traced[next] == i)
+      {
+        color = context.sums[i] / (float)samples;
+        ++next;
+      }
+      else
+        color = (color * reusedWeight + context.sums[i]) / (float)samples;
+    }
+  }
+
+  return reused;
+}
+
+bool RayTracer::Reproject(const RenderView& view, int pixel, const RenderView& previous, Vector4f& color) const
+{
+  Surface* surface = view.surfaces[pixel];
+  if (!surface)
+    return false;
+
+  const Vector3f& point = view.points[pixel];
+  float x, y;
+  if (!previous.camera.Project(point, x, y))
+    return false;
+
+  // The four pixel centers around it all have to see the surface close by
+  const int width = previous.camera.screen_width(), height = previous.camera.screen_height();
+  float fx = x - 0.5f, fy = y - 0.5f;
+  int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+  if (x0 < 0 || y0 < 0 || x0 + 1 >= width || y0 + 1 >= height)
+    return false;
+  fx -= x0;
+  fy -= y0;
+
+  // About two pixels at that distance
+  float distance = (point - previous.camera.position()).norm();
+  float tolerance = 4.0f * distance / (std::min)(width, height);
+
+  color = Vector4f::Zero();
+  for (int corner = 0; corner < 4; ++corner)
+  {
+    int cx = x0 + (corner & 1), cy = y0 + (corner >> 1);
+    size_t index = (size_t)cy * width + cx;
+    if (previous.surfaces[index] != surface || (previous.points[index] - point).norm() > tolerance)
+      return false;
+
+    float weight = ((corner & 1) ? fx : 1.0f - fx) * ((corner >> 1) ? fy : 1.0f - fy);
+    color += previous.image[index] * weight;
+  }
+  return true;
+}
+
+std::shared_ptr<AsyncFrame> RayTracer::RenderAsync(const TileCallback& tile_done, const FrameCallback& frame_done)
+{
+  // Anything still in flight is stale now, it drains while the new frame starts
+  for (const std::shared_ptr<AsyncFrame>& frame : async_frames_)
+    frame->cancel();
+  async_frames_.erase(std::remove_if(async_frames_.begin(), async_frames_.end(),
+                                     [](const std::shared_ptr<AsyncFrame>& frame) { return frame->ready(); }),
+                      async_frames_.end());
+
+  const int width = camera_->screen_width();
+  std::shared_ptr<AsyncFrame> frame(new AsyncFrame(tiles_, width, camera_->screen_height()));
+  if (!scene_)
+  {
+    frame->cancel();
+    frame->Finish();
+    return frame;
+  }
+
+  StartPool();
+  async_frames_.push_back(frame);
+  const int samples = samples_per_pixel();
+
+  pool_->ParallelForAsync((int)tiles_.size(), [this, frame, samples, width, tile_done](int index, int slot) {
+    TraceContext& context = contexts_[slot];
+    const Tile& rect = frame->tiles_[index];
+
+    // Checked between samples too, a stale tile stops within one pass
+    context.sums.assign(rect.size(), Vector4f::Zero());
+    for (int sample = 0; sample < samples; ++sample)
+    {
+      if (frame->cancelled_)
+        return false;
+
+      TraceTileSample(rect, sample, context);
+      for (int i = 0; i < rect.size(); ++i)
+        context.sums[i] += context.colors[i];
+    }
+
+    int i = 0;
+    for (int y = rect.y0; y < rect.y1; ++y)
+    {
+      for (int x = rect.x0; x < rect.x1; ++x, ++i)
+        frame->image_[(size_t)y * width + x] = context.sums[i] / (float)samples;
+    }
+
+    ++frame->tiles_done_;
+    if (tile_done)
+      tile_done(*frame, index);
+    frame->tile_resolved_[index] = 1;
+    frame->tile_promises_[index].set_value(true);
+    return true;
+  }, [frame, frame_done] {
+    if (frame_done)
+      frame_done(*frame, frame->tiles_done_ == (int)frame->tiles_.size());
+    frame->Finish();
+  }, priority_);
+
+  return frame;
+}
+
+void RayTracer::cancel_async()
+{
+  for (const std::shared_ptr<AsyncFrame>& frame : async_frames_)
+    frame->cancel();
+  for (const std::shared_ptr<AsyncFrame>& frame : async_frames_)
+    frame->wait();
+  async_frames_.clear();
+}
+
+void RayTracer::StartPool()
+{
+  if (!pool_)
+    pool_ = std::make_shared<ThreadPool>(thread_count_);
+  contexts_.resize((std::max)((int)contexts_.size(), pool_->slots()));
+  UpdateShadowMaps();
+}
+
+void RayTracer::UpdateShadowMaps()
+{
+  using namespace std::chrono;
+
+  // Cancelled frames may still be on a sample pass that reads the maps,
+  // they have to drain before the maps go away
+  if (shadow_map_size_ <= 0 || !scene_)
+  {
+    if (!shadow_maps_.empty())
+      cancel_async();
+    shadow_maps_.clear();
+    return;
+  }
+
+  // Everything the maps depend on, the surfaces by address as the maps
+  // point to them
+  Fingerprint print;
+  print.add(shadow_map_size_);
+  std::vector<Surface*> surfaces;
+  for (const std::unique_ptr<Surface>& surface : scene_->surfaces_)
+  {
+    print.add((uint64_t)(uintptr_t)surface.get());
+    surface->fingerprint(print);
+    surfaces.push_back(surface.get());
+  }
+  const LightTree& lights = scene_->light_tree();
+  for (int i = 0; i < lights.size(); ++i)
+    print.add(lights.light(i)->position());
+
+  if ((int)shadow_maps_.size() == lights.size() && print.value() == shadow_maps_print_)
+    return;
+
+  cancel_async();
+  steady_clock::time_point start = steady_clock::now();
+  shadow_maps_.assign(lights.size(), ShadowMap());
+  for (int i = 0; i < lights.size(); ++i)
+  {
+    if (!shadow_maps_[i].Build(surfaces, lights.light(i)->position(), shadow_map_size_, pool_.get()))
+      LOG(WARNING) << "Light " << i << " is too close to a surface for a shadow map, its shadows are traced";
+  }
+  shadow_maps_print_ = print.value();
+  shadow_map_ms_ = duration<float, std::milli>(steady_clock::now() - start).count();
+}
+
+void RayTracer::RenderTile(int tile, TraceContext& context)
+{
+  const Tile& rect = tiles_[tile];
+  int width = camera_->screen_width();
+
+  // Every pixel of a tile has the same number of samples
+  if (hit_cache_)
+  {
+    std::vector<HitSamples>& hits = tile_hits_[tile];
+    if ((int)hits.size() <= tile_samples_[tile])
+      hits.resize(tile_samples_[tile] + 1);
+    context.record = &hits[tile_samples_[tile]];
+  }
+  context.visibility = raster_primary_ && visibility_.width > 0 ? &visibility_ : nullptr;
+  TraceTileSample(rect, tile_samples_[tile], context);
+  context.visibility = nullptr;
+  if (context.record)
+  {
+    for (int i = 0; touched_built_ && i < rect.size(); ++i)
+      MarkTouched(tile, i, *context.record, i);
+    context.record = nullptr;
+  }
+
+  int i = 0;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    for (int x = rect.x0; x < rect.x1; ++x, ++i)
+    {
+      int index = y * width + x;
+
+      accumulation_buffer_[index] += context.colors[i];
+      ++sample_counts_[index];
+      frame_buffer_[index] = accumulation_buffer_[index] / (float)sample_counts_[index];
+      if (feature_buffers_)
+      {
+        normal_buffer_[index] += context.first_normals[i];
+        albedo_buffer_[index] += context.first_albedos[i];
+      }
+    }
+  }
+
+  ++tile_samples_[tile];
+}
+
+void RayTracer::TraceTileSample(const Tile& rect, int sample, TraceContext& context,
+                                const std::vector<int>* pixels)
+{
+  // Lay out the sample of every pixel, then make all the rays at once
+  RayBuffer& rays = context.rays;
+  const int count = pixels ? (int)pixels->size() : rect.size();
+  rays.resize(count);
+
+  int i;
+  for (i = 0; i < count; ++i)
+  {
+    int pixel = pixels ? (*pixels)[i] : i;
+    int x = rect.x0 + pixel % rect.width(), y = rect.y0 + pixel / rect.width();
+    rays.pixel_x[i] = x;
+    rays.pixel_y[i] = y;
+    rays.sample[i] = sample;
+    if (context.centered)
+      rays.offset_x[i] = rays.offset_y[i] = 0.5f;
+    else
+      ((*this).*(sampler))(x, y, sample, rays.offset_x[i], rays.offset_y[i]);
+  }
+
+  (context.camera ? *context.camera : *camera_).GenerateRays(rays);
+
+  if (context.record)
+    context.record->clear();
+
+  // Trace fills in the rays that hit something
+  if (feature_buffers_ || context.features)
+  {
+    context.first_normals.assign(rays.size(), Vector4f::Zero());
+    context.first_albedos.assign(rays.size(), Vector4f::Zero());
+  }
+
+  context.colors.resize(rays.size());
+  for (i = 0; i < rays.size(); ++i)
+  {
+    context.replay_path = i;
+    context.colors[i] = Trace(rays.ray(i), Utility::sample_seed(rays.pixel_x[i], rays.pixel_y[i], sample), context);
+  }
+
+  if (context.record)
+    context.record->finish();
+}
+
+Vector4f RayTracer::Trace(const Ray& ray, uint32_t seed, TraceContext& context) const
+{
+    Vector4f color = Vector4f::Zero();
+
+    // Weight of whatever the current ray sees on the final color
+    float throughput = 1.0f;
+    Ray current = ray;
+
+    // When re-shading, the hits this path had before are taken as they were
+    const HitSamples* replay = context.replay;
+    int firstCached = 0, cachedHits = 0;
+    bool escaped = false;
+    if (replay)
+    {
+      firstCached = replay->paths[context.replay_path];
+      cachedHits = replay->paths[context.replay_path + 1] - firstCached;
+      escaped = replay->escaped[context.replay_path] != 0;
+    }
+
+    HitSamples* record = context.record;
+    if (record)
+    {
+      record->paths.push_back((int)record->hits.size());
+      record->escaped.push_back(0);
+    }
+
+    for (int depth = 0; depth <= max_trace_depth_; ++depth)
+    {
+        // Hit data from the ray trace
+        HitData data;
+        bool bHit;
+        context.replay_hit = -1;
+        if (depth < cachedHits)
+        {
+          const CachedHit& cached = replay->hits[firstCached + depth];
+          data.hit_surface = cached.surface;
+          data.hit_point = cached.point;
+          data.normal = cached.normal;
+          context.replay_hit = firstCached + depth;
+          bHit = true;
+          ++context.stats.cached_hits;
+        }
+        else if (depth == cachedHits && escaped)
+        {
+          bHit = false;
+        }
+        else
+        {
+          if (depth == 0)
+            ++context.stats.primary_rays;
+          else
+            ++context.stats.secondary_rays;
+          if (depth > 0 || !context.visibility || !VisibleHit(current, context, data, bHit))
+            bHit = scene_->IntersectSurfaces(current, data);
+        }
+
+        // If nothing was hit the rest of the path is black
+        if (!bHit)
+        {
+          if (record)
+            record->escaped.back() = 1;
+          break;
+        }
+
+        if (record)
+          record->hits.push_back({ data.hit_surface, data.hit_point, data.normal, (int)record->shadows.size() });
+
+        if (depth == 0 && (feature_buffers_ || context.features))
+        {
+          const Material& material = *scene_->materials_.at(data.hit_surface->material());
+          float distance = (data.hit_point - ray.position()).norm();
+          context.first_normals[context.replay_path] << data.normal, distance;
+          context.first_albedos[context.replay_path] << material.diffuse().head<3>(), 1.0f;
+        }
+
+        // Local illumination calculation (ambient, specular, diffuse)
+        // Additionally calculates shadows
+        Vector4f local = LocalShading(current, data, seed, depth, context);
+
+        // Without reflection the surface color is all there is
+        float reflectionCoef = scene_->materials_.at(data.hit_surface->material())->reflectivity();
+        if (reflectionCoef <= 0.0f)
+        {
+          color += local * throughput;
+          break;
+        }
+
+        // Reflective surfaces blend their own color with the reflected one.
+        // Reflectivity is not clamped to 1, the blue sphere of spheres.cpp
+        // has 32 and has always extrapolated past the reflection. Throughput
+        // grows there and only max_trace_depth_ ends such paths.
+        color += local * (throughput * (1.0f - reflectionCoef));
+        throughput *= reflectionCoef;
+
+        // Past the max depth the reflection is black
+        if (depth == max_trace_depth_)
+          break;
+
+        // Cut off paths that can no longer change the pixel much
+        if (throughput < min_throughput_)
+        {
+          float survive = throughput / min_throughput_;
+          if (!russian_roulette_ || Utility::random_unit(seed, BounceDimension(depth, light_samples_)) >= survive)
+          {
+            ++context.stats.terminated_paths;
+            break;
+          }
+
+          // Survivors stand in for the paths that were cut
+          throughput /= survive;
+        }
+
+        // Calculate the reflection ray
+        Vector3f incident = -current.direction();
+        Vector3f dir = incident - data.normal * (2.0f * data.normal.dot(incident));
+        current = Ray(data.hit_point, dir.normalized());
+    }
+
+    return color;
+}
+
+Vector4f RayTracer::LocalShading(const Ray& ray, const HitData& data, uint32_t seed, int depth,
+                                 TraceContext& context) const
+{
   Material* material = scene_->materials_.at(data.hit_surface->material()).get();
 
   Vector4f out = material->ambient();
 
+  // Only the lights whose influence reaches the hit point can add anything
+  const LightTree& lights = scene_->light_tree();
+  std::vector<int>& candidates = context.light_candidates;
+  lights.Query(data.hit_point, candidates);
+
+  context.last_occluder.resize(lights.size(), nullptr);
+
+  if (light_samples_ <= 0 || (int)candidates.size() <= light_samples_)
+  {
+    for (int light : candidates)
+      out += DirectLighting(ray, data, *material, light, context);
+
+    return out;
+  }
+
   /**
-   *  For each light in the scene
-   *  Calculate the vector from hit point -> light.
-   *  Make the shadow ray using the vector
+   *  Too many lights, pick light_samples_ of them with probability in
+   *  proportion to how much they could add, and weight each by one over
+   *  the chance of picking it.
    */
-  for (const std::unique_ptr<Light>& uLight : scene_->lights_)
+  std::vector<float>& cdf = context.light_weights;
+  cdf.resize(candidates.size());
+  float total = 0.0f;
+  for (size_t i = 0; i < candidates.size(); ++i)
   {
-    Light* light = uLight.get();
+    const Light* light = lights.light(candidates[i]);
+    total += light->intensity_ * light->attenuation((light->position() - data.hit_point).norm());
+    cdf[i] = total;
+  }
 
-    // Trace for shadows here
-    Vector3f hitToLight = light->position() - data.hit_point;
-    Ray shadowray(data.hit_point + hitToLight.normalized(), hitToLight);
-    HitData shadowhit;
+  if (total <= 0.0f)
+    return out;
+
+  const uint32_t firstPick = BounceDimension(depth, light_samples_) + 1;
+  for (int k = 0; k < light_samples_; ++k)
+  {
+    float u = Utility::random_unit(seed, firstPick + k) * total;
+    size_t pick = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    pick = (std::min)(pick, cdf.size() - 1);
+
+    float weight = cdf[pick] - (pick > 0 ? cdf[pick - 1] : 0.0f);
+    float probability = weight / total;
+
+    out += DirectLighting(ray, data, *material, candidates[pick], context) / (probability * light_samples_);
+  }
+
+  return out;
+}
 
+Vector4f RayTracer::DirectLighting(const Ray& ray, const HitData& data, const Material& material,
+                                   int lightIndex, TraceContext& context) const
+{
+  using namespace std;
+
+  Light* light = scene_->light_tree().light(lightIndex);
+  Surface*& occluder = context.last_occluder[lightIndex];
+
+  // Trace for shadows here, only blockers between the point and the light count
+  Vector3f hitToLight = light->position() - data.hit_point;
+  float lightDistance = hitToLight.norm();
+  float attenuation = light->attenuation(lightDistance);
+  if (attenuation <= 0.0f)
+    return Vector4f::Zero();
+
+  Ray shadowray(data.hit_point, hitToLight / lightDistance);
+
+  // A re-shaded hit knows what it saw of every light that did not change
+  int cached = context.replay_hit >= 0 ? CachedShadow(context, lightIndex) : -1;
+  bool bShadow = false;
+  Surface* blocker = nullptr;
+  if (cached >= 0)
+  {
+    bShadow = (context.replay->shadows[cached] & 1) == 0;
+    blocker = context.replay->blockers[cached];
+    ++context.stats.cached_shadows;
+  }
+  else if (MappedShadow(shadowray, data, lightIndex, lightDistance, bShadow, blocker))
+  {
+    ++context.stats.mapped_shadows;
+    if (bShadow)
+      occluder = blocker;
+  }
+  else
+  {
     // Check intersection data for shadows, ignore data.hit_surface
-    bool bShadow = scene_->IntersectSurfaces(shadowray, shadowhit, data.hit_surface);
-    if ( shadowhit.hit_surface != nullptr)
+    ++context.stats.shadow_rays;
+
+    // Try the surface that blocked this light last time on this thread first,
+    // a hit there settles the query with a single primitive test.
+    bool tested = shadow_cache_ && occluder && occluder != data.hit_surface;
+    if (tested)
     {
-      // Calculate the diffuse lighting color
-      float ndotl = data.normal.dot(hitToLight.normalized());
-      Vector4f Ldiff = material->diffuse() * light->intensity_ * max(0.0f, ndotl);
+      HitData shadowhit;
+      shadowhit.tMax = lightDistance;
+      bShadow = occluder->Intersect(shadowray, shadowhit);
+    }
 
-      // Specular Light calculations
-      // Subtract the ray direction instead of add to reverse direction
-      Vector3f halfdir = (hitToLight.normalized() - ray.direction()).normalized();
-      float ndoth = data.normal.dot(halfdir);
-      Vector4f Lspec = material->specular() * light->intensity_ * pow(max(0.0f, ndoth), material->specular_power());
+    if (bShadow)
+    {
+      ++context.stats.occluder_hits;
+    }
+    else
+    {
+      // Only a surface that was tried can miss
+      if (tested)
+        ++context.stats.occluder_misses;
+      bShadow = scene_->Occluded(shadowray, lightDistance, data.hit_surface, &occluder);
+    }
+
+    if (bShadow)
+      blocker = occluder;
+  }
+
+  if (context.record)
+  {
+    context.record->shadows.push_back(lightIndex * 2 + (bShadow ? 0 : 1));
+    context.record->blockers.push_back(blocker);
+  }
+
+  if (bShadow)
+    return Vector4f::Zero();
+
+  float intensity = light->intensity_ * attenuation;
 
-      out += Ldiff + Lspec;
+  // Calculate the diffuse lighting color
+  float ndotl = data.normal.dot(shadowray.direction());
+  Vector4f Ldiff = material.diffuse() * intensity * max(0.0f, ndotl);
+
+  // Specular Light calculations
+  // Subtract the ray direction instead of add to reverse direction
+  Vector3f halfdir = (shadowray.direction() - ray.direction()).normalized();
+  float ndoth = data.normal.dot(halfdir);
+  Vector4f Lspec = material.specular() * intensity * pow(max(0.0f, ndoth), material.specular_power());
+
+  return Ldiff + Lspec;
+}
+
+bool RayTracer::VisibleHit(const Ray& ray, TraceContext& context, HitData& data, bool& hit) const
+{
+  const VisibilityBuffer& visibility = *context.visibility;
+  const int pixel = context.rays.pixel_y[context.replay_path] * visibility.width +
+                    context.rays.pixel_x[context.replay_path];
+  const int count = visibility.counts[pixel];
+  if (count < 0)
+    return false;
+
+  // The tests IntersectSurfaces makes in the order it makes them, minus
+  // the surfaces that cannot be in front
+  hit = false;
+  const int* candidates = visibility.pixel_candidates(pixel);
+  for (int i = 0; i < count; ++i)
+  {
+    HitData candidate;
+    candidate.tMax = data.tMax;
+    if (visibility_surfaces_[candidates[i]]->Intersect(ray, candidate))
+    {
+      data = candidate;
+      data.tMax = candidate.t;
+      hit = true;
     }
   }
 
-  return out;
+  ++context.stats.rasterized;
+  return true;
+}
+
+bool RayTracer::MappedShadow(const Ray& shadowray, const HitData& data, int light, float distance, bool& shadow,
+                             Surface*& blocker) const
+{
+  if (light >= (int)shadow_maps_.size())
+    return false;
+
+  Surface* solid = nullptr;
+  ShadowTest test = shadow_maps_[light].Test(data.hit_point, data.hit_surface, &solid);
+  if (test == ShadowUnknown)
+    return false;
+
+  // Certain but for rays that start right next to it, one test settles it
+  if (test == ShadowBlocked)
+  {
+    HitData shadowhit;
+    shadowhit.tMax = distance;
+    if (!solid->Intersect(shadowray, shadowhit))
+      return false;
+    blocker = solid;
+  }
+  shadow = test == ShadowBlocked;
+  return true;
+}
+
+int RayTracer::CachedShadow(const TraceContext& context, int light) const
+{
+  if (context.dirty_lights && light < (int)context.dirty_lights->size() && (*context.dirty_lights)[light])
+    return -1;
+
+  const HitSamples& replay = *context.replay;
+  int hit = context.replay_hit;
+  for (int s = replay.hits[hit].first_shadow; s < replay.shadow_end(hit); ++s)
+  {
+    if (replay.shadows[s] / 2 == light)
+      return s;
+  }
+
+  // Lit for the first time, it moved into range or was added
+  return -1;
 }
 
 void RayTracer::set_sampling_type(PostProcess type)
 {
+  reset_accumulation();
+
   switch(type)
   {
     case PostProcess::NoSampling:
@@ -160,48 +1749,34 @@ void RayTracer::set_sampling_type(PostProcess type)
 void RayTracer::set_sample_rate(int sample_rate)
 {
     sample_rate_ = sample_rate;
+    reset_accumulation();
 }
 
-Vector4f RayTracer::NoSampling(int x, int y)
+void RayTracer::set_samples_per_pixel(int samples)
 {
-  Ray ray = camera_->GetRayFromEye(x, y);
-  return Trace(ray, max_trace_time_);
+    samples_per_pixel_ = samples;
+    reset_accumulation();
 }
 
-Vector4f RayTracer::UniformSampling(int x, int y)
+void RayTracer::NoSampling(int, int, int, float& dx, float& dy) const
 {
-    Vector4f result;
-    float coef = 1.0f / sample_rate_;
-    for (float dy = 0.0f; dy < 1.0f; dy += coef)
-    {
-        for (float dx = 0.0f; dx < 1.0f; dx += coef)
-        {
-            Ray ray = camera_->GetRayFromEye(x, y, dx, dy);
-            result += Trace(ray, max_trace_time_);
-        }
-    }
-    return result * coef * coef;
+  dx = dy = 0.5f;
 }
 
-Vector4f RayTracer::RandomSampling(int x, int y)
+void RayTracer::UniformSampling(int, int, int sample, float& dx, float& dy) const
 {
-  // Random number generator for ray random sampling
-  std::default_random_engine generator;
-  std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-
-  // NOTE: this could be cheaper by avoiding the conversion
-  // from int to float, make sampling rate a float.
-  Vector4f result;
-  float s2 = sample_rate_ * sample_rate_;
-  for (int i = 0; i < s2; ++i)
-  {
-    float dx = distribution(generator);
-    float dy = distribution(generator);
-
-    Ray ray = camera_->GetRayFromEye(x, y, dx, dy);
-    result += Trace(ray, max_trace_time_);
-  }
+    // Walk the sample_rate * sample_rate grid one cell per sample
+    int cell = sample % (sample_rate_ * sample_rate_);
+    float coef = 1.0f / sample_rate_;
+    dx = (cell % sample_rate_) * coef;
+    dy = (cell / sample_rate_) * coef;
+}
 
-  // Return the total result divided by the sampling rate^2
-  return result / s2;
+void RayTracer::RandomSampling(int x, int y, int sample, float& dx, float& dy) const
+{
+  // Offsets are a function of the pixel and sample, every pixel gets its own
+  // sequence and re-tracing a sample gives the same ray.
+  uint32_t seed = Utility::sample_seed(x, y, sample);
+  dx = Utility::random_unit(seed, 0);
+  dy = Utility::random_unit(seed, 1);
 }
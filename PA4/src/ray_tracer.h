@@ -12,16 +12,20 @@
 
 #define NOMINMAX
 
-#include <GL/glew.h>
-#include <GL/glut.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
 #include <fstream>
 #include <vector>
 #include <random>
 #include <memory>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <unordered_map>
 
 #include <Eigen/Core>
 
@@ -29,6 +33,13 @@
 #include "scene.hpp"
 #include "primitives/material.hpp"
 #include "primitives/camera.hpp"
+#include "checkpoint.hpp"
+#include "denoiser.h"
+#include "rasterizer.h"
+#include "shadow_map.h"
+#include "thread_pool.hpp"
+#include "tile.hpp"
+#include "tiled_frame_buffer.hpp"
 #include "utility.h"
 
 namespace raytracer
@@ -42,12 +53,244 @@ enum PostProcess
   NoSampling,
   UniformSampling,
   RandomSampling
-} SamplingType;
+};
+
+// What a call to Render got done
+struct FrameStats
+{
+  float elapsed_ms;           // Wall time spent tracing
+  int tiles;                  // Tiles traced, one sample per pixel each
+  long long samples;          // Samples traced
+  int min_samples;            // Fewest samples any pixel has now
+  float target_coverage;      // Fraction of pixels with all their samples
+  bool deadline_hit;          // Stopped because the time budget ran out
+  long long reprojected;      // Pixels started from the frame before
+  float raster_ms;            // Of elapsed_ms, drawing the visibility buffer
+};
+
+// Counters for the rays a thread traced
+struct RayStats
+{
+  long long primary_rays;
+  long long secondary_rays;     // Reflection rays
+  long long shadow_rays;
+  long long terminated_paths;   // Reflection paths cut by the throughput test
+  long long occluder_hits;      // Shadow rays blocked by the cached occluder
+  long long occluder_misses;    // Shadow rays the cached occluder was tried on and missed
+  long long cached_hits;        // Hits re-shaded from the hit cache instead of traced
+  long long cached_shadows;     // Shadow rays answered by the hit cache
+  long long rasterized;         // Primary rays that only tested what the visibility buffer lists
+  long long mapped_shadows;     // Shadow rays the shadow maps answered instead
+
+  RayStats() :
+    primary_rays(0), secondary_rays(0), shadow_rays(0), terminated_paths(0),
+    occluder_hits(0), occluder_misses(0), cached_hits(0), cached_shadows(0), rasterized(0),
+    mapped_shadows(0)
+  {}
+
+  RayStats& operator+=(const RayStats& other)
+  {
+    primary_rays += other.primary_rays;
+    secondary_rays += other.secondary_rays;
+    shadow_rays += other.shadow_rays;
+    terminated_paths += other.terminated_paths;
+    occluder_hits += other.occluder_hits;
+    occluder_misses += other.occluder_misses;
+    cached_hits += other.cached_hits;
+    cached_shadows += other.cached_shadows;
+    rasterized += other.rasterized;
+    mapped_shadows += other.mapped_shadows;
+    return *this;
+  }
+};
+
+// One surface a camera path hit, as the hit cache keeps it
+struct CachedHit
+{
+  Surface* surface;
+  Vector3f point, normal;
+  int first_shadow;           // Its lights in HitSamples::shadows
+};
+
+/**
+ *  What one sample of a tile hit, path after path in scanline order, and
+ *  which of the lights shaded at every hit were visible. Shading it again
+ *  gives the color tracing it would, as long as no surface moved.
+ */
+struct HitSamples
+{
+  std::vector<int> paths;         // First hit of every path, and one past the last
+  std::vector<uint8_t> escaped;   // Per path, it left the scene after its hits
+  std::vector<CachedHit> hits;
+  std::vector<int> shadows;       // Light index * 2, plus 1 if the light was visible
+  std::vector<Surface*> blockers; // Per shadow, what was in the way of the light
+
+  void clear()
+  {
+    paths.clear();
+    escaped.clear();
+    hits.clear();
+    shadows.clear();
+    blockers.clear();
+  }
+
+  // Shadows of hits[hit] are [first_shadow, shadow_end(hit))
+  int shadow_end(int hit) const
+  {
+    return hit + 1 < (int)hits.size() ? hits[hit + 1].first_shadow : (int)shadows.size();
+  }
+
+  // Copy a path of other to the end, call finish after the last one
+  void append_path(const HitSamples& other, int path)
+  {
+    int first = other.paths[path], last = other.paths[path + 1];
+    paths.push_back((int)hits.size());
+    escaped.push_back(other.escaped[path]);
+    if (first == last)
+      return;
+
+    int shadowFirst = other.hits[first].first_shadow, shadowLast = other.shadow_end(last - 1);
+    int shift = (int)shadows.size() - shadowFirst;
+    for (int h = first; h < last; ++h)
+    {
+      hits.push_back(other.hits[h]);
+      hits.back().first_shadow += shift;
+    }
+    shadows.insert(shadows.end(), other.shadows.begin() + shadowFirst, other.shadows.begin() + shadowLast);
+    blockers.insert(blockers.end(), other.blockers.begin() + shadowFirst, other.blockers.begin() + shadowLast);
+  }
+
+  void finish() { paths.push_back((int)hits.size()); }
+};
+
+// Per thread state handed down through Trace, one per pool slot
+struct TraceContext
+{
+  RayStats stats;
+
+  // Last surface that blocked a shadow ray, per light. Neighbouring
+  // shading points are usually blocked by the same one.
+  std::vector<Surface*> last_occluder;
+
+  // Camera rays of the tile being traced, and what each of them saw
+  RayBuffer rays;
+  std::vector<Vector4f> colors;
+  std::vector<Vector4f> sums;     // Per pixel totals of a tile traced to the end
+  std::vector<float> rgb;         // and their averages
+
+  // Scratch space for picking the lights of a shading point
+  std::vector<int> light_candidates;
+  std::vector<float> light_weights;
+
+  // The sample being traced goes into record when it is not null. When
+  // re-shading, hits come out of replay instead of the scene, and only
+  // the lights flagged in dirty_lights trace their shadow rays again.
+  HitSamples* record;
+  const HitSamples* replay;
+  const std::vector<uint8_t>* dirty_lights;
+  int replay_path;            // Camera ray of the tile Trace is following, its path in replay
+  int replay_hit;             // Hit of replay being shaded, -1 if it was traced
+  HitSamples reshaded;        // Where Reshade records, swapped into the cache
+  HitSamples retraced;        // Paths Rerender traced again, merged into reshaded
+  std::vector<int> pixels;    // Pixels of the tile Rerender traces again
+
+  // First hit of every camera ray of the tile, with the feature buffers
+  // on or features set. Normal and distance, and diffuse albedo with 1 in
+  // w, 0 if it escaped.
+  std::vector<Vector4f> first_normals, first_albedos;
+  std::vector<Vector4f> normal_sums, albedo_sums;   // Their totals, like sums
+  bool features;
+
+  // Every ray through the pixel center whatever the sampler, for previews
+  bool centered;
+
+  // Camera the tile is traced from, the tracer's own when null
+  const Camera* camera;
+
+  // Camera rays test only the surfaces it lists for their pixel, when set
+  const VisibilityBuffer* visibility;
+  HitSamples first_hits;      // First sample of a RenderViews tile
+
+  TraceContext() :
+    record(nullptr), replay(nullptr), dirty_lights(nullptr), replay_path(0), replay_hit(-1),
+    features(false), centered(false), camera(nullptr), visibility(nullptr)
+  {}
+};
+
+// One camera of RayTracer::RenderViews and the image it gets
+struct RenderView
+{
+  Camera camera;                  // Its resolution is the size of the image
+  std::vector<Vector4f> image;    // width * height top row first
+
+  // What the first sample of every pixel hit, null where it escaped.
+  // Lets the next frame of a camera move reproject this one.
+  std::vector<Surface*> surfaces;
+  std::vector<Vector3f> points;
+
+  RenderView() {}
+  explicit RenderView(const Camera& camera) : camera(camera) {}
+};
+
+/**
+ *  A frame RayTracer::RenderAsync traces in the background. Every tile
+ *  gets all its samples and lands in image() when it is done, the futures
+ *  say when that happened or that the tile was dropped.
+ */
+class AsyncFrame
+{
+  friend class RayTracer;
+public:
+  AsyncFrame(const AsyncFrame&) = delete;
+  AsyncFrame& operator=(const AsyncFrame&) = delete;
+
+  // Tiles not started are dropped, the ones in progress stop after the
+  // sample they are on
+  void cancel() { cancelled_ = true; }
+  bool cancelled() const { return cancelled_; }
+
+  // Block until every tile is done or dropped, true if the frame is whole
+  bool wait() const { return finished_.get(); }
+  bool ready() const { return finished_.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+
+  // True once tiles()[index] is in the image, false if it was dropped
+  std::shared_future<bool> tile(int index) const { return tile_futures_[index]; }
+
+  // Same as wait, as a future
+  std::shared_future<bool> finished() const { return finished_; }
+
+  const std::vector<Tile>& tiles() const { return tiles_; }
+  int tiles_done() const { return tiles_done_; }
+
+  // width * height top row first, tiles that are not done are black
+  const std::vector<Vector4f>& image() const { return image_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+private:
+  AsyncFrame(const std::vector<Tile>& tiles, int width, int height);
+
+  // Resolve the tiles that never made it and the frame, once
+  void Finish();
+private:
+  std::vector<Tile> tiles_;
+  int width_, height_;
+  std::vector<Vector4f> image_;
+
+  std::vector<std::promise<bool>> tile_promises_;
+  std::vector<std::shared_future<bool>> tile_futures_;
+  std::vector<char> tile_resolved_;
+  std::promise<bool> finished_promise_;
+  std::shared_future<bool> finished_;
+
+  std::atomic<bool> cancelled_;
+  std::atomic<int> tiles_done_;
+};
 
 class RayTracer
 {
-  // This is to define a member function pointer type
-  typedef Vector4f (RayTracer::*SamplingFunction)(int x, int y);
+  // This is to define a member function pointer type, gives the offset inside
+  // the pixel of one sample
+  typedef void (RayTracer::*SamplingFunction)(int x, int y, int sample, float& dx, float& dy) const;
   typedef size_t frame_buffer_size_t;
 public:
   /**
@@ -58,6 +301,12 @@ public:
   ~RayTracer();
 
   void initialize(std::unique_ptr<Scene>& scene);
+
+  /**
+   *  Trace a scene other tracers may be tracing too. It has to be built
+   *  already and must not change while any of them renders.
+   */
+  void initialize(std::shared_ptr<Scene> scene);
   /**
    *  Resize the window
    *  @param w width
@@ -72,6 +321,274 @@ public:
 
   // Set anti-aliasing sample rate, 1x, 2x, 4x, 8x, 16x
   void set_sample_rate(int sample_rate);
+
+  // Samples per pixel to converge to, 0 goes by the sampling type and rate
+  void set_samples_per_pixel(int samples);
+
+  // Move the camera, restarts accumulation
+  void set_camera_position(Vector3f position);
+
+  // Time budget for one Render call in milliseconds, 0 to trace a full pass
+  void set_max_trace_time(float milliseconds) { max_trace_time_ = milliseconds; }
+
+  // Worker threads used to trace tiles, 0 uses every hardware thread
+  void set_thread_count(int threads);
+
+  // Trace on a pool shared with other tracers instead of one of our own
+  void set_thread_pool(std::shared_ptr<ThreadPool> pool);
+
+  // Priority of our tiles against the other work on the pool
+  void set_priority(TaskPriority priority) { priority_ = priority; }
+
+  // Most reflection bounces a path can take
+  void set_max_trace_depth(int depth);
+
+  /**
+   *  Reflection paths whose remaining weight drops below epsilon stop
+   *  bouncing. With russian roulette they instead survive with probability
+   *  weight / epsilon and carry the lost weight, which keeps the image
+   *  unbiased. epsilon 0 traces every path to max trace depth.
+   */
+  void set_path_termination(float epsilon, bool russian_roulette = false);
+
+  /**
+   *  Shade at most this many lights per hit, chosen at random in proportion
+   *  to their estimated contribution. 0 shades every light in range.
+   */
+  void set_light_samples(int samples);
+
+  // Test the last occluder of each light before querying the whole scene
+  void set_shadow_cache(bool enabled) { shadow_cache_ = enabled; }
+
+  /**
+   *  Find what camera rays hit first by rasterizing the scene into a
+   *  visibility buffer, once per camera and scene, instead of querying
+   *  every surface for every one of them. A camera ray then only tests the
+   *  few surfaces that may be in front in its pixel, and from its hit on
+   *  only shadow and reflection rays are traced. The image is the same.
+   *  Pixels with too many surfaces still query the scene, and scenes with
+   *  a surface that cannot be tessellated, or a camera inside one, are
+   *  traced throughout.
+   */
+  void set_raster_primary(bool enabled);
+
+  /**
+   *  Draw a cube shadow map of size by size pixels a face around every
+   *  light, 0 for none. Shadow queries the maps answer for certain, points
+   *  with nothing but their own surface towards the light and points with
+   *  something solid all around the way there, trace no ray, the latter
+   *  test only what is in the way. The rest, near shadow edges, are traced
+   *  as before and the image is the same. The maps are drawn again before
+   *  tracing whenever a surface or light has moved.
+   */
+  void set_shadow_maps(int size) { shadow_map_size_ = (std::max)(size, 0); }
+
+  // How long drawing the shadow maps took the last time they changed
+  float shadow_map_ms() const { return shadow_map_ms_; }
+
+  /**
+   *  Keep what every sample Render traces hit, so material and light edits
+   *  can be re-shaded with Reshade instead of traced again, and a moved
+   *  surface only retraces the pixels it affects with Rerender. Costs about
+   *  50 bytes per hit of every sample, and a bit per pixel per surface.
+   *  Turning it on starts the image over.
+   */
+  void set_hit_cache(bool enabled);
+  bool hit_cache() const { return hit_cache_; }
+
+  /**
+   *  Average the normal, distance and albedo of the first hit of every
+   *  sample Render traces, the guides Denoise needs. Costs 32 bytes per
+   *  pixel. Turning it on starts the image over.
+   */
+  void set_feature_buffers(bool enabled);
+
+  // Rays traced since the last reset_ray_stats, summed over all threads
+  RayStats ray_stats() const;
+  void reset_ray_stats();
+
+  /**
+   *  Progressive render called by the idle function. Work is split into
+   *  tiles, tracing a tile adds one sample to each of its pixels and resolves
+   *  the running average into the frame buffer.
+   *
+   *  Without a time budget every call adds one sample per pixel. With one,
+   *  tiles and sample passes are handed out until the budget is spent, the
+   *  tiles with the fewest samples first, and the frame buffer holds the best
+   *  image so far. Does nothing once the image has all the samples the
+   *  sampling settings ask for.
+   */
+  FrameStats Render();
+
+  // Called on a worker thread as each tile lands, and once at the end
+  typedef std::function<void(const AsyncFrame& frame, int tile)> TileCallback;
+  typedef std::function<void(const AsyncFrame& frame, bool complete)> FrameCallback;
+
+  /**
+   *  Start tracing a frame with the current settings and return right
+   *  away. A frame still in flight is cancelled, it is stale once a new
+   *  one is asked for. Changing any setting, resizing, Reshade, Rerender
+   *  and RenderRects cancel and wait for the frames in flight first, they
+   *  hold on to the old ones. So do RenderAsync and Render when the shadow
+   *  maps have to be drawn again. Edit the scene itself only after
+   *  cancel_async or once the frames are done.
+   *
+   *  tile_done runs as each tile lands in the image and frame_done once
+   *  after the last, with complete false if the frame was cancelled. Both
+   *  run on worker threads and must not call back into the tracer.
+   */
+  std::shared_ptr<AsyncFrame> RenderAsync(const TileCallback& tile_done = nullptr,
+                                          const FrameCallback& frame_done = nullptr);
+
+  // Cancel every frame in flight and wait until the workers let go of them
+  void cancel_async();
+
+  /**
+   *  Throw away the accumulated samples, call after editing the scene.
+   *  Camera and sampling setters already do this.
+   */
+  void reset_accumulation();
+
+  /**
+   *  Shade the samples traced so far again after editing materials or
+   *  lights, from the hit cache. The lights listed, by index in the scene,
+   *  trace their shadow rays again, the others keep what the cache says.
+   *  Build the scene first if any of them moved. Paths that reflect further
+   *  than before trace the rest of their way. The image comes out exactly
+   *  as tracing the edited scene would make it.
+   *
+   *  Moving a surface or removing a light still needs reset_accumulation.
+   *  Without the hit cache, or if it missed samples, this is what it does.
+   */
+  FrameStats Reshade(const std::vector<int>& lights = std::vector<int>());
+
+  /**
+   *  Move or reshape surface with edit and trace again only the pixels it
+   *  can have changed: those with a ray that hit it or was shadowed by it,
+   *  which the hit cache keeps track of, and those with a ray through its
+   *  new bounds. Every one of their samples is traced again, the image
+   *  comes out as tracing the edited scene would make it.
+   *
+   *  Without the hit cache, or for a surface without bounds, the whole
+   *  image starts over.
+   */
+  FrameStats Rerender(Surface* surface, const std::function<void(Surface& surface)>& edit);
+
+  /**
+   *  Render a whole frame straight into an out of core frame buffer, its
+   *  size is the image size. Every tile gets all its samples in one go,
+   *  so the in memory buffers are neither used nor touched and the image
+   *  can be far bigger than they could hold.
+   *
+   *  band_done(band) is called as soon as a row of tiles is finished, in
+   *  order and one at a time, while the other workers keep tracing. It
+   *  returns false to stop the render.
+   */
+  FrameStats RenderTiled(TiledFrameBuffer& target, const std::function<bool(int band)>& band_done);
+
+  /**
+   *  Trace all the samples of some rects of a width by height image, the
+   *  building block of RenderTiled and of rendering on other machines.
+   *  done(index, rgb) gets the averages of rects[index] as RGB floats in
+   *  scanline order, on the worker thread that traced it. It returns false
+   *  to stop the render.
+   */
+  FrameStats RenderRects(const std::vector<Tile>& rects, int width, int height,
+                         const std::function<bool(int index, const float* rgb)>& done);
+
+  /**
+   *  RenderRects that picks up where an earlier render of the same rects
+   *  left off. resume(index, sums) may fill in the per pixel sums of the
+   *  samples rects[index] already has and returns how many those are, 0
+   *  traces the rect from scratch. done also gets the sums, to carry on
+   *  from later. Samples are summed in order either way, so a resumed rect
+   *  comes out exactly like one traced in one go.
+   */
+  FrameStats RenderRects(const std::vector<Tile>& rects, int width, int height,
+                         const std::function<int(int index, Vector4f* sums)>& resume,
+                         const std::function<bool(int index, const Vector4f* sums, const float* rgb)>& done);
+
+  /**
+   *  Render several views of the scene as one job, stereo pairs, cube map
+   *  faces or turntable frames. They share the scene, its accelerator and
+   *  the pool, and their tiles are handed out interleaved: tile 0 of every
+   *  view, then tile 1 of every view, so the views being traced at once
+   *  look at much the same geometry while it is in cache. Every tile gets
+   *  all its samples, each image is exactly what rendering its camera
+   *  alone would give. The tracer's own camera and buffers are not used.
+   */
+  FrameStats RenderViews(std::vector<RenderView>& views);
+
+  /**
+   *  Render view as the frame after previous in a camera move through a
+   *  scene that did not change. A pixel whose first sample hits a surface
+   *  previous saw all around the same point starts from the color previous
+   *  had there and traces fresh_samples. If their average is within
+   *  tolerance of it, in every channel, the reused color stands in for the
+   *  rest of the samples. Where it is not, a reflection or a highlight
+   *  that moved, and for every other pixel, all the samples are traced.
+   *  With an empty previous, RenderView(), the image is exactly what
+   *  RenderViews makes.
+   */
+  FrameStats RenderReprojected(RenderView& view, const RenderView& previous, int fresh_samples = 2,
+                               float tolerance = 0.05f);
+
+  /**
+   *  A quick look at the scene as it is now for while it is moving, traced
+   *  at 1 / scale of the resolution in each direction with one sample
+   *  through the middle of every low resolution pixel. image gets it at
+   *  full size, each pixel blended from the samples around it that saw the
+   *  same surface as the nearest one, so silhouettes stay sharp and only
+   *  the shading in between is interpolated. About scale * scale times
+   *  faster than a sample per pixel. Accumulation is left alone, Render
+   *  carries on where it was.
+   */
+  FrameStats RenderPreview(int scale, std::vector<Vector4f>& image);
+
+  /**
+   *  Filter the image Render accumulated so far into image, with the edge
+   *  avoiding wavelet filter of denoiser.h guided by the feature buffers,
+   *  on the tracer's pool. A few samples per pixel filtered come close to
+   *  many unfiltered. Without feature buffers image is the frame buffer.
+   *  Samples a restored state brought have no features, the guides only
+   *  know the ones traced since.
+   */
+  void Denoise(std::vector<Vector4f>& image, const DenoiseSettings& settings = DenoiseSettings());
+
+  /**
+   *  Copy the accumulated samples out, cheap enough to call between Render
+   *  calls. Hand the copy to a CheckpointWriter to get it on disk.
+   */
+  void save_state(RenderState& state) const;
+
+  /**
+   *  Carry on from a saved state instead of starting over. Refused with
+   *  false when the resolution or anything that changes the samples
+   *  differs from the current settings, set those up first.
+   */
+  bool restore_state(const RenderState& state);
+
+  /**
+   *  Hash of every setting that changes what a sample traces to. The sample
+   *  count is left out, a resumed render may go on to more samples. So is
+   *  the resolution when asked, for renders that pass their own size.
+   */
+  uint64_t SettingsFingerprint(bool resolution = true) const;
+
+  // Samples per pixel the current sampling settings converge to
+  int samples_per_pixel() const;
+
+  // Samples every pixel has accumulated so far
+  int sample_count() const { return min_samples_; }
+
+  // True once the frame buffer holds the converged image
+  bool converged() const { return min_samples_ >= samples_per_pixel(); }
+
+  int tile_size() const { return tile_size_; }
+
+  const Camera& camera() const { return *camera_; }
+  const std::vector<Vector4f>& frame_buffer() const { return frame_buffer_; }
+  const std::vector<int>& sample_counts() const { return sample_counts_; }
 private:
   void Idle();
   /**
@@ -79,45 +596,158 @@ private:
    */
   void Display();
 
+  // Start the worker threads if they are not running, and draw the
+  // shadow maps again if the scene changed
+  void StartPool();
+
+  // Draw a shadow map per light unless the ones there are still current
+  void UpdateShadowMaps();
+
+  // Add one sample to every pixel of tiles_[tile]
+  void RenderTile(int tile, TraceContext& context);
+
+  // Trace all the samples of rect of view, or fresh_samples where previous
+  // can be reprojected. Returns the pixels it reprojected.
+  int RenderViewTile(RenderView& view, const Tile& rect, const RenderView* previous, int fresh_samples,
+                     float tolerance, TraceContext& context);
+
+  // Color of previous where the first hit of pixel of view lands in it,
+  // false if that is not the same surface all around
+  bool Reproject(const RenderView& view, int pixel, const RenderView& previous, Vector4f& color) const;
+
+  // Fewest samples and how much of the frame has all of them
+  void MeasureCoverage(FrameStats& stats) const;
+
+  // Trace sample number sample of every pixel in rect into context.colors,
+  // in scanline order. With pixels, only those, by index in that order.
+  void TraceTileSample(const Tile& rect, int sample, TraceContext& context,
+                       const std::vector<int>* pixels = nullptr);
+
+  // Note the surfaces path of hits hit or was shadowed by as ones pixel of
+  // tiles_[tile] depends on
+  void MarkTouched(int tile, int pixel, const HitSamples& hits, int path);
+
+  // Fill touched_ from the recorded hits if a reset left it out of date
+  void BuildTouched();
+
+  // True if a ray of path, camera ray first, goes through min to max
+  bool CrossesBounds(const Ray& ray, const HitSamples& hits, int path,
+                     const Vector3f& min, const Vector3f& max) const;
+
   /**
-   *  Ray trace render function called by idle function
-   */
-  void Render();
-  /**
-   *  Trace a ray through the scene recursively.
+   *  Trace a ray through the scene, following reflections iteratively while
+   *  carrying the weight the rest of the path still has on the result.
    *  @param ray Ray to shoot through scene.
-   *  @param depth should alwyas be 0, else used recursively.
-   *  @return HitData information on the ray trace
+   *  @param seed random seed of the sample, used by russian roulette.
+   *  @param context per thread counters.
+   *  @return color seen along the ray
    */
-  Vector4f Trace(const Ray& ray, int depth) const;
+  Vector4f Trace(const Ray& ray, uint32_t seed, TraceContext& context) const;
+
+  // Use ray and hit data to calculate the color at the point, depth
+  // bounces down the path the sample seed belongs to.
+  Vector4f LocalShading(const Ray& ray, const HitData& Data, uint32_t seed, int depth,
+                        TraceContext& context) const;
+
+  // Diffuse and specular light one light adds at the hit, 0 if shadowed
+  Vector4f DirectLighting(const Ray& ray, const HitData& data, const Material& material,
+                          int light, TraceContext& context) const;
+
+  // What the shadow map of light says about the shadow ray from the hit
+  // in data, distance long, false if it cannot tell
+  bool MappedShadow(const Ray& shadowray, const HitData& data, int light, float distance, bool& shadow,
+                    Surface*& blocker) const;
 
-  // Use ray and hit data to calculate the color at the point.
-  Vector4f LocalShading(const Ray& ray, const HitData& Data) const;
+  // What the replayed hit saw of light, index in its shadows, -1 to trace it
+  int CachedShadow(const TraceContext& context, int light) const;
 
-  // Simply shoots a ray.
-  Vector4f NoSampling(int x, int y);
+  // Closest hit of the camera ray being traced among the surfaces the
+  // visibility buffer lists for its pixel, false if the pixel needs tracing
+  bool VisibleHit(const Ray& ray, TraceContext& context, HitData& data, bool& hit) const;
 
-  // Uses evenly spaced ray's in the pixel. Uses sample * sample.
-  Vector4f UniformSampling(int x, int y);
+  // Simply shoots a ray through the pixel center.
+  void NoSampling(int x, int y, int sample, float& dx, float& dy) const;
 
-  // Uses a random number generator in the [0,1] space to perturb original ray
-  // sample * sample rays.
-  Vector4f RandomSampling(int x, int y);
+  // Uses evenly spaced ray's in the pixel, sample picks the cell of the
+  // sample * sample grid.
+  void UniformSampling(int x, int y, int sample, float& dx, float& dy) const;
+
+  // Uses a random number in the [0,1] space to perturb original ray,
+  // the offsets are fixed per pixel and sample index.
+  void RandomSampling(int x, int y, int sample, float& dx, float& dy) const;
 private:
   // Main scene to draw
-  std::unique_ptr<Scene> scene_;
+  std::shared_ptr<Scene> scene_;
   std::unique_ptr<Camera> camera_;
 
-  // frame buffer
+  // frame buffer, holds the resolved average of the accumulation buffer
   std::vector<Vector4f> frame_buffer_;
   frame_buffer_size_t size_;
 
+  // Sum of every sample traced since the last reset and how many there are
+  std::vector<Vector4f> accumulation_buffer_;
+  std::vector<int> sample_counts_;
+
+  // Screen tiles and the samples each one has, Render works on the tiles
+  // with the fewest samples first
+  std::vector<Tile> tiles_;
+  std::vector<int> tile_samples_;
+  int tile_size_;
+  int min_samples_;
+
+  std::shared_ptr<ThreadPool> pool_;
+  int thread_count_;
+  TaskPriority priority_;
+  std::vector<TraceContext> contexts_;    // One per pool slot
+
+  std::vector<std::shared_ptr<AsyncFrame>> async_frames_;   // Started by RenderAsync
+
+  // Hits of every sample of every tile, with the hit cache on. Complete
+  // unless samples came from somewhere else, a restored state.
+  std::vector<std::vector<HitSamples>> tile_hits_;
+  bool tile_hits_complete_;
+
+  // With the hit cache, a bit per pixel for every surface its rays hit or
+  // were shadowed by. Tiles start on a word of their own, so threads never
+  // share one. Built on the first Rerender after a reset, kept up to date
+  // by the samples after it.
+  std::unordered_map<const Surface*, int> surface_ids_;
+  std::vector<std::vector<uint64_t>> touched_;
+  std::vector<int> tile_bits_;
+  bool touched_built_;
+
   // Anti-aliasing settings
   int sample_rate_;
+  int samples_per_pixel_;     // Overrides the sample count of the sampler if set
   SamplingFunction sampler;   // Sampling function pointer used to call samplying type
 
-  float max_trace_time_;      // Trace maximum time
+  float max_trace_time_;      // Time budget of a Render call in ms, 0 is none
   int max_trace_depth_;       // Trace recursion maximum depth
+  float min_throughput_;      // Paths weighing less than this are terminated
+  bool russian_roulette_;     // Terminate those paths randomly instead
+  bool shadow_cache_;         // Per thread last occluder test for shadow rays
+  bool hit_cache_;            // Record the hits of every sample for Reshade
+  bool feature_buffers_;      // Sum the first hits into the buffers below
+
+  // With feature buffers, per pixel sums of what first_normals and
+  // first_albedos hold, over the same samples as the accumulation buffer
+  std::vector<Vector4f> normal_buffer_;
+  std::vector<Vector4f> albedo_buffer_;
+  int light_samples_;         // Lights shaded per hit, 0 for all in range
+
+  // With raster primary, what the camera sees and the surfaces its
+  // indices refer to, drawn again by Render after every reset
+  bool raster_primary_;
+  bool visibility_stale_;
+  VisibilityBuffer visibility_;
+  std::vector<Surface*> visibility_surfaces_;
+
+  // Per light in light tree order, and the surfaces and light positions
+  // they were drawn from
+  int shadow_map_size_;
+  std::vector<ShadowMap> shadow_maps_;
+  uint64_t shadow_maps_print_;
+  float shadow_map_ms_;
 };
 
 } // end of namespace raytracer
@@ -0,0 +1,437 @@
+/**
+ *
+ *  filename : render_cache.cpp
+ *  author   : Do Won Cha
+ *  content  : Disk cache of rendered frames, see render_cache.h
+ *
+ */
+
+#include "render_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "easylogging++.h"
+#include "fingerprint.hpp"
+
+namespace raytracer
+{
+
+namespace
+{
+
+const char kMagic[4] = { 'R', 'T', 'R', 'C' };
+const uint32_t kVersion = 1;
+const char kExtension[] = ".rtc";
+
+// Held while entries are written, evicted or counted, by any process
+class DirectoryLock
+{
+public:
+  explicit DirectoryLock(const std::string& directory) :
+    fd_(::open((directory + "/lock").c_str(), O_RDWR | O_CREAT, 0644))
+  {
+    if (fd_ >= 0)
+      flock(fd_, LOCK_EX);
+  }
+
+  ~DirectoryLock()
+  {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  DirectoryLock(const DirectoryLock&) = delete;
+  DirectoryLock& operator=(const DirectoryLock&) = delete;
+private:
+  int fd_;
+};
+
+template<typename T>
+bool Write(FILE* file, const T* data, size_t count)
+{
+  return std::fwrite(data, sizeof(T), count, file) == count;
+}
+
+template<typename T>
+bool Read(FILE* file, T* data, size_t count)
+{
+  return std::fread(data, sizeof(T), count, file) == count;
+}
+
+// Start of every tile in the sums of an entry
+std::vector<size_t> TileOffsets(const std::vector<Tile>& tiles)
+{
+  std::vector<size_t> offsets(tiles.size());
+  size_t offset = 0;
+  for (size_t t = 0; t < tiles.size(); ++t)
+  {
+    offsets[t] = offset;
+    offset += (size_t)tiles[t].size() * 3;
+  }
+  return offsets;
+}
+
+bool EndsWith(const std::string& text, const std::string& end)
+{
+  return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+}
+
+} // end of anonymous namespace
+
+RenderCache::RenderCache() :
+  max_bytes_(0)
+{}
+
+bool RenderCache::open(const std::string& directory, long long max_bytes)
+{
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    LOG(ERROR) << "Could not create cache directory " << directory << ": " << std::strerror(errno);
+    return false;
+  }
+
+  directory_ = directory;
+  max_bytes_ = max_bytes;
+  return true;
+}
+
+FrameStats RenderCache::Render(RayTracer& tracer, uint64_t scene, int width, int height, int tile_size,
+                               const std::function<bool(int index, const float* rgb)>& done,
+                               CacheResult* result)
+{
+  using namespace std::chrono;
+  steady_clock::time_point start = steady_clock::now();
+
+  Fingerprint print;
+  print.add(scene);
+  print.add(tracer.SettingsFingerprint(false));
+  print.add(width);
+  print.add(height);
+  print.add(tile_size);
+  const uint64_t key = print.value();
+  const int samples = tracer.samples_per_pixel();
+
+  std::vector<Tile> tiles = MakeTiles(width, height, tile_size);
+  std::vector<size_t> offsets = TileOffsets(tiles);
+
+  // What this render ends up with, stored again afterwards
+  Entry entry;
+  entry.samples = samples;
+  entry.done.assign(tiles.size(), 0);
+  entry.sums.assign((size_t)width * height * 3, 0.0f);
+
+  std::string path = EntryPath(key, samples);
+  bool stored = ReadEntry(path, key, width, height, tile_size, (int)tiles.size(), entry);
+
+  Entry fewer;
+  fewer.samples = FewerSamples(key, samples);
+  bool resumable = fewer.samples > 0 &&
+                   ReadEntry(EntryPath(key, fewer.samples), key, width, height, tile_size, (int)tiles.size(), fewer);
+
+  CacheResult outcome;
+  bool stopped = false;
+  std::vector<float> rgb;
+  std::vector<Tile> rects;
+  std::vector<int> rectTiles;
+
+  // Stored tiles go out right away, with the same division tracing does
+  for (int t = 0; t < (int)tiles.size(); ++t)
+  {
+    if (!stored || !entry.done[t])
+    {
+      rects.push_back(tiles[t]);
+      rectTiles.push_back(t);
+      continue;
+    }
+    if (stopped)
+      continue;
+
+    const float* sums = &entry.sums[offsets[t]];
+    rgb.resize((size_t)tiles[t].size() * 3);
+    for (int i = 0; i < tiles[t].size(); ++i)
+    {
+      Vector4f color = Vector4f(sums[i * 3 + 0], sums[i * 3 + 1], sums[i * 3 + 2], 0.0f) / (float)samples;
+      rgb[i * 3 + 0] = color(0);
+      rgb[i * 3 + 1] = color(1);
+      rgb[i * 3 + 2] = color(2);
+    }
+    ++outcome.reused;
+    stopped = !done(t, rgb.data());
+  }
+
+  FrameStats stats = FrameStats();
+  std::atomic<int> resumed(0), finished(0);
+  if (!rects.empty() && !stopped)
+  {
+    stats = tracer.RenderRects(rects, width, height,
+      [&](int index, Vector4f* sums) {
+        int t = rectTiles[index];
+        if (!resumable || !fewer.done[t])
+          return 0;
+
+        const float* previous = &fewer.sums[offsets[t]];
+        for (int i = 0; i < tiles[t].size(); ++i)
+          sums[i] = Vector4f(previous[i * 3 + 0], previous[i * 3 + 1], previous[i * 3 + 2], 0.0f);
+        ++resumed;
+        return fewer.samples;
+      },
+      [&](int index, const Vector4f* sums, const float* pixels) {
+        int t = rectTiles[index];
+        float* out = &entry.sums[offsets[t]];
+        for (int i = 0; i < tiles[t].size(); ++i)
+        {
+          out[i * 3 + 0] = sums[i](0);
+          out[i * 3 + 1] = sums[i](1);
+          out[i * 3 + 2] = sums[i](2);
+        }
+        entry.done[t] = 1;
+        ++finished;
+        return done(t, pixels);
+      });
+  }
+
+  outcome.resumed = resumed;
+  outcome.traced = finished - resumed;
+  outcome.hit = outcome.reused == (int)tiles.size();
+
+  // New tiles are stored, a plain hit only counts as a use
+  int evictions = 0;
+  if (finished > 0)
+  {
+    DirectoryLock lock(directory_);
+    WriteEntry(path, key, width, height, tile_size, entry);
+    evictions = Evict(path);
+  }
+  else if (stored)
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+  Record(outcome, evictions);
+  if (result)
+    *result = outcome;
+
+  stats.elapsed_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+  stats.min_samples = stopped ? 0 : samples;
+  stats.target_coverage = stopped ? 0.0f : 1.0f;
+  return stats;
+}
+
+CacheStats RenderCache::stats() const
+{
+  CacheStats totals;
+  std::ifstream file(directory_ + "/stats");
+
+  std::string name;
+  long long value;
+  while (file >> name >> value)
+  {
+    if (name == "frames") totals.frames = value;
+    else if (name == "frame_hits") totals.frame_hits = value;
+    else if (name == "partial_hits") totals.partial_hits = value;
+    else if (name == "tiles_reused") totals.tiles_reused = value;
+    else if (name == "tiles_resumed") totals.tiles_resumed = value;
+    else if (name == "tiles_traced") totals.tiles_traced = value;
+    else if (name == "evictions") totals.evictions = value;
+  }
+  return totals;
+}
+
+std::string RenderCache::EntryPath(uint64_t key, int samples) const
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%d%s", (unsigned long long)key, samples, kExtension);
+  return directory_ + name;
+}
+
+bool RenderCache::ReadEntry(const std::string& path, uint64_t key, int width, int height, int tile_size,
+                            int tiles, Entry& entry) const
+{
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  char magic[4];
+  uint32_t version = 0, count = 0;
+  uint64_t storedKey = 0;
+  int32_t header[4];
+
+  bool ok = Read(file, magic, 4) && std::memcmp(magic, kMagic, 4) == 0 &&
+            Read(file, &version, 1) && version == kVersion &&
+            Read(file, &storedKey, 1) && storedKey == key &&
+            Read(file, header, 4) && header[0] == width && header[1] == height &&
+            header[2] == tile_size && header[3] == entry.samples &&
+            Read(file, &count, 1) && (int)count == tiles;
+
+  if (ok)
+  {
+    entry.done.resize(tiles);
+    entry.sums.resize((size_t)width * height * 3);
+    ok = Read(file, entry.done.data(), entry.done.size()) &&
+         Read(file, entry.sums.data(), entry.sums.size());
+  }
+  std::fclose(file);
+
+  if (!ok)
+  {
+    LOG(WARNING) << "Ignoring damaged cache entry " << path;
+    std::fill(entry.done.begin(), entry.done.end(), 0);
+  }
+  return ok;
+}
+
+bool RenderCache::WriteEntry(const std::string& path, uint64_t key, int width, int height, int tile_size,
+                             const Entry& entry) const
+{
+  // Written next to it and renamed over it, readers never see half an entry
+  static std::atomic<int> counter(0);
+  std::string temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+
+  FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    LOG(ERROR) << "Could not write cache entry " << temporary << ": " << std::strerror(errno);
+    return false;
+  }
+
+  int32_t header[4] = { width, height, tile_size, entry.samples };
+  uint32_t count = (uint32_t)entry.done.size();
+  bool ok = Write(file, kMagic, 4) && Write(file, &kVersion, 1) && Write(file, &key, 1) &&
+            Write(file, header, 4) && Write(file, &count, 1) &&
+            Write(file, entry.done.data(), entry.done.size()) &&
+            Write(file, entry.sums.data(), entry.sums.size());
+  ok = (std::fclose(file) == 0) && ok;
+  ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+
+  if (!ok)
+  {
+    LOG(ERROR) << "Failed writing cache entry " << path << ": " << std::strerror(errno);
+    std::remove(temporary.c_str());
+  }
+  return ok;
+}
+
+int RenderCache::FewerSamples(uint64_t key, int samples) const
+{
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%016llx-", (unsigned long long)key);
+  const size_t prefixLength = std::strlen(prefix);
+
+  DIR* directory = opendir(directory_.c_str());
+  if (!directory)
+    return 0;
+
+  int best = 0;
+  while (dirent* file = readdir(directory))
+  {
+    std::string name = file->d_name;
+    if (name.compare(0, prefixLength, prefix) != 0 || !EndsWith(name, kExtension))
+      continue;
+
+    int stored = std::atoi(name.c_str() + prefixLength);
+    if (stored < samples && stored > best)
+      best = stored;
+  }
+  closedir(directory);
+  return best;
+}
+
+int RenderCache::Evict(const std::string& keep) const
+{
+  struct Stored
+  {
+    std::string path;
+    long long size;
+    long long used;
+  };
+
+  DIR* directory = opendir(directory_.c_str());
+  if (!directory)
+    return 0;
+
+  std::vector<Stored> entries;
+  long long total = 0;
+  while (dirent* file = readdir(directory))
+  {
+    std::string name = file->d_name;
+    struct stat info;
+    std::string path = directory_ + "/" + name;
+
+    // Every writer holds the lock, one left behind was killed writing it
+    if (EndsWith(name, ".tmp"))
+    {
+      if (unlink(path.c_str()) == 0)
+        LOG(WARNING) << "Removed unfinished cache file " << path;
+      continue;
+    }
+
+    if (!EndsWith(name, kExtension) || stat(path.c_str(), &info) != 0)
+      continue;
+
+    // Counts towards the size, but was written for the frame asking
+    total += info.st_size;
+    if (path == keep)
+      continue;
+
+    entries.push_back(Stored{ path, (long long)info.st_size,
+                              (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec });
+  }
+  closedir(directory);
+
+  if (total <= max_bytes_)
+    return 0;
+
+  std::sort(entries.begin(), entries.end(), [](const Stored& a, const Stored& b) { return a.used < b.used; });
+
+  int evicted = 0;
+  for (const Stored& entry : entries)
+  {
+    if (total <= max_bytes_)
+      break;
+    if (unlink(entry.path.c_str()) == 0)
+    {
+      total -= entry.size;
+      ++evicted;
+    }
+  }
+  return evicted;
+}
+
+void RenderCache::Record(const CacheResult& result, int evictions) const
+{
+  DirectoryLock lock(directory_);
+
+  CacheStats totals = stats();
+  ++totals.frames;
+  totals.frame_hits += result.hit;
+  totals.partial_hits += !result.hit && (result.reused > 0 || result.resumed > 0);
+  totals.tiles_reused += result.reused;
+  totals.tiles_resumed += result.resumed;
+  totals.tiles_traced += result.traced;
+  totals.evictions += evictions;
+
+  std::string temporary = directory_ + "/stats." + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream file(temporary);
+    file << "frames " << totals.frames << "\n"
+         << "frame_hits " << totals.frame_hits << "\n"
+         << "partial_hits " << totals.partial_hits << "\n"
+         << "tiles_reused " << totals.tiles_reused << "\n"
+         << "tiles_resumed " << totals.tiles_resumed << "\n"
+         << "tiles_traced " << totals.tiles_traced << "\n"
+         << "evictions " << totals.evictions << "\n";
+  }
+  std::rename(temporary.c_str(), (directory_ + "/stats").c_str());
+}
+
+} // end of namespace raytracer
@@ -0,0 +1,129 @@
+/**
+ *
+ *  filename : render_cache.h
+ *  author   : Do Won Cha
+ *  content  : Disk cache of rendered frames, keyed by what went into them
+ *             instead of by file names.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RENDER_CACHE_
+#define _RAY_RENDER_CACHE_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "ray_tracer.h"
+#include "tile.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// Totals of every render that went through a cache directory
+struct CacheStats
+{
+  long long frames;           // Frames rendered through the cache
+  long long frame_hits;       // Frames that were all in the cache
+  long long partial_hits;     // Frames that found some of their tiles
+  long long tiles_reused;     // Tiles taken as they were stored
+  long long tiles_resumed;    // Tiles carried on from fewer samples
+  long long tiles_traced;     // Tiles traced from scratch
+  long long evictions;        // Entries removed to stay under the size cap
+
+  CacheStats() :
+    frames(0), frame_hits(0), partial_hits(0), tiles_reused(0), tiles_resumed(0),
+    tiles_traced(0), evictions(0)
+  {}
+
+  float frame_hit_rate() const { return frames ? (float)frame_hits / frames : 0.0f; }
+
+  // Resumed tiles count as half a hit, they still trace their extra samples
+  float tile_hit_rate() const
+  {
+    long long tiles = tiles_reused + tiles_resumed + tiles_traced;
+    return tiles ? (tiles_reused + 0.5f * tiles_resumed) / tiles : 0.0f;
+  }
+};
+
+// What one render got out of the cache
+struct CacheResult
+{
+  bool hit;                   // Every tile came from the cache
+  int reused, resumed, traced;
+
+  CacheResult() : hit(false), reused(0), resumed(0), traced(0) {}
+};
+
+/**
+ *  Frames are stored under a hash of the scene contents, the tracer
+ *  settings, camera, resolution and tile size, one entry per sample count
+ *  holding the sums of every tile. A frame asked for again is read back
+ *  instead of traced. Otherwise the tiles a stopped render already
+ *  finished are kept, and an entry with fewer samples of the same frame
+ *  lets every tile carry on from its sums instead of starting over. The
+ *  image is exactly what tracing it from scratch gives.
+ *
+ *  Entries past the size cap are dropped least recently used first.
+ *  Several processes can share a directory.
+ */
+class RenderCache
+{
+public:
+  RenderCache();
+
+  // Create the directory if needed, max_bytes caps the entries on disk
+  bool open(const std::string& directory, long long max_bytes);
+  bool is_open() const { return !directory_.empty(); }
+
+  /**
+   *  Render a width by height frame with the settings of tracer, through
+   *  the cache. scene is the fingerprint of the scene the tracer holds.
+   *  done(index, rgb) gets every tile of MakeTiles(width, height, tile_size)
+   *  like RayTracer::RenderRects does, the cached ones on the calling
+   *  thread before any tracing starts.
+   */
+  FrameStats Render(RayTracer& tracer, uint64_t scene, int width, int height, int tile_size,
+                    const std::function<bool(int index, const float* rgb)>& done,
+                    CacheResult* result = nullptr);
+
+  // Totals over every process that used the directory
+  CacheStats stats() const;
+private:
+  struct Entry
+  {
+    int samples;
+    std::vector<uint8_t> done;    // Per tile
+    std::vector<float> sums;      // RGB sums, tile after tile
+  };
+
+  std::string EntryPath(uint64_t key, int samples) const;
+
+  bool ReadEntry(const std::string& path, uint64_t key, int width, int height, int tile_size,
+                 int tiles, Entry& entry) const;
+  bool WriteEntry(const std::string& path, uint64_t key, int width, int height, int tile_size,
+                  const Entry& entry) const;
+
+  // Most samples below samples any entry of key has, 0 if there is none
+  int FewerSamples(uint64_t key, int samples) const;
+
+  // Drop the least recently used entries other than keep until they fit,
+  // and any temporary files a crashed writer left. Returns how many entries
+  // it dropped
+  int Evict(const std::string& keep) const;
+
+  void Record(const CacheResult& result, int evictions) const;
+private:
+  std::string directory_;
+  long long max_bytes_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RENDER_CACHE_ */
@@ -0,0 +1,509 @@
+/**
+ *
+ *  filename : render_farm.cpp
+ *  author   : Do Won Cha
+ *  content  : Coordinator and worker of a render farm, see render_farm.h
+ *
+ */
+
+#include "render_farm.h"
+
+#include <atomic>
+#include <mutex>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/time.h>
+
+#include "easylogging++.h"
+#include "scene_io.hpp"
+
+namespace raytracer
+{
+
+namespace
+{
+
+// Tiles a worker gets per thread ahead of its results, enough that it never
+// runs dry waiting for the next one
+const int kTilesPerThread = 2;
+
+// A worker that stops halfway through a message for this long is dropped
+const int kReceiveTimeoutSeconds = 30;
+
+// A connection gets this long to say hello, it is read without blocking
+// meanwhile so nobody else waits on it
+const int kHelloTimeoutSeconds = 10;
+const uint32_t kMaxHelloSize = 4096;
+
+// With no worker for this long the coordinator traces what is left itself
+const int kAloneSeconds = 10;
+
+} // end of anonymous namespace
+
+void RenderSettings::write(MessageBuffer& buffer) const
+{
+  buffer.put<int32_t>(width);
+  buffer.put<int32_t>(height);
+  buffer.put<int32_t>(tile_size);
+  buffer.put<int32_t>(sampling);
+  buffer.put<int32_t>(sample_rate);
+  buffer.put<int32_t>(samples_per_pixel);
+  buffer.put<int32_t>(light_samples);
+  buffer.put_bytes(camera.data(), 3 * sizeof(float));
+}
+
+bool RenderSettings::read(MessageBuffer& buffer)
+{
+  int32_t values[7];
+  for (int32_t& value : values)
+  {
+    if (!buffer.get(value))
+      return false;
+  }
+  if (!buffer.get_bytes(camera.data(), 3 * sizeof(float)))
+    return false;
+
+  width = values[0];
+  height = values[1];
+  tile_size = values[2];
+  sampling = values[3];
+  sample_rate = values[4];
+  samples_per_pixel = values[5];
+  light_samples = values[6];
+  return width > 0 && height > 0 && tile_size > 0 && light_samples >= 0;
+}
+
+void RenderSettings::apply(RayTracer& tracer) const
+{
+  tracer.set_sampling_type((PostProcess)sampling);
+  tracer.set_sample_rate(sample_rate);
+  tracer.set_samples_per_pixel(samples_per_pixel);
+  tracer.set_light_samples(light_samples);
+  tracer.set_camera_position(camera);
+}
+
+RenderCoordinator::RenderCoordinator(const std::string& scene_text, const RenderSettings& settings) :
+  scene_text_(scene_text),
+  settings_(settings),
+  tiles_(MakeTiles(settings.width, settings.height, settings.tile_size)),
+  listener_(-1),
+  frame_(0),
+  joined_(0),
+  left_(0)
+{}
+
+RenderCoordinator::~RenderCoordinator()
+{
+  Shutdown();
+}
+
+bool RenderCoordinator::listen(const std::string& address)
+{
+  listener_ = ListenSocket(address);
+  if (address.compare(0, 5, "unix:") == 0)
+    unix_path_ = address.substr(5);
+  return listener_ >= 0;
+}
+
+void RenderCoordinator::Shutdown()
+{
+  for (Worker& worker : workers_)
+  {
+    SendMessage(worker.socket, FarmBye, MessageBuffer());
+    close(worker.socket);
+  }
+  workers_.clear();
+
+  for (Greeting& greeting : greetings_)
+    close(greeting.socket);
+  greetings_.clear();
+
+  if (listener_ >= 0)
+    close(listener_);
+  listener_ = -1;
+
+  if (!unix_path_.empty())
+    unlink(unix_path_.c_str());
+  unix_path_.clear();
+}
+
+void RenderCoordinator::AcceptWorker()
+{
+  int socket = AcceptSocket(listener_);
+  if (socket < 0)
+    return;
+
+  // Results are only read once poll says they are there, the timeouts
+  // catch a worker that hangs halfway through one or stops reading
+  timeval timeout = { kReceiveTimeoutSeconds, 0 };
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  Greeting greeting;
+  greeting.socket = socket;
+  greeting.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(kHelloTimeoutSeconds);
+  greetings_.push_back(greeting);
+}
+
+bool RenderCoordinator::ReadHello(Greeting& greeting)
+{
+  // The header first, then as much of the payload as it says
+  const size_t kHeader = 2 * sizeof(uint32_t);
+  size_t wanted = kHeader;
+  uint32_t header[2] = { 0, 0 };
+  if (greeting.bytes.size() >= kHeader)
+  {
+    std::memcpy(header, greeting.bytes.data(), kHeader);
+    wanted += header[1];
+  }
+
+  uint8_t chunk[512];
+  ssize_t received = recv(greeting.socket, chunk, (std::min)(sizeof(chunk), wanted - greeting.bytes.size()),
+                          MSG_DONTWAIT);
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return true;
+  if (received <= 0)
+    return false;
+  greeting.bytes.insert(greeting.bytes.end(), chunk, chunk + received);
+
+  if (greeting.bytes.size() < kHeader)
+    return true;
+  std::memcpy(header, greeting.bytes.data(), kHeader);
+  if (header[0] != FarmHello || header[1] > kMaxHelloSize)
+    return false;
+  if (greeting.bytes.size() < kHeader + header[1])
+    return true;
+
+  MessageBuffer hello;
+  hello.put_bytes(greeting.bytes.data() + kHeader, header[1]);
+  Worker worker;
+  int32_t threads = 0;
+  worker.socket = greeting.socket;
+  if (!hello.get(threads) || !hello.get_string(worker.name))
+    return false;
+  worker.threads = (std::max)(1, (int)threads);
+
+  // The scene goes out once per worker, tiles after that are a few bytes
+  MessageBuffer setup;
+  settings_.write(setup);
+  setup.put_string(scene_text_);
+  if (!SendMessage(worker.socket, FarmSetup, setup))
+    return false;
+
+  LOG(INFO) << "Worker " << worker.name << " joined with " << worker.threads << " threads";
+  workers_.push_back(worker);
+  ++joined_;
+
+  // Handed over to the worker, the greeting is done with
+  greeting.socket = -1;
+  return true;
+}
+
+bool RenderCoordinator::RenderLocally(std::deque<int>& pending, std::vector<char>& finished, int& remaining,
+                                      std::vector<Vector4f>& frame)
+{
+  if (!local_)
+  {
+    std::istringstream sceneStream(scene_text_);
+    std::unique_ptr<Scene> scene = ReadScene(sceneStream, "farm scene");
+    if (!scene)
+      return false;
+
+    local_.reset(new RayTracer(nullptr, nullptr));
+    local_->initialize(scene);
+    settings_.apply(*local_);
+  }
+
+  LOG(WARNING) << "No workers for " << kAloneSeconds << " s, tracing " << pending.size() << " tiles here";
+
+  std::vector<int> ids(pending.begin(), pending.end());
+  std::vector<Tile> rects;
+  for (int tile : ids)
+    rects.push_back(tiles_[tile]);
+  pending.clear();
+
+  std::atomic<int> stored(0);
+  local_->RenderRects(rects, settings_.width, settings_.height, [&](int index, const float* rgb) {
+    if (!finished[ids[index]])
+    {
+      StoreTile(ids[index], rgb, frame);
+      finished[ids[index]] = 1;
+      ++stored;
+    }
+    return true;
+  });
+  remaining -= stored;
+  return true;
+}
+
+void RenderCoordinator::StoreTile(int tile, const float* rgb, std::vector<Vector4f>& frame) const
+{
+  const Tile& rect = tiles_[tile];
+  const int width = settings_.width;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    for (int x = rect.x0; x < rect.x1; ++x, rgb += 3)
+      frame[(size_t)y * width + x] = Vector4f(rgb[0], rgb[1], rgb[2], 1.0f);
+  }
+}
+
+void RenderCoordinator::DropWorker(size_t index, std::deque<int>& pending)
+{
+  Worker& worker = workers_[index];
+  LOG(INFO) << "Worker " << worker.name << " left, " << worker.in_flight.size() << " tiles handed back";
+
+  for (auto tile = worker.in_flight.rbegin(); tile != worker.in_flight.rend(); ++tile)
+    pending.push_front(*tile);
+
+  close(worker.socket);
+  workers_.erase(workers_.begin() + index);
+  ++left_;
+}
+
+bool RenderCoordinator::RenderFrame(std::vector<Vector4f>& frame)
+{
+  using namespace std::chrono;
+
+  if (listener_ < 0)
+    return false;
+
+  const int width = settings_.width;
+  frame.assign((size_t)width * settings_.height, Vector4f::Zero());
+
+  // Results of an earlier frame still on their way are recognised and dropped
+  ++frame_;
+  for (Worker& worker : workers_)
+    worker.in_flight.clear();
+
+  std::deque<int> pending;
+  for (int t = 0; t < (int)tiles_.size(); ++t)
+    pending.push_back(t);
+  std::vector<char> finished(tiles_.size(), 0);
+  int remaining = (int)tiles_.size();
+
+  MessageBuffer message;
+  std::vector<float> rgb;
+  steady_clock::time_point aloneSince = steady_clock::now();
+
+  while (remaining > 0)
+  {
+    // Top every worker up
+    for (size_t w = workers_.size(); w-- > 0;)
+    {
+      Worker& worker = workers_[w];
+      while ((int)worker.in_flight.size() < worker.threads * kTilesPerThread && !pending.empty())
+      {
+        int tile = pending.front();
+        message.clear();
+        message.put<uint32_t>(frame_);
+        message.put<uint32_t>(tile);
+        if (!SendMessage(worker.socket, FarmTile, message))
+        {
+          DropWorker(w, pending);
+          break;
+        }
+        pending.pop_front();
+        worker.in_flight.push_back(tile);
+      }
+    }
+
+    // Nobody left to hand the rest to, wait a while and then trace it here
+    steady_clock::time_point now = steady_clock::now();
+    if (!workers_.empty() || !greetings_.empty())
+      aloneSince = now;
+    else if (now >= aloneSince + seconds(kAloneSeconds))
+    {
+      if (!RenderLocally(pending, finished, remaining, frame))
+        return false;
+      aloneSince = steady_clock::now();
+      continue;
+    }
+
+    // Wake up for the first greeting to time out, or to stop waiting alone
+    steady_clock::time_point wake = workers_.empty() && greetings_.empty() ?
+                                    aloneSince + seconds(kAloneSeconds) : steady_clock::time_point::max();
+    for (const Greeting& greeting : greetings_)
+      wake = (std::min)(wake, greeting.deadline);
+    int timeout = -1;
+    if (wake != steady_clock::time_point::max())
+      timeout = (int)(std::max)((long long)0, (long long)duration_cast<milliseconds>(wake - now).count() + 1);
+
+    const size_t firstGreeting = 1 + workers_.size();
+    std::vector<pollfd> polls(firstGreeting + greetings_.size());
+    polls[0].fd = listener_;
+    polls[0].events = POLLIN;
+    for (size_t w = 0; w < workers_.size(); ++w)
+    {
+      polls[w + 1].fd = workers_[w].socket;
+      polls[w + 1].events = POLLIN;
+    }
+    for (size_t g = 0; g < greetings_.size(); ++g)
+    {
+      polls[firstGreeting + g].fd = greetings_[g].socket;
+      polls[firstGreeting + g].events = POLLIN;
+    }
+
+    if (poll(polls.data(), polls.size(), timeout) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      LOG(ERROR) << "poll failed: " << std::strerror(errno);
+      return false;
+    }
+
+    // Backwards so dropping a worker keeps the indices of the rest
+    for (size_t w = workers_.size(); w-- > 0;)
+    {
+      if (!(polls[w + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      Worker& worker = workers_[w];
+      uint32_t type = 0, resultFrame = 0, tile = 0;
+      if (!ReceiveMessage(worker.socket, type, message) || type != FarmResult ||
+          !message.get(resultFrame) || !message.get(tile))
+      {
+        DropWorker(w, pending);
+        continue;
+      }
+
+      auto sent = std::find(worker.in_flight.begin(), worker.in_flight.end(), (int)tile);
+      if (resultFrame != frame_ || sent == worker.in_flight.end())
+        continue;
+      worker.in_flight.erase(sent);
+
+      rgb.resize(tiles_[tile].size() * 3);
+      if (!message.get_bytes(rgb.data(), rgb.size() * sizeof(float)))
+      {
+        pending.push_front(tile);
+        DropWorker(w, pending);
+        continue;
+      }
+      if (finished[tile])
+        continue;
+
+      StoreTile(tile, rgb.data(), frame);
+      finished[tile] = 1;
+      --remaining;
+    }
+
+    // Greetings that said hello join, silent or broken ones are dropped
+    now = steady_clock::now();
+    for (size_t g = greetings_.size(); g-- > 0;)
+    {
+      Greeting& greeting = greetings_[g];
+      bool keep = true;
+      if (polls[firstGreeting + g].revents & (POLLIN | POLLHUP | POLLERR))
+        keep = ReadHello(greeting);
+      if (keep && greeting.socket >= 0 && now >= greeting.deadline)
+        keep = false;
+
+      if (!keep)
+      {
+        LOG(WARNING) << "Dropped a connection that did not say hello";
+        close(greeting.socket);
+      }
+      if (!keep || greeting.socket < 0)
+        greetings_.erase(greetings_.begin() + g);
+    }
+
+    if (polls[0].revents & POLLIN)
+      AcceptWorker();
+  }
+
+  return true;
+}
+
+bool RunRenderWorker(const std::string& address, int threads, int* argc, char** argv)
+{
+  int socket = ConnectSocket(address);
+  if (socket < 0)
+    return false;
+
+  char host[256] = "worker";
+  gethostname(host, sizeof(host) - 1);
+
+  MessageBuffer message;
+  message.put<int32_t>(threads > 0 ? threads : (std::max)(1u, std::thread::hardware_concurrency()));
+  message.put_string(std::string(host) + ":" + std::to_string(getpid()));
+
+  uint32_t type = 0;
+  RenderSettings settings;
+  std::string sceneText;
+  if (!SendMessage(socket, FarmHello, message) || !ReceiveMessage(socket, type, message) ||
+      type != FarmSetup || !settings.read(message) || !message.get_string(sceneText))
+  {
+    LOG(ERROR) << "No setup from the coordinator at " << address;
+    close(socket);
+    return false;
+  }
+
+  std::istringstream sceneStream(sceneText);
+  std::unique_ptr<Scene> scene = ReadScene(sceneStream, address);
+  if (!scene)
+  {
+    close(socket);
+    return false;
+  }
+
+  RayTracer tracer(argc, argv);
+  tracer.initialize(scene);
+  tracer.set_thread_count(threads);
+  settings.apply(tracer);
+
+  std::vector<Tile> tiles = MakeTiles(settings.width, settings.height, settings.tile_size);
+  std::mutex sendMutex;
+  bool connected = true, bye = false;
+
+  while (connected && !bye)
+  {
+    // Everything that is already waiting becomes one batch
+    std::vector<uint32_t> frames, batch;
+    do
+    {
+      uint32_t frame = 0, tile = 0;
+      if (!ReceiveMessage(socket, type, message))
+        connected = false;
+      else if (type == FarmBye)
+        bye = true;
+      else if (type == FarmTile && message.get(frame) && message.get(tile) && tile < tiles.size())
+      {
+        frames.push_back(frame);
+        batch.push_back(tile);
+      }
+      else
+      {
+        // Nothing else is ever sent, the stream is out of step or not ours
+        LOG(ERROR) << "Unexpected message " << type << " from " << address << ", disconnecting";
+        connected = false;
+      }
+
+      pollfd waiting = { socket, POLLIN, 0 };
+      if (!connected || bye || poll(&waiting, 1, 0) <= 0)
+        break;
+    } while (true);
+
+    if (bye || !connected)
+      break;
+
+    std::vector<Tile> rects;
+    for (uint32_t tile : batch)
+      rects.push_back(tiles[tile]);
+
+    tracer.RenderRects(rects, settings.width, settings.height, [&](int index, const float* rgb) {
+      MessageBuffer result;
+      result.put<uint32_t>(frames[index]);
+      result.put<uint32_t>(batch[index]);
+      result.put_bytes(rgb, rects[index].size() * 3 * sizeof(float));
+
+      std::lock_guard<std::mutex> lock(sendMutex);
+      connected = connected && SendMessage(socket, FarmResult, result);
+      return connected;
+    });
+  }
+
+  close(socket);
+  return true;
+}
+
+} // end of namespace raytracer
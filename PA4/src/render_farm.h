@@ -0,0 +1,162 @@
+/**
+ *
+ *  filename : render_farm.h
+ *  author   : Do Won Cha
+ *  content  : Renders a frame on worker processes, on this machine or
+ *             others, that connect to a coordinator over sockets.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RENDER_FARM_
+#define _RAY_RENDER_FARM_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "net.hpp"
+#include "ray_tracer.h"
+#include "tile.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  Messages between the coordinator and its workers
+ *
+ *  FarmHello   worker -> coordinator  threads, name
+ *  FarmSetup   coordinator -> worker  RenderSettings, scene file text
+ *  FarmTile    coordinator -> worker  frame, tile
+ *  FarmResult  worker -> coordinator  frame, tile, RGB floats of the tile
+ *  FarmBye     coordinator -> worker  no more work, exit
+ */
+enum FarmMessage
+{
+  FarmHello = 1,
+  FarmSetup,
+  FarmTile,
+  FarmResult,
+  FarmBye
+};
+
+// Everything a worker needs besides the scene to trace the same samples
+struct RenderSettings
+{
+  int width, height, tile_size;
+  int sampling;           // PostProcess
+  int sample_rate;
+  int samples_per_pixel;  // 0 goes by sampling and rate
+  int light_samples;      // 0 shades every light
+  Vector3f camera;
+
+  RenderSettings() :
+    width(512), height(512), tile_size(32), sampling(NoSampling), sample_rate(1),
+    samples_per_pixel(0), light_samples(0), camera(Vector3f::Zero())
+  {}
+
+  void write(MessageBuffer& buffer) const;
+  bool read(MessageBuffer& buffer);
+
+  // Set a tracer up to match, its scene is left alone
+  void apply(RayTracer& tracer) const;
+};
+
+/**
+ *  Hands out tiles to every connected worker and puts their results
+ *  together. Workers can connect at any time, also in the middle of a
+ *  frame, and the tiles of a worker that goes away are handed to the
+ *  others. Every tile is traced to all its samples by one worker, so the
+ *  image is the same no matter how the tiles were spread.
+ */
+class RenderCoordinator
+{
+public:
+  RenderCoordinator(const std::string& scene_text, const RenderSettings& settings);
+
+  // Sends every worker home
+  ~RenderCoordinator();
+
+  RenderCoordinator(const RenderCoordinator&) = delete;
+  RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+
+  bool listen(const std::string& address);
+
+  /**
+   *  Render a frame into frame, width * height top row first. Waits for
+   *  workers while there are none, for kAloneSeconds, then traces the
+   *  tiles left right here. False if the listening socket fails or the
+   *  scene cannot be read for that.
+   */
+  bool RenderFrame(std::vector<Vector4f>& frame);
+
+  // Tell the workers to exit and close every connection
+  void Shutdown();
+
+  int worker_count() const { return (int)workers_.size(); }
+
+  // Workers that joined and left since the coordinator started
+  int workers_joined() const { return joined_; }
+  int workers_left() const { return left_; }
+private:
+  struct Worker
+  {
+    int socket;
+    int threads;
+    std::string name;
+    std::vector<int> in_flight;     // Tiles sent and not answered yet
+  };
+
+  // A connection that has not said hello yet, read as it trickles in
+  struct Greeting
+  {
+    int socket;
+    std::vector<uint8_t> bytes;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  void AcceptWorker();
+
+  // Read what a greeting has sent, a worker joins once its hello is whole.
+  // False if it is to be dropped.
+  bool ReadHello(Greeting& greeting);
+
+  // Trace the pending tiles on this machine, for when no worker is left
+  bool RenderLocally(std::deque<int>& pending, std::vector<char>& finished, int& remaining,
+                     std::vector<Vector4f>& frame);
+
+  // Copy the RGB floats of a finished tile into frame
+  void StoreTile(int tile, const float* rgb, std::vector<Vector4f>& frame) const;
+
+  // Close the connection, its unfinished tiles go back to the front
+  void DropWorker(size_t index, std::deque<int>& pending);
+private:
+  std::string scene_text_;
+  RenderSettings settings_;
+  std::vector<Tile> tiles_;
+
+  int listener_;
+  std::string unix_path_;         // Removed again on shutdown
+  std::vector<Worker> workers_;
+  std::vector<Greeting> greetings_;
+  std::unique_ptr<RayTracer> local_;  // Made the first time there is no worker
+  uint32_t frame_;
+  int joined_, left_;
+};
+
+/**
+ *  Connect to a coordinator and render tiles for it until it says bye or
+ *  the connection drops. Returns false if the connection or setup failed.
+ */
+bool RunRenderWorker(const std::string& address, int threads, int* argc, char** argv);
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RENDER_FARM_ */
@@ -0,0 +1,389 @@
+/**
+ *
+ *  filename : render_service.cpp
+ *  author   : Do Won Cha
+ *  content  : Long running render daemon, see render_service.h
+ *
+ */
+
+#include "render_service.h"
+
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <thread>
+
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "easylogging++.h"
+#include "scene_io.hpp"
+
+namespace raytracer
+{
+
+namespace
+{
+
+// The image has to fit in one message
+const long long kMaxPixels = net_detail::kMaxMessageSize / (3 * sizeof(float));
+
+// How often the accept loop looks at the stop flag
+const int kStopPollMs = 200;
+
+const char* PriorityName(TaskPriority priority)
+{
+  return priority == PriorityHigh ? "high" : priority == PriorityLow ? "low" : "normal";
+}
+
+} // end of anonymous namespace
+
+RenderService::RenderService(int* argc, char** argv, int threads, int cache_size) :
+  argc_(argc),
+  argv_(argv),
+  pool_(std::make_shared<ThreadPool>(threads)),
+  results_(nullptr),
+  cache_size_((std::max)(1, cache_size)),
+  listener_(-1),
+  stop_(false),
+  client_threads_(0),
+  requests_(0),
+  scene_hits_(0)
+{}
+
+RenderService::~RenderService()
+{
+  Stop();
+
+  // Requests in progress notice the stop flag after their current tiles
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  for (int socket : clients_)
+    shutdown(socket, SHUT_RDWR);
+  clients_done_.wait(lock, [this] { return client_threads_ == 0; });
+  lock.unlock();
+
+  if (listener_ >= 0)
+    close(listener_);
+  if (!unix_path_.empty())
+    unlink(unix_path_.c_str());
+}
+
+bool RenderService::listen(const std::string& address)
+{
+  if (!net_detail::IsUnix(address) && scene_root_.empty())
+  {
+    LOG(ERROR) << "Refusing to serve " << address << " over TCP without a scene root";
+    return false;
+  }
+
+  listener_ = ListenSocket(address);
+  if (address.compare(0, 5, "unix:") == 0)
+    unix_path_ = address.substr(5);
+  return listener_ >= 0;
+}
+
+bool RenderService::set_scene_root(const std::string& directory)
+{
+  char resolved[PATH_MAX];
+  struct stat info;
+  if (!realpath(directory.c_str(), resolved) || stat(resolved, &info) != 0 || !S_ISDIR(info.st_mode))
+  {
+    LOG(ERROR) << "No scene root directory " << directory;
+    return false;
+  }
+
+  scene_root_ = resolved;
+  if (scene_root_.back() != '/')
+    scene_root_ += '/';
+  return true;
+}
+
+bool RenderService::ResolveScene(const std::string& path, std::string& resolved) const
+{
+  // Links and .. are followed first, so neither leads out of the root
+  char real[PATH_MAX];
+  if (!realpath(path.c_str(), real))
+    return false;
+
+  resolved = real;
+  return scene_root_.empty() || resolved.compare(0, scene_root_.size(), scene_root_) == 0;
+}
+
+void RenderService::Run()
+{
+  while (!stop_ && listener_ >= 0)
+  {
+    pollfd waiting = { listener_, POLLIN, 0 };
+    int ready = poll(&waiting, 1, kStopPollMs);
+    if (ready < 0 && errno != EINTR)
+    {
+      LOG(ERROR) << "poll failed: " << std::strerror(errno);
+      return;
+    }
+    if (ready <= 0 || !(waiting.revents & POLLIN))
+      continue;
+
+    int socket = AcceptSocket(listener_);
+    if (socket < 0)
+      continue;
+
+    // Connections get a thread each, the tracing happens on the pool
+    {
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      clients_.insert(socket);
+      ++client_threads_;
+    }
+    std::thread([this, socket] {
+      ServeClient(socket);
+
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      clients_.erase(socket);
+      close(socket);
+      if (--client_threads_ == 0)
+        clients_done_.notify_all();
+    }).detach();
+  }
+}
+
+void RenderService::ServeClient(int socket)
+{
+  uint32_t type = 0;
+  MessageBuffer message, reply;
+  std::vector<float> rgb;
+
+  while (!stop_ && ReceiveMessage(socket, type, message))
+  {
+    RenderRequest request;
+    int32_t priority = 0;
+    std::string error;
+    RenderReply result;
+
+    bool ok = false;
+    if (type != ServiceRender || !message.get(priority) || !message.get_string(request.scene) ||
+        !request.settings.read(message))
+      error = "Malformed request";
+    else
+    {
+      request.priority = (TaskPriority)(std::min)((std::max)(priority, (int32_t)PriorityLow), (int32_t)PriorityHigh);
+      ok = Render(request, rgb, result, error);
+    }
+
+    reply.clear();
+    if (ok)
+    {
+      reply.put<float>(result.load_ms);
+      reply.put<float>(result.render_ms);
+      reply.put<uint8_t>(result.cached);
+      reply.put_bytes(rgb.data(), rgb.size() * sizeof(float));
+    }
+    else
+    {
+      LOG(WARNING) << "Refused a request for " << request.scene << ": " << error;
+      reply.put_string(error);
+    }
+
+    if (!SendMessage(socket, ok ? ServiceImage : ServiceError, reply))
+      return;
+  }
+}
+
+bool RenderService::Render(const RenderRequest& request, std::vector<float>& rgb, RenderReply& reply,
+                           std::string& error)
+{
+  using namespace std::chrono;
+
+  const RenderSettings& settings = request.settings;
+  if ((long long)settings.width * settings.height > kMaxPixels || settings.tile_size < 1 ||
+      settings.sampling < NoSampling || settings.sampling > RandomSampling ||
+      settings.sample_rate < 1 || settings.samples_per_pixel < 0 || settings.light_samples < 0)
+  {
+    error = "Unsupported render settings";
+    return false;
+  }
+
+  std::shared_ptr<CachedScene> entry;
+  std::unique_ptr<RayTracer> tracer = Acquire(request.scene, entry, reply, error);
+  if (!tracer)
+    return false;
+
+  ++requests_;
+  if (reply.cached)
+    ++scene_hits_;
+
+  settings.apply(*tracer);
+  tracer->set_priority(request.priority);
+
+  const int width = settings.width;
+  rgb.assign((size_t)width * settings.height * 3, 0.0f);
+  std::vector<Tile> tiles = MakeTiles(width, settings.height, settings.tile_size);
+
+  auto copyTile = [&](int index, const float* pixels) {
+    const Tile& rect = tiles[index];
+    const int rowFloats = (rect.x1 - rect.x0) * 3;
+    for (int y = rect.y0; y < rect.y1; ++y, pixels += rowFloats)
+      std::memcpy(&rgb[((size_t)y * width + rect.x0) * 3], pixels, rowFloats * sizeof(float));
+    return !stop_;
+  };
+
+  steady_clock::time_point start = steady_clock::now();
+  CacheResult cached;
+  if (results_)
+    results_->Render(*tracer, entry->fingerprint, width, settings.height, settings.tile_size, copyTile, &cached);
+  else
+    tracer->RenderRects(tiles, width, settings.height, copyTile);
+  reply.render_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+
+  Release(entry, std::move(tracer));
+
+  LOG(INFO) << request.scene << " " << width << "x" << settings.height << " at "
+            << PriorityName(request.priority) << " priority: "
+            << (reply.cached ? "cached" : "loaded in " + std::to_string(reply.load_ms) + " ms")
+            << ", rendered in " << reply.render_ms << " ms"
+            << (results_ ? ", " + std::to_string(cached.reused) + " tiles from the render cache" : std::string());
+
+  if (stop_)
+  {
+    error = "Service is shutting down";
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<RayTracer> RenderService::Acquire(const std::string& requested,
+                                                  std::shared_ptr<CachedScene>& entry, RenderReply& reply,
+                                                  std::string& error)
+{
+  using namespace std::chrono;
+
+  // The real path from here on, what is checked is what gets loaded
+  std::string path;
+  struct stat info;
+  if (!ResolveScene(requested, path) || stat(path.c_str(), &info) != 0)
+  {
+    error = "No scene file " + requested + (scene_root_.empty() ? "" : " under " + scene_root_);
+    return nullptr;
+  }
+  long long modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+  long long size = info.st_size;
+
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto cached = cache_.begin(); cached != cache_.end(); ++cached)
+    {
+      if ((*cached)->path != path)
+        continue;
+
+      // Edited since it was read, the next load replaces it
+      if ((*cached)->modified != modified || (*cached)->size != size)
+      {
+        cache_.erase(cached);
+        break;
+      }
+
+      cache_.splice(cache_.begin(), cache_, cached);
+      entry = cache_.front();
+      reply.cached = true;
+      if (!entry->idle.empty())
+      {
+        std::unique_ptr<RayTracer> tracer = std::move(entry->idle.back());
+        entry->idle.pop_back();
+        return tracer;
+      }
+      break;
+    }
+  }
+
+  if (!entry)
+  {
+    // Loading runs outside the lock, requests for other scenes go on
+    steady_clock::time_point start = steady_clock::now();
+    std::unique_ptr<Scene> scene = LoadScene(path);
+    if (!scene)
+    {
+      error = "Could not load scene " + path;
+      return nullptr;
+    }
+    scene->build();
+    reply.load_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+
+    entry = std::make_shared<CachedScene>();
+    entry->path = path;
+    entry->modified = modified;
+    entry->size = size;
+    entry->fingerprint = scene->fingerprint();
+    entry->scene = std::move(scene);
+
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    cache_.remove_if([&](const std::shared_ptr<CachedScene>& cached) { return cached->path == path; });
+    cache_.push_front(entry);
+
+    // Requests still rendering an evicted scene keep it alive until they finish
+    while ((int)cache_.size() > cache_size_)
+    {
+      LOG(INFO) << "Evicted " << cache_.back()->path << " from the scene cache";
+      cache_.pop_back();
+    }
+  }
+
+  return MakeTracer(entry->scene);
+}
+
+void RenderService::Release(const std::shared_ptr<CachedScene>& entry, std::unique_ptr<RayTracer> tracer)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if (std::find(cache_.begin(), cache_.end(), entry) != cache_.end())
+    entry->idle.push_back(std::move(tracer));
+}
+
+std::unique_ptr<RayTracer> RenderService::MakeTracer(const std::shared_ptr<Scene>& scene)
+{
+  std::unique_ptr<RayTracer> tracer(new RayTracer(argc_, argv_));
+
+  // Requests are whole frames traced with RenderRects, the progressive
+  // buffers are never used and can stay a single pixel
+  tracer->resize(1, 1);
+  tracer->initialize(scene);
+  tracer->set_thread_pool(pool_);
+  return tracer;
+}
+
+bool RequestRender(int socket, const RenderRequest& request, std::vector<Vector4f>& frame,
+                   RenderReply& reply, std::string& error)
+{
+  MessageBuffer message;
+  message.put<int32_t>(request.priority);
+  message.put_string(request.scene);
+  request.settings.write(message);
+
+  uint32_t type = 0;
+  if (!SendMessage(socket, ServiceRender, message) || !ReceiveMessage(socket, type, message))
+  {
+    error = "Lost the connection to the render service";
+    return false;
+  }
+
+  if (type == ServiceError)
+  {
+    if (!message.get_string(error))
+      error = "Render service refused the request";
+    return false;
+  }
+
+  const size_t pixels = (size_t)request.settings.width * request.settings.height;
+  uint8_t cached = 0;
+  std::vector<float> rgb(pixels * 3);
+  if (type != ServiceImage || !message.get(reply.load_ms) || !message.get(reply.render_ms) ||
+      !message.get(cached) || !message.get_bytes(rgb.data(), rgb.size() * sizeof(float)))
+  {
+    error = "Malformed reply from the render service";
+    return false;
+  }
+  reply.cached = cached != 0;
+
+  frame.resize(pixels);
+  for (size_t i = 0; i < pixels; ++i)
+    frame[i] = Vector4f(rgb[i * 3 + 0], rgb[i * 3 + 1], rgb[i * 3 + 2], 1.0f);
+  return true;
+}
+
+} // end of namespace raytracer
@@ -0,0 +1,167 @@
+/**
+ *
+ *  filename : render_service.h
+ *  author   : Do Won Cha
+ *  content  : Long running render daemon. Keeps loaded scenes and their
+ *             tracers warm between requests that come in over a local
+ *             socket, and renders them all on one shared thread pool.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RENDER_SERVICE_
+#define _RAY_RENDER_SERVICE_
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "net.hpp"
+#include "ray_tracer.h"
+#include "render_cache.h"
+#include "render_farm.h"
+#include "thread_pool.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  Messages between the service and its clients, a connection can send
+ *  any number of requests one after the other
+ *
+ *  ServiceRender  client -> service  priority, scene file path, RenderSettings
+ *  ServiceImage   service -> client  load ms, render ms, cached flag, RGB floats
+ *  ServiceError   service -> client  what went wrong
+ */
+enum ServiceMessage
+{
+  ServiceRender = 1,
+  ServiceImage,
+  ServiceError
+};
+
+struct RenderRequest
+{
+  std::string scene;          // Path of the scene file as the service sees it
+  RenderSettings settings;
+  TaskPriority priority;
+
+  RenderRequest() : priority(PriorityNormal) {}
+};
+
+struct RenderReply
+{
+  float load_ms;              // Reading and building the scene, 0 when cached
+  float render_ms;            // Tracing, including any wait for the pool
+  bool cached;                // The scene was already loaded
+
+  RenderReply() : load_ms(0.0f), render_ms(0.0f), cached(false) {}
+};
+
+/**
+ *  Scenes stay loaded and built, with tracers ready to go, until they are
+ *  the least recently used one past the cache size. A scene whose file
+ *  changed since it was loaded is read again. Every request gets a tracer
+ *  of its own on the shared scene, so any number of them can render one
+ *  scene at the same time, and the pool hands out their tiles by priority.
+ */
+class RenderService
+{
+public:
+  RenderService(int* argc, char** argv, int threads, int cache_size);
+
+  // Waits for the requests in progress
+  ~RenderService();
+
+  RenderService(const RenderService&) = delete;
+  RenderService& operator=(const RenderService&) = delete;
+
+  /**
+   *  Listen on a unix socket or TCP. Anyone who reaches a TCP port can name
+   *  a scene file, so TCP needs a scene root first, false without one.
+   */
+  bool listen(const std::string& address);
+
+  // Only load scene files under directory, false if it does not exist
+  bool set_scene_root(const std::string& directory);
+
+  // Look every request up in a render cache first, it has to outlive us
+  void set_result_cache(RenderCache* cache) { results_ = cache; }
+
+  // Serve until Stop is called, safe to call Stop from a signal handler
+  void Run();
+  void Stop() { stop_ = true; }
+
+  // Requests served and how many of them found their scene loaded
+  long long requests() const { return requests_; }
+  long long scene_hits() const { return scene_hits_; }
+private:
+  struct CachedScene
+  {
+    std::string path;
+    long long modified, size;                         // Of the file when it was read
+    std::shared_ptr<Scene> scene;
+    uint64_t fingerprint;                             // Of the scene contents
+    std::vector<std::unique_ptr<RayTracer>> idle;     // Tracers set up on the scene
+  };
+
+  void ServeClient(int socket);
+
+  // Render one request, false with error set if it could not be
+  bool Render(const RenderRequest& request, std::vector<float>& rgb, RenderReply& reply, std::string& error);
+
+  // A tracer on the scene file requested, loading it if it is not cached or stale
+  std::unique_ptr<RayTracer> Acquire(const std::string& requested, std::shared_ptr<CachedScene>& entry,
+                                     RenderReply& reply, std::string& error);
+
+  // The real path of a requested scene, false if it is not under the root
+  bool ResolveScene(const std::string& path, std::string& resolved) const;
+
+  // Hand the tracer back, dropped if its scene left the cache meanwhile
+  void Release(const std::shared_ptr<CachedScene>& entry, std::unique_ptr<RayTracer> tracer);
+
+  std::unique_ptr<RayTracer> MakeTracer(const std::shared_ptr<Scene>& scene);
+private:
+  int* argc_;
+  char** argv_;
+  std::shared_ptr<ThreadPool> pool_;
+  RenderCache* results_;
+  std::string scene_root_;        // Real path ending in /, empty for anywhere
+
+  std::mutex cache_mutex_;
+  std::list<std::shared_ptr<CachedScene>> cache_;   // Most recently used first
+  int cache_size_;
+
+  int listener_;
+  std::string unix_path_;
+  std::atomic<bool> stop_;
+
+  // Connections being served, shut down to stop their threads
+  std::mutex clients_mutex_;
+  std::condition_variable clients_done_;
+  std::set<int> clients_;
+  int client_threads_;
+
+  std::atomic<long long> requests_, scene_hits_;
+};
+
+/**
+ *  Send request to the service on socket and wait for the image, width *
+ *  height top row first. False if the connection failed or the service
+ *  refused, the reason is in error.
+ */
+bool RequestRender(int socket, const RenderRequest& request, std::vector<Vector4f>& frame,
+                   RenderReply& reply, std::string& error);
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RENDER_SERVICE_ */
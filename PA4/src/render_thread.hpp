@@ -0,0 +1,221 @@
+/**
+ *
+ *  filename : render_thread.hpp
+ *  author   : Do Won Cha
+ *  content  : Runs progressive rendering on a thread of its own and hands
+ *             finished passes to the display through a double buffer.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_RENDER_THREAD_
+#define _RAY_RENDER_THREAD_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "ray_tracer.h"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  The tracer belongs to the render thread while this runs, it calls
+ *  Render over and over until the image converges and then sleeps until
+ *  there is something to change. Every finished pass is copied into the
+ *  back buffer and swapped with the front one, so whoever presents only
+ *  ever sees whole passes and never waits for tracing.
+ *
+ *  Changes to the tracer go through Post and are made between passes.
+ *  Those posted with PostMotion, a camera or light being dragged around,
+ *  show as previews traced at 1/2 or 1/4 of the resolution, whichever
+ *  keeps up with the preview rate, until the motion has stopped for a
+ *  moment. Then the image refines at full resolution as before.
+ */
+class RenderThread
+{
+public:
+  typedef std::function<void(RayTracer& tracer)> Change;
+  typedef std::function<void(const std::vector<Vector4f>& pixels, int width, int height)> Presenter;
+
+  explicit RenderThread(RayTracer& tracer) :
+    tracer_(tracer), width_(0), height_(0), ready_(false), stop_(false), preview_ms_(1000.0f / 30.0f),
+    preview_scale_(2)
+  {
+    thread_ = std::thread([this] { RenderLoop(); });
+  }
+
+  // Finishes the pass in progress first
+  ~RenderThread()
+  {
+    {
+      std::lock_guard<std::mutex> lock(changes_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+
+  RenderThread(const RenderThread&) = delete;
+  RenderThread& operator=(const RenderThread&) = delete;
+
+  // Run change on the render thread before the next pass, in posting order
+  void Post(Change change)
+  {
+    {
+      std::lock_guard<std::mutex> lock(changes_mutex_);
+      changes_.push_back(std::move(change));
+    }
+    wake_.notify_all();
+  }
+
+  /**
+   *  Post change as part of a motion. It should restart accumulation when
+   *  it changes what the samples see, the full resolution image starts
+   *  over once the motion stops.
+   */
+  void PostMotion(Change change)
+  {
+    {
+      std::lock_guard<std::mutex> lock(changes_mutex_);
+      changes_.push_back(std::move(change));
+      moving_until_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(kSettleMs);
+    }
+    wake_.notify_all();
+  }
+
+  // Frames per second previews aim for, 0 keeps full resolution throughout
+  void set_preview_rate(float fps)
+  {
+    std::lock_guard<std::mutex> lock(changes_mutex_);
+    preview_ms_ = fps > 0.0f ? 1000.0f / fps : 0.0f;
+  }
+
+  // Resolution divisor the next preview is traced at, 2 or 4
+  int preview_scale() const { return preview_scale_; }
+
+  // True if a pass finished since the last Present
+  bool frame_ready() const { return ready_; }
+
+  /**
+   *  Hand the newest finished pass to present on the calling thread. The
+   *  render thread only waits for it if it finishes another pass in the
+   *  meantime, keep present to an upload. Nothing happens before the
+   *  first pass is done.
+   */
+  void Present(const Presenter& present)
+  {
+    std::lock_guard<std::mutex> lock(swap_mutex_);
+    ready_ = false;
+    if (!front_.empty())
+      present(front_, width_, height_);
+  }
+private:
+  void RenderLoop()
+  {
+    using namespace std::chrono;
+
+    std::vector<Change> changes;
+    for (;;)
+    {
+      bool moving;
+      float previewMs;
+      {
+        // While moving only more motion is worth waking up for, until it settles
+        std::unique_lock<std::mutex> lock(changes_mutex_);
+        if (steady_clock::now() < moving_until_ && preview_ms_ > 0.0f)
+          wake_.wait_until(lock, moving_until_, [this] { return stop_ || !changes_.empty(); });
+        else
+          wake_.wait(lock, [this] { return stop_ || !changes_.empty() || !tracer_.converged(); });
+        if (stop_)
+          return;
+        changes.swap(changes_);
+        moving = steady_clock::now() < moving_until_ && preview_ms_ > 0.0f;
+        previewMs = preview_ms_;
+      }
+
+      // A change may have updated the image itself, a re-shade does
+      bool changed = !changes.empty();
+      for (Change& change : changes)
+        change(tracer_);
+      changes.clear();
+
+      if (moving)
+      {
+        if (!changed)
+          continue;
+        TracePreview(previewMs);
+      }
+      else
+      {
+        if (!tracer_.converged())
+          tracer_.Render();
+        else if (!changed)
+          continue;
+
+        // Copied outside the lock, the swap itself is a pointer exchange
+        back_ = tracer_.frame_buffer();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(swap_mutex_);
+        front_.swap(back_);
+        width_ = tracer_.camera().screen_width();
+        height_ = tracer_.camera().screen_height();
+      }
+      ready_ = true;
+    }
+  }
+
+  // Trace a preview into the back buffer at the scale that should take
+  // about budget_ms, going by how long the last one took
+  void TracePreview(float budget_ms)
+  {
+    int scale = preview_scale_;
+    float ms = tracer_.RenderPreview(scale, back_).elapsed_ms;
+
+    // Time goes with the pixels traced, a quarter for every halving
+    float fullMs = ms * scale * scale;
+    scale = 2;
+    while (scale < kMaxPreviewScale && fullMs / (scale * scale) > budget_ms)
+      scale *= 2;
+    preview_scale_ = scale;
+  }
+private:
+  // Quiet time after the last motion before full resolution takes over,
+  // and the coarsest previews get
+  enum { kSettleMs = 150, kMaxPreviewScale = 4 };
+
+  RayTracer& tracer_;
+  std::thread thread_;
+
+  // Front is what Present shows, back is filled by the render thread
+  std::vector<Vector4f> front_, back_;
+  int width_, height_;
+  std::mutex swap_mutex_;
+  std::atomic<bool> ready_;
+
+  std::vector<Change> changes_;
+  std::mutex changes_mutex_;
+  std::condition_variable wake_;
+  bool stop_;
+
+  // Motion keeps previews going until then
+  std::chrono::steady_clock::time_point moving_until_;
+  float preview_ms_;
+  std::atomic<int> preview_scale_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_RENDER_THREAD_ */
@@ -14,10 +14,14 @@
 #include <unordered_map>
 #include <list>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "primitives/surface.hpp"
 #include "primitives/light.hpp"
 #include "primitives/material.hpp"
+#include "light_tree.hpp"
+#include "fingerprint.hpp"
 
 namespace raytracer
 {
@@ -49,8 +53,70 @@ public:
     materials_.emplace(material_name, std::move(material));
   }
 
+  // Build the acceleration structures, call after adding or moving objects
+  void build()
+  {
+    light_tree_.build(lights_);
+  }
+
+  const LightTree& light_tree() const { return light_tree_; }
+
+  // The material called name, to edit it, nullptr if there is none
+  Material* material(const std::string& name) const
+  {
+    materials_map_t::const_iterator found = materials_.find(name);
+    return found != materials_.end() ? found->second.get() : nullptr;
+  }
+
+  /**
+   *  Hash of everything in the scene that shows up in an image. Two scenes
+   *  with the same fingerprint render the same, however they were written.
+   */
+  uint64_t fingerprint() const
+  {
+    Fingerprint print;
+
+    // Surfaces and lights in order, it decides ties and light sampling
+    print.add((uint32_t)surfaces_.size());
+    for (const std::unique_ptr<Surface>& surface : surfaces_)
+      surface->fingerprint(print);
+
+    print.add((uint32_t)lights_.size());
+    for (const std::unique_ptr<Light>& light : lights_)
+    {
+      print.add(light->position());
+      print.add(light->ambient_);
+      print.add(light->diffuse_);
+      print.add(light->intensity_);
+      print.add(light->range_);
+    }
+
+    // Materials are looked up by name, their order means nothing
+    std::vector<std::string> names;
+    for (const auto& material : materials_)
+      names.push_back(material.first);
+    std::sort(names.begin(), names.end());
+
+    print.add((uint32_t)names.size());
+    for (const std::string& name : names)
+    {
+      const Material& material = *materials_.at(name);
+      print.add(name);
+      print.add(material.ambient());
+      print.add(material.diffuse());
+      print.add(material.specular());
+      print.add(material.specular_power());
+      print.add(material.reflectivity());
+    }
+
+    return print.value();
+  }
+
+  // Find the closest surface along the ray, closer than hit.tMax
   bool IntersectSurfaces(const Ray& ray, HitData& hit, Surface* ignore = nullptr)
   {
+    bool bHit = false;
+
     // Intersect all surfaces using view ray
     for (const std::unique_ptr<Surface>& surface : surfaces_)
     {
@@ -58,10 +124,36 @@ public:
       if (surface.get() == ignore)
         continue;
 
-      // Surface is hit return true;
-      if (surface->Intersect(ray, hit))
+      // Only accept hits closer than the current closest one
+      HitData candidate;
+      candidate.tMax = hit.tMax;
+      if (surface->Intersect(ray, candidate))
       {
-          return true;
+        hit = candidate;
+        hit.tMax = candidate.t;
+        bHit = true;
+      }
+    }
+
+    return bHit;
+  }
+
+  // Shadow query, true as soon as any surface blocks the ray before tMax.
+  // The blocking surface is written to occluder when one is passed.
+  bool Occluded(const Ray& ray, float tMax, Surface* ignore = nullptr, Surface** occluder = nullptr)
+  {
+    for (const std::unique_ptr<Surface>& surface : surfaces_)
+    {
+      if (surface.get() == ignore)
+        continue;
+
+      HitData candidate;
+      candidate.tMax = tMax;
+      if (surface->Intersect(ray, candidate))
+      {
+        if (occluder)
+          *occluder = surface.get();
+        return true;
       }
     }
 
@@ -71,6 +163,8 @@ private:
   surfaces_list_t surfaces_;
   lights_list_t lights_;
   materials_map_t materials_;
+
+  LightTree light_tree_;
 };
 
 } // end of namespace raytracer
@@ -0,0 +1,131 @@
+/**
+ *
+ *  filename : scene_io.hpp
+ *  author   : Do Won Cha
+ *  content  : Read scenes from a plain text description.
+ *
+ *  One object per line, # starts a comment:
+ *
+ *    material <name> <ambient rgba> <diffuse rgba> <specular rgba> [specular power] [reflectivity]
+ *    sphere   <center xyz> <radius> <material>
+ *    plane    <point xyz> <normal xyz> <material>
+ *    light    <position xyz> [intensity] [range]
+ *
+ */
+
+#pragma once
+#ifndef _RAY_SCENE_IO_
+#define _RAY_SCENE_IO_
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <Eigen/Core>
+
+#include "easylogging++.h"
+#include "scene.hpp"
+#include "primitives/surface_plane.hpp"
+#include "primitives/surface_sphere.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  Parse a scene description from a stream.
+ *  @return the scene, nullptr if any line could not be read
+ */
+inline std::unique_ptr<Scene> ReadScene(std::istream& in, const std::string& name = "scene")
+{
+  std::unique_ptr<Scene> scene = std::make_unique<Scene>();
+
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(in, line))
+  {
+    ++lineNumber;
+
+    // Strip comments and skip blank lines
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string type;
+    if (!(fields >> type))
+      continue;
+
+    bool ok = false;
+    if (type == "material")
+    {
+      std::string material;
+      Vector4f ambient, diffuse, specular;
+      float power = 0.0f, reflectivity = 0.0f;
+      ok = bool(fields >> material
+                       >> ambient(0) >> ambient(1) >> ambient(2) >> ambient(3)
+                       >> diffuse(0) >> diffuse(1) >> diffuse(2) >> diffuse(3)
+                       >> specular(0) >> specular(1) >> specular(2) >> specular(3));
+      if (ok && (fields >> power))
+        fields >> reflectivity;
+
+      if (ok)
+        scene->add_material(std::make_unique<Material>(ambient, diffuse, specular, power, reflectivity), material);
+    }
+    else if (type == "sphere")
+    {
+      Vector3f center;
+      float radius;
+      std::string material;
+      ok = bool(fields >> center(0) >> center(1) >> center(2) >> radius >> material);
+
+      if (ok)
+        scene->add_surface(std::make_unique<Sphere>(center, radius, material));
+    }
+    else if (type == "plane")
+    {
+      Vector3f point, normal;
+      std::string material;
+      ok = bool(fields >> point(0) >> point(1) >> point(2)
+                       >> normal(0) >> normal(1) >> normal(2) >> material);
+
+      if (ok)
+        scene->add_surface(std::make_unique<Plane>(point, normal, material));
+    }
+    else if (type == "light")
+    {
+      Vector3f position;
+      float intensity = 1.0f, range = 0.0f;
+      ok = bool(fields >> position(0) >> position(1) >> position(2));
+      if (ok && (fields >> intensity))
+        fields >> range;
+
+      if (ok)
+        scene->add_light(std::make_unique<Light>(position, Vector3f::Ones(), Vector3f::Ones(), intensity, range));
+    }
+
+    if (!ok)
+    {
+      LOG(ERROR) << name << ":" << lineNumber << ": can't read '" << line << "'";
+      return nullptr;
+    }
+  }
+
+  return scene;
+}
+
+// Load a scene description file, nullptr if it can't be opened or read
+inline std::unique_ptr<Scene> LoadScene(const std::string& filename)
+{
+  std::ifstream in(filename);
+  if (!in)
+  {
+    LOG(ERROR) << "Can't open scene file " << filename;
+    return nullptr;
+  }
+
+  return ReadScene(in, filename);
+}
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_SCENE_IO_ */
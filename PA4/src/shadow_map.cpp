@@ -0,0 +1,120 @@
+/**
+ *
+ *  filename : shadow_map.cpp
+ *  author   : Do Won Cha
+ *  content  : Cube shadow maps, see shadow_map.h
+ *
+ */
+
+#include "shadow_map.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace raytracer
+{
+
+namespace
+{
+
+// Share of its depth a point has to be clear of anything else by, either
+// way, to be told apart from it, and what is put down to rounding. The
+// rasterizer lists surfaces ten times as far past the solid depth.
+const float kDepthSlack = 1e-3f;
+const float kRounding = 1e-4f;
+
+// Shadow rays from further away than this lose too much to float rounding
+// in the intersection tests for the map to say what they find. Within the
+// default tMax, so planes are drawn far enough.
+const float kMaxReach = 100.0f;
+
+} // end of anonymous namespace
+
+bool ShadowMap::Build(const std::vector<Surface*>& surfaces, const Vector3f& position, int size, ThreadPool* pool)
+{
+  const Vector3f axes[3] = { Vector3f::UnitX(), Vector3f::UnitY(), Vector3f::UnitZ() };
+
+  surfaces_ = surfaces;
+  position_ = position;
+  size_ = size;
+  ready_ = false;
+  VisibilityBuffer buffer;
+  for (int face = 0; face < 6; ++face)
+  {
+    // The default camera sees 90 degrees across, a face of the cube
+    int axis = face / 2;
+    Vector3f forward = face % 2 ? Vector3f(-axes[axis]) : axes[axis];
+    faces_[face] = Camera(size, size);
+    faces_[face].set_position(position);
+    faces_[face].look_at(position + forward, axis == 1 ? axes[2] : axes[1]);
+
+    if (!RasterizeVisibility(surfaces, faces_[face], pool, buffer))
+    {
+      for (std::vector<Texel>& texels : texels_)
+        std::vector<Texel>().swap(texels);
+      return false;
+    }
+
+    std::vector<Texel>& texels = texels_[face];
+    texels.resize((size_t)size * size);
+    for (int pixel = 0; pixel < size * size; ++pixel)
+    {
+      Texel& texel = texels[pixel];
+      texel.solid_depth = buffer.solid_depths[pixel];
+      texel.solid_surface = buffer.solid_surfaces[pixel];
+      texel.count = buffer.counts[pixel];
+      std::copy_n(buffer.pixel_candidates(pixel), kMaxCandidates, texel.candidates);
+      std::copy_n(buffer.pixel_candidate_depths(pixel), kMaxCandidates, texel.candidate_depths);
+    }
+  }
+
+  ready_ = true;
+  return true;
+}
+
+ShadowTest ShadowMap::Test(const Vector3f& point, const Surface* ignore, Surface** blocker) const
+{
+  Vector3f toPoint = point - position_;
+  if (!ready_ || toPoint.norm() >= kMaxReach)
+    return ShadowUnknown;
+
+  // The face the point is in front of, and where on it
+  int axis;
+  toPoint.cwiseAbs().maxCoeff(&axis);
+  const int face = axis * 2 + (toPoint[axis] < 0.0f ? 1 : 0);
+  const Vector3f view = faces_[face].ToView(point);
+  if (view.z() <= 0.0f)
+    return ShadowUnknown;
+
+  float x, y;
+  faces_[face].ViewToScreen(view, x, y);
+  const int px = (std::min)((std::max)((int)std::floor(x), 0), size_ - 1);
+  const int py = (std::min)((std::max)((int)std::floor(y), 0), size_ - 1);
+  const int pixel = py * size_ + px;
+
+  // The way to the light runs through this pixel only. The pixel lists
+  // everything that may be in it up to a little past its solid depth, so
+  // all of it if the point is in front of that.
+  const Texel& texel = texels_[face][pixel];
+  const float depth = view.z();
+  if (texel.count >= 0 && depth <= texel.solid_depth * (1.0f + kRounding))
+  {
+    bool clear = true;
+    for (int i = 0; i < texel.count && clear; ++i)
+      clear = surfaces_[texel.candidates[i]] == ignore || texel.candidate_depths[i] > depth * (1.0f + kDepthSlack);
+    if (clear)
+      return ShadowLit;
+  }
+
+  // Every way through the pixel has hit the solid surface before the point
+  const int solid = texel.solid_surface;
+  if (solid >= 0 && surfaces_[solid] != ignore && texel.solid_depth < depth * (1.0f - kDepthSlack))
+  {
+    *blocker = surfaces_[solid];
+    return ShadowBlocked;
+  }
+
+  return ShadowUnknown;
+}
+
+} // end of namespace raytracer
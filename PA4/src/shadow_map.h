@@ -0,0 +1,87 @@
+/**
+ *
+ *  filename : shadow_map.h
+ *  author   : Do Won Cha
+ *  content  : Cube shadow maps drawn with the visibility rasterizer, to
+ *             answer most shadow queries of a point light without tracing.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_SHADOW_MAP_
+#define _RAY_SHADOW_MAP_
+
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "primitives/camera.hpp"
+#include "primitives/surface.hpp"
+#include "rasterizer.h"
+#include "thread_pool.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+// What a shadow map says about the way from a point to its light
+enum ShadowTest
+{
+  ShadowLit,                  // Nothing can be in the way
+  ShadowBlocked,              // Something solid is in the way all around
+  ShadowUnknown               // Close to an edge or too crowded, trace it
+};
+
+/**
+ *  What a point light sees in all six directions, a visibility buffer per
+ *  face of a cube around it. A pixel knows every surface that may be hit
+ *  through it and in front of what depth, and which surface surely is by
+ *  what depth, so a point behind nothing but its own surface is lit and a
+ *  point behind something solid across the whole pixel is in shadow. Only
+ *  points near the edge of a shadow, or close behind something, are left.
+ */
+class ShadowMap
+{
+public:
+  ShadowMap() : size_(0), ready_(false) {}
+
+  /**
+   *  Draw surfaces as seen from position, size by size pixels a face, with
+   *  rows split over pool when there is one. False if any face cannot be
+   *  drawn, every test then comes out ShadowUnknown.
+   */
+  bool Build(const std::vector<Surface*>& surfaces, const Vector3f& position, int size, ThreadPool* pool);
+
+  /**
+   *  What is between point, on surface ignore, and the light. The surfaces
+   *  Scene::Occluded would test are the ones that count. ShadowBlocked sets
+   *  blocker to the surface in the way, it is certain to be hit except by
+   *  a ray that starts within kRayEpsilon of it, test it to be sure.
+   */
+  ShadowTest Test(const Vector3f& point, const Surface* ignore, Surface** blocker) const;
+
+  int size() const { return size_; }
+private:
+  // What Test reads of a pixel of the visibility buffer, kept together so
+  // a query touches one place in memory instead of five arrays
+  struct Texel
+  {
+    float solid_depth;
+    int solid_surface;
+    int count;
+    int candidates[kMaxCandidates];
+    float candidate_depths[kMaxCandidates];
+  };
+
+  std::vector<Surface*> surfaces_;
+  Camera faces_[6];           // +x, -x, +y, -y, +z, -z
+  std::vector<Texel> texels_[6];
+  Vector3f position_;
+  int size_;
+  bool ready_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_SHADOW_MAP_ */
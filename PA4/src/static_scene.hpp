@@ -0,0 +1,410 @@
+/**
+ *
+ *  filename : static_scene.hpp
+ *  author   : Do Won Cha
+ *  content  : Scenes fixed at compile time. Primitives, materials and lights
+ *             are types, and a scene made of them compiles into intersection
+ *             and shading code for exactly those, no containers, no virtual
+ *             calls and every material constant folded in.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_STATIC_SCENE_
+#define _RAY_STATIC_SCENE_
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+
+#include <Eigen/Core>
+
+#include "primitives/ray.hpp"
+#include "primitives/surface_sphere.hpp"
+#include "primitives/surface_plane.hpp"
+#include "scene.hpp"
+
+namespace raytracer
+{
+
+using namespace Eigen;
+
+/**
+ *  Literal stand-ins for Vector3f, constexpr functions can return them and
+ *  the compiler folds whatever reads them. Colors are rgb, the alpha of a
+ *  material never shows up in an image.
+ */
+struct StaticVector
+{
+  float x, y, z;
+};
+
+inline Vector3f ToVector(const StaticVector& v) { return Vector3f(v.x, v.y, v.z); }
+constexpr bool IsZero(const StaticVector& v) { return v.x == 0.0f && v.y == 0.0f && v.z == 0.0f; }
+constexpr float SquaredNorm(const StaticVector& v) { return v.x * v.x + v.y * v.y + v.z * v.z; }
+
+/**
+ *  A material is a struct of constexpr functions, the same numbers as a
+ *  material line of a scene file:
+ *
+ *    struct Red : StaticMaterial
+ *    {
+ *      static constexpr const char* name() { return "red"; }
+ *      static constexpr StaticVector ambient() { return { 0.2f, 0.0f, 0.0f }; }
+ *      static constexpr StaticVector diffuse() { return { 1.0f, 0.0f, 0.0f }; }
+ *    };
+ *
+ *  Whatever it leaves out is black, dull and not reflective.
+ */
+struct StaticMaterial
+{
+  static constexpr StaticVector ambient() { return { 0.0f, 0.0f, 0.0f }; }
+  static constexpr StaticVector diffuse() { return { 0.0f, 0.0f, 0.0f }; }
+  static constexpr StaticVector specular() { return { 0.0f, 0.0f, 0.0f }; }
+  static constexpr float specular_power() { return 0.0f; }
+  static constexpr float reflectivity() { return 0.0f; }
+};
+
+// The runtime Material of a static one, opaque like those of scene files
+template <class M>
+std::unique_ptr<Material> MakeMaterial()
+{
+  auto color = [](const StaticVector& v) { return Vector4f(v.x, v.y, v.z, 1.0f); };
+  return std::make_unique<Material>(color(M::ambient()), color(M::diffuse()), color(M::specular()),
+                                    M::specular_power(), M::reflectivity());
+}
+
+/**
+ *  Primitives derive from StaticSphere or StaticPlane with themselves and
+ *  their material, and give where they are:
+ *
+ *    struct RedSphere : StaticSphere<RedSphere, Red>
+ *    {
+ *      static constexpr StaticVector center() { return { -4.0f, 0.0f, -7.0f }; }
+ *      static constexpr float radius() { return 1.0f; }
+ *    };
+ *
+ *  The tests are those of Sphere and Plane step for step, so both trace the
+ *  same image.
+ */
+template <class Self, class MaterialType>
+struct StaticSphere
+{
+  typedef MaterialType material;
+
+  static bool Intersect(const Ray& ray, float tMax, float& t)
+  {
+    const float radius2 = Self::radius() * Self::radius();
+    Vector3f posray = ToVector(Self::center()) - ray.position();
+    float s = posray.dot(ray.direction());
+    float length2 = posray.squaredNorm();
+    if (s <= 0.0f)
+      return false;
+
+    float m2 = length2 - s * s;
+    if (m2 >= radius2)
+      return false;
+
+    float q = std::sqrt(radius2 - m2);
+    t = (length2 > radius2) ? s - q : s + q;
+    return t > kRayEpsilon && t < tMax;
+  }
+
+  static Vector3f Normal(const Vector3f& point) { return (point - ToVector(Self::center())).normalized(); }
+
+  static std::unique_ptr<Surface> MakeSurface()
+  {
+    return std::make_unique<Sphere>(ToVector(Self::center()), Self::radius(), MaterialType::name());
+  }
+};
+
+// normal() has to be of unit length, it is not normalized at compile time
+template <class Self, class MaterialType>
+struct StaticPlane
+{
+  typedef MaterialType material;
+
+  static bool Intersect(const Ray& ray, float tMax, float& t)
+  {
+    static_assert(SquaredNorm(Self::normal()) > 0.9999f && SquaredNorm(Self::normal()) < 1.0001f,
+                  "StaticPlane normals have to be of unit length");
+    const Vector3f normal = ToVector(Self::normal());
+    float denom = normal.dot(ray.direction());
+    if (std::fabs(denom) <= 1e-6)
+      return false;
+
+    t = normal.dot(ToVector(Self::point()) - ray.position()) / denom;
+    return t > kRayEpsilon && t < tMax;
+  }
+
+  static Vector3f Normal(const Vector3f&) { return ToVector(Self::normal()); }
+
+  static std::unique_ptr<Surface> MakeSurface()
+  {
+    return std::make_unique<Plane>(ToVector(Self::point()), ToVector(Self::normal()), MaterialType::name());
+  }
+};
+
+// Point lights, intensity 1 and lighting the whole scene unless given
+template <class Self>
+struct StaticLight
+{
+  static constexpr float intensity() { return 1.0f; }
+  static constexpr float range() { return 0.0f; }
+
+  // Light::attenuation with the range folded in
+  static float Attenuation(float distance)
+  {
+    if (Self::range() <= 0.0f)
+      return 1.0f;
+
+    float x = distance / Self::range();
+    if (x >= 1.0f)
+      return 0.0f;
+
+    float falloff = 1.0f - x * x;
+    return falloff * falloff;
+  }
+
+  static std::unique_ptr<Light> MakeLight()
+  {
+    return std::make_unique<Light>(ToVector(Self::position()), Vector3f::Ones(), Vector3f::Ones(),
+                                   Self::intensity(), Self::range());
+  }
+};
+
+template <class... Types>
+struct TypeList {};
+
+namespace detail
+{
+
+/**
+ *  Everything over a list of primitives is one step for the first and the
+ *  same again for the rest, the compiler inlines the whole chain. Index is
+ *  where the first one is in the scene.
+ */
+template <int Index, class... Primitives>
+struct EachPrimitive
+{
+  static void Closest(const Ray&, float&, int&) {}
+  static bool Any(const Ray&, float, int) { return false; }
+  static Vector3f Normal(int, const Vector3f&) { return Vector3f::Zero(); }
+  template <class Lights, class SceneType>
+  static float Shade(int, const Ray&, const Vector3f&, const Vector3f&, Vector3f&)
+  {
+    return 0.0f;
+  }
+  static void Add(Scene&) {}
+};
+
+template <int Index, class Primitive, class... Rest>
+struct EachPrimitive<Index, Primitive, Rest...>
+{
+  typedef EachPrimitive<Index + 1, Rest...> Next;
+
+  // Strictly closer hits win, ties go to the earlier primitive like Scene
+  static void Closest(const Ray& ray, float& t, int& hit)
+  {
+    float candidate;
+    if (Primitive::Intersect(ray, t, candidate))
+    {
+      t = candidate;
+      hit = Index;
+    }
+    Next::Closest(ray, t, hit);
+  }
+
+  static bool Any(const Ray& ray, float tMax, int ignore)
+  {
+    float t;
+    if (Index != ignore && Primitive::Intersect(ray, tMax, t))
+      return true;
+    return Next::Any(ray, tMax, ignore);
+  }
+
+  static Vector3f Normal(int primitive, const Vector3f& point)
+  {
+    return primitive == Index ? Primitive::Normal(point) : Next::Normal(primitive, point);
+  }
+
+  // Local color of the hit into out, returns how reflective it is
+  template <class Lights, class SceneType>
+  static float Shade(int primitive, const Ray& ray, const Vector3f& point, const Vector3f& normal, Vector3f& out)
+  {
+    if (primitive != Index)
+      return Next::template Shade<Lights, SceneType>(primitive, ray, point, normal, out);
+
+    typedef typename Primitive::material M;
+    out = ToVector(M::ambient());
+    Lights::template Direct<M, SceneType>(Index, ray, point, normal, out);
+    return M::reflectivity();
+  }
+
+  static void Add(Scene& scene)
+  {
+    typedef typename Primitive::material M;
+    if (!scene.material(M::name()))
+      scene.add_material(MakeMaterial<M>(), M::name());
+    scene.add_surface(Primitive::MakeSurface());
+    Next::Add(scene);
+  }
+};
+
+template <class... Lights>
+struct EachLight
+{
+  template <class M, class SceneType>
+  static void Direct(int, const Ray&, const Vector3f&, const Vector3f&, Vector3f&) {}
+  static void Add(Scene&) {}
+};
+
+template <class Light, class... Rest>
+struct EachLight<Light, Rest...>
+{
+  // Lights add up in the order they are listed, like in LocalShading
+  template <class M, class SceneType>
+  static void Direct(int primitive, const Ray& ray, const Vector3f& point, const Vector3f& normal, Vector3f& out)
+  {
+    out += One<M, SceneType>(primitive, ray, point, normal);
+    EachLight<Rest...>::template Direct<M, SceneType>(primitive, ray, point, normal, out);
+  }
+
+  // RayTracer::DirectLighting for one material and light, the terms its
+  // material has no color for are left out
+  template <class M, class SceneType>
+  static Vector3f One(int primitive, const Ray& ray, const Vector3f& point, const Vector3f& normal)
+  {
+    using namespace std;
+
+    Vector3f hitToLight = ToVector(Light::position()) - point;
+    float lightDistance = hitToLight.norm();
+    float attenuation = Light::Attenuation(lightDistance);
+    if (attenuation <= 0.0f)
+      return Vector3f::Zero();
+
+    Ray shadowray(point, hitToLight / lightDistance);
+    if (SceneType::Occluded(shadowray, lightDistance, primitive))
+      return Vector3f::Zero();
+
+    float intensity = Light::intensity() * attenuation;
+    Vector3f Ldiff = Vector3f::Zero(), Lspec = Vector3f::Zero();
+    if (!IsZero(M::diffuse()))
+    {
+      float ndotl = normal.dot(shadowray.direction());
+      Ldiff = ToVector(M::diffuse()) * intensity * max(0.0f, ndotl);
+    }
+    if (!IsZero(M::specular()))
+    {
+      Vector3f halfdir = (shadowray.direction() - ray.direction()).normalized();
+      float ndoth = normal.dot(halfdir);
+      Lspec = ToVector(M::specular()) * intensity * pow(max(0.0f, ndoth), M::specular_power());
+    }
+
+    return Ldiff + Lspec;
+  }
+
+  static void Add(Scene& scene)
+  {
+    scene.add_light(Light::MakeLight());
+    EachLight<Rest...>::Add(scene);
+  }
+};
+
+} // end of namespace detail
+
+/**
+ *  A scene fixed at compile time, TypeLists of primitives and lights:
+ *
+ *    typedef StaticScene<TypeList<RedSphere, GreenSphere, BlueSphere, Floor>,
+ *                        TypeList<KeyLight>> Spheres;
+ *
+ *  Trace follows RayTracer::Trace without the caches, the shadow maps and
+ *  light sampling, so with the same settings it draws the image of the
+ *  Scene from MakeScene, a good deal faster.
+ */
+template <class Primitives, class Lights>
+class StaticScene;
+
+template <class... Primitives, class... Lights>
+class StaticScene<TypeList<Primitives...>, TypeList<Lights...>>
+{
+  typedef detail::EachPrimitive<0, Primitives...> PrimitiveSteps;
+  typedef detail::EachLight<Lights...> LightSteps;
+public:
+  static const int kPrimitives = sizeof...(Primitives);
+  static const int kLights = sizeof...(Lights);
+
+  // Index of the closest primitive along the ray before tMax, -1 for none
+  static int Intersect(const Ray& ray, float& t, float tMax = HitData().tMax)
+  {
+    int hit = -1;
+    t = tMax;
+    PrimitiveSteps::Closest(ray, t, hit);
+    return hit;
+  }
+
+  // Anything but primitive ignore in the way before tMax
+  static bool Occluded(const Ray& ray, float tMax, int ignore = -1)
+  {
+    return PrimitiveSteps::Any(ray, tMax, ignore);
+  }
+
+  /**
+   *  Color seen along ray with reflections up to maxDepth bounces. Paths
+   *  whose weight drops below minThroughput are cut, as RayTracer does
+   *  without russian roulette.
+   */
+  static Vector3f Trace(const Ray& ray, int maxDepth = 2, float minThroughput = 0.01f)
+  {
+    Vector3f color = Vector3f::Zero();
+    float throughput = 1.0f;
+    Ray current = ray;
+
+    for (int depth = 0; depth <= maxDepth; ++depth)
+    {
+      float t;
+      int primitive = Intersect(current, t);
+      if (primitive < 0)
+        break;
+
+      Vector3f point = current.evaluate(t);
+      Vector3f normal = PrimitiveSteps::Normal(primitive, point);
+
+      Vector3f local;
+      float reflectionCoef =
+        PrimitiveSteps::template Shade<LightSteps, StaticScene>(primitive, current, point, normal, local);
+      if (reflectionCoef <= 0.0f)
+      {
+        color += local * throughput;
+        break;
+      }
+
+      color += local * (throughput * (1.0f - reflectionCoef));
+      throughput *= reflectionCoef;
+      if (depth == maxDepth || throughput < minThroughput)
+        break;
+
+      Vector3f incident = -current.direction();
+      Vector3f dir = incident - normal * (2.0f * normal.dot(incident));
+      current = Ray(point, dir.normalized());
+    }
+
+    return color;
+  }
+
+  // The same scene with the runtime containers, to render it the usual way
+  static std::unique_ptr<Scene> MakeScene()
+  {
+    std::unique_ptr<Scene> scene = std::make_unique<Scene>();
+    PrimitiveSteps::Add(*scene);
+    LightSteps::Add(*scene);
+    scene->build();
+    return scene;
+  }
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_STATIC_SCENE_ */
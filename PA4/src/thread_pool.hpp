@@ -0,0 +1,279 @@
+/**
+ *
+ *  filename : thread_pool.hpp
+ *  author   : Do Won Cha
+ *  content  : Fixed set of worker threads that run queued tasks.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_THREAD_POOL_
+#define _RAY_THREAD_POOL_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace raytracer
+{
+
+// ParallelFor calls nested this deep inside each other get slots of their own
+const int kMaxNesting = 4;
+
+// Work of a higher class always goes ahead of anything lower still waiting
+enum TaskPriority
+{
+  PriorityLow,          // Batch jobs that can wait
+  PriorityNormal,
+  PriorityHigh          // Someone is looking at the result
+};
+
+/**
+ *  Several callers can share one pool. Their work is handed out an index
+ *  at a time, highest priority first and first come first served within a
+ *  class, so a high priority frame overtakes a long low priority one as
+ *  soon as the tiles in progress are done.
+ */
+class ThreadPool
+{
+public:
+  // 0 threads picks one per hardware thread
+  explicit ThreadPool(int threads = 0) :
+    stop_(false)
+  {
+    if (threads <= 0)
+      threads = (std::max)(1u, std::thread::hardware_concurrency());
+
+    worker_ids_.resize(threads);
+    for (int i = 0; i < threads; ++i)
+      workers_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (std::thread& worker : workers_)
+      worker.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const { return (int)workers_.size(); }
+
+  // How many slots ParallelFor hands out, size() for each level of nesting
+  int slots() const { return size() * kMaxNesting; }
+
+  // Queue a task, runs on whichever worker is free first
+  void Submit(std::function<void()> task, TaskPriority priority = PriorityNormal)
+  {
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->body = [task](int, int) { task(); return true; };
+    job->count = 1;
+    Queue(job, priority);
+  }
+
+  /**
+   *  Run body(index, slot) for every index in [0, count) and wait for all of
+   *  them. slot is in [0, slots()) and no two calls running at the same
+   *  time share one, so it can index per thread scratch data.
+   *  body returns false to stop handing out the remaining indices.
+   *
+   *  Called from inside a task of this pool the caller works on its own
+   *  indices while it waits, nesting never runs out of threads. It does
+   *  so in a slot of the next level, the body it was called from keeps
+   *  its scratch data. Past kMaxNesting levels the caller only waits.
+   */
+  void ParallelFor(int count, const std::function<bool(int index, int slot)>& body,
+                   TaskPriority priority = PriorityNormal)
+  {
+    if (count <= 0)
+      return;
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->body = body;
+    job->count = count;
+    Queue(job, priority);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    int slot = WorkerSlot();
+    int& depth = NestingDepth();
+    if (slot >= 0 && depth + 1 < kMaxNesting)
+    {
+      ++depth;
+      while (job->next < job->count && !job->stopped)
+        RunIndex(job, depth * size() + slot, lock);
+      --depth;
+    }
+    job_done_.wait(lock, [&] { return job->finished(); });
+  }
+  /**
+   *  ParallelFor that returns right away. finished runs once the last index
+   *  handed out is done, on the worker that did it, or right here if there
+   *  is nothing to do.
+   */
+  void ParallelForAsync(int count, const std::function<bool(int index, int slot)>& body,
+                        std::function<void()> finished, TaskPriority priority = PriorityNormal)
+  {
+    if (count <= 0)
+    {
+      if (finished)
+        finished();
+      return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->body = body;
+    job->count = count;
+    job->on_finished = std::move(finished);
+    Queue(job, priority);
+  }
+private:
+  struct Job
+  {
+    std::function<bool(int, int)> body;
+    std::function<void()> on_finished;
+    int count = 0;
+    int next = 0;           // First index not handed out
+    int running = 0;        // Indices being worked on
+    bool stopped = false;   // A body returned false
+    int priority = 0;
+
+    bool finished() const { return running == 0 && (stopped || next >= count); }
+  };
+
+  void Queue(const std::shared_ptr<Job>& job, TaskPriority priority)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job->priority = priority;
+
+      // Kept sorted, the front is always the job to work on next
+      auto position = std::find_if(jobs_.begin(), jobs_.end(), [&](const std::shared_ptr<Job>& queued) {
+        return queued->priority < job->priority;
+      });
+      jobs_.insert(position, job);
+    }
+    wake_.notify_all();
+  }
+
+  // Hand out the next index of job and run it, lock is held around the call
+  void RunIndex(const std::shared_ptr<Job>& job, int slot, std::unique_lock<std::mutex>& lock)
+  {
+    int index = job->next++;
+    ++job->running;
+    if (job->next >= job->count)
+      Unqueue(job);
+    lock.unlock();
+
+    bool carryOn = job->body(index, slot);
+
+    lock.lock();
+    --job->running;
+    if (!carryOn && !job->stopped)
+    {
+      job->stopped = true;
+      Unqueue(job);
+    }
+    if (job->finished())
+    {
+      job_done_.notify_all();
+
+      // Taken out first, it runs exactly once
+      std::function<void()> finished;
+      finished.swap(job->on_finished);
+      if (finished)
+      {
+        lock.unlock();
+        finished();
+        lock.lock();
+      }
+    }
+  }
+
+  void Unqueue(const std::shared_ptr<Job>& job)
+  {
+    auto position = std::find(jobs_.begin(), jobs_.end(), job);
+    if (position != jobs_.end())
+      jobs_.erase(position);
+  }
+
+  // Levels of ParallelFor the calling thread is working inside of, 0 on a
+  // worker running queued work
+  static int& NestingDepth()
+  {
+    static thread_local int depth = 0;
+    return depth;
+  }
+
+  // Slot of the calling thread if it is one of ours, -1 otherwise
+  int WorkerSlot() const
+  {
+    for (int i = 0; i < (int)worker_ids_.size(); ++i)
+    {
+      if (worker_ids_[i] == std::this_thread::get_id())
+        return i;
+    }
+    return -1;
+  }
+
+  void WorkerLoop(int slot)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    worker_ids_[slot] = std::this_thread::get_id();
+
+    for (;;)
+    {
+      wake_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+
+      // Hold on to it, the job may leave the queue and its caller meanwhile
+      std::shared_ptr<Job> job = jobs_.front();
+      RunIndex(job, slot, lock);
+    }
+  }
+private:
+  std::vector<std::thread> workers_;
+  std::vector<std::thread::id> worker_ids_;   // Indexed by slot
+
+  std::vector<std::shared_ptr<Job>> jobs_;    // Jobs with indices left, by priority
+
+  std::mutex mutex_;
+  std::condition_variable wake_, job_done_;
+  bool stop_;
+};
+
+/**
+ *  Run body(first, last) for every strip of rows rows of an image height
+ *  rows high, last one past the end, on pool when there is one and right
+ *  here otherwise.
+ */
+inline void ForEachStrip(int height, int rows, ThreadPool* pool,
+                         const std::function<void(int first, int last)>& body)
+{
+  int strips = (height + rows - 1) / rows;
+  auto strip = [&](int s) { body(s * rows, (std::min)(height, (s + 1) * rows)); };
+  if (pool && strips > 1)
+  {
+    pool->ParallelFor(strips, [&](int s, int) { strip(s); return true; });
+    return;
+  }
+
+  for (int s = 0; s < strips; ++s)
+    strip(s);
+}
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_THREAD_POOL_ */
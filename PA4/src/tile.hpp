@@ -0,0 +1,48 @@
+/**
+ *
+ *  filename : tile.hpp
+ *  author   : Do Won Cha
+ *  content  : Rectangular block of pixels, the unit of work for the tracer.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_TILE_
+#define _RAY_TILE_
+
+#include <algorithm>
+#include <vector>
+
+namespace raytracer
+{
+
+// Pixels [x0, x1) x [y0, y1)
+struct Tile
+{
+  int x0, y0, x1, y1;
+
+  int width()  const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+  int size()   const { return width() * height(); }
+};
+
+// Split the screen into tiles in scanline order, edge tiles are clipped
+inline std::vector<Tile> MakeTiles(int width, int height, int tile_size)
+{
+  std::vector<Tile> tiles;
+  tiles.reserve(((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size));
+
+  for (int y = 0; y < height; y += tile_size)
+  {
+    for (int x = 0; x < width; x += tile_size)
+    {
+      tiles.push_back(Tile{ x, y, (std::min)(x + tile_size, width), (std::min)(y + tile_size, height) });
+    }
+  }
+
+  return tiles;
+}
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_TILE_ */
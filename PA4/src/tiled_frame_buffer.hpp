@@ -0,0 +1,160 @@
+/**
+ *
+ *  filename : tiled_frame_buffer.hpp
+ *  author   : Do Won Cha
+ *  content  : Frame buffer kept in a memory mapped file, for images too big
+ *             to hold in memory.
+ *
+ */
+
+#pragma once
+#ifndef _RAY_TILED_FRAME_BUFFER_
+#define _RAY_TILED_FRAME_BUFFER_
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "easylogging++.h"
+#include "tile.hpp"
+
+namespace raytracer
+{
+
+/**
+ *  RGB floats stored tile by tile, so a finished tile is one contiguous
+ *  range of the file. Tiles are in scanline order, which makes each row of
+ *  tiles (a band) contiguous too. Once a band has been streamed out its
+ *  pages can be released, the data stays in the file and the page cache
+ *  takes care of the rest.
+ */
+class TiledFrameBuffer
+{
+public:
+  TiledFrameBuffer() :
+    width_(0), height_(0), tile_size_(0), file_(-1), data_(nullptr), bytes_(0)
+  {}
+
+  ~TiledFrameBuffer() { close(); }
+
+  TiledFrameBuffer(const TiledFrameBuffer&) = delete;
+  TiledFrameBuffer& operator=(const TiledFrameBuffer&) = delete;
+
+  // Create or overwrite the file and map it
+  bool open(const std::string& filename, int width, int height, int tile_size)
+  {
+    close();
+
+    width_ = width;
+    height_ = height;
+    tile_size_ = tile_size;
+    tiles_ = MakeTiles(width, height, tile_size);
+
+    offsets_.resize(tiles_.size() + 1);
+    offsets_[0] = 0;
+    for (size_t t = 0; t < tiles_.size(); ++t)
+      offsets_[t + 1] = offsets_[t] + (size_t)tiles_[t].size() * 3;
+    bytes_ = offsets_.back() * sizeof(float);
+
+    file_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_ < 0)
+    {
+      LOG(ERROR) << "Could not open frame buffer " << filename << ": " << std::strerror(errno);
+      return false;
+    }
+
+    // Sparse file, blocks only get allocated for tiles that are written
+    if (ftruncate(file_, bytes_) != 0)
+    {
+      LOG(ERROR) << "Could not size frame buffer " << filename << ": " << std::strerror(errno);
+      close();
+      return false;
+    }
+
+    void* memory = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+    if (memory == MAP_FAILED)
+    {
+      LOG(ERROR) << "Could not map frame buffer " << filename << ": " << std::strerror(errno);
+      close();
+      return false;
+    }
+    data_ = static_cast<float*>(memory);
+
+    return true;
+  }
+
+  void close()
+  {
+    if (data_)
+      munmap(data_, bytes_);
+    if (file_ >= 0)
+      ::close(file_);
+
+    data_ = nullptr;
+    file_ = -1;
+  }
+
+  bool is_open() const { return data_ != nullptr; }
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int tile_size() const { return tile_size_; }
+  const std::vector<Tile>& tiles() const { return tiles_; }
+
+  // Rows of tiles, a band is tile_size rows of the image
+  int bands() const { return (height_ + tile_size_ - 1) / tile_size_; }
+  int tiles_per_band() const { return (width_ + tile_size_ - 1) / tile_size_; }
+
+  // RGB floats of tiles()[t], rows of the tile one after another
+  float* tile(int t) { return data_ + offsets_[t]; }
+  const float* tile(int t) const { return data_ + offsets_[t]; }
+
+  // Copy a band out as plain top to bottom scanlines of RGB floats
+  void ReadBand(int band, std::vector<float>& rows) const
+  {
+    int first = band * tiles_per_band();
+    int last = first + tiles_per_band();
+    int y0 = tiles_[first].y0;
+    rows.resize((size_t)tiles_[first].height() * width_ * 3);
+
+    for (int t = first; t < last; ++t)
+    {
+      const Tile& rect = tiles_[t];
+      const float* source = tile(t);
+      for (int y = rect.y0; y < rect.y1; ++y, source += rect.width() * 3)
+        std::memcpy(&rows[((size_t)(y - y0) * width_ + rect.x0) * 3], source, rect.width() * 3 * sizeof(float));
+    }
+  }
+
+  // Drop the band's pages from this process, keeps the resident set down
+  // to the bands still being worked on
+  void ReleaseBand(int band)
+  {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = offsets_[band * tiles_per_band()] * sizeof(float);
+    size_t end = offsets_[(band + 1) * tiles_per_band()] * sizeof(float);
+
+    // Only whole pages, the ones shared with a neighbouring band stay
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    if (end > begin)
+      madvise((char*)data_ + begin, end - begin, MADV_DONTNEED);
+  }
+private:
+  int width_, height_, tile_size_;
+  std::vector<Tile> tiles_;
+  std::vector<size_t> offsets_;   // Float offset of every tile, and the total
+
+  int file_;
+  float* data_;
+  size_t bytes_;
+};
+
+} // end of namespace raytracer
+
+#endif /* end of include guard: _RAY_TILED_FRAME_BUFFER_ */
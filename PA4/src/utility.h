@@ -15,7 +15,8 @@
 #elif __unix__ || __APPLE__
 #endif
 
-//#include <cstdint>
+#include <cstdint>
+#include <cmath>
 #include <algorithm>
 
 namespace Utility
@@ -52,6 +53,32 @@ inline uint8_t floatToByte(float i)
   return (uint8_t)(isx & 0xff);
 }
 
+// Integer hash with good avalanche, used to seed per sample random numbers
+inline uint32_t hash(uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+// Seed for everything random about one sample of one pixel
+inline uint32_t sample_seed(uint32_t x, uint32_t y, uint32_t sample)
+{
+  return hash(x ^ hash(y ^ hash(sample)));
+}
+
+// Random number in [0, 1) that only depends on the seed and which dimension
+// of the sample is asked for. Same inputs give the same number, so a sample
+// can be traced again later and land on the same offsets.
+inline float random_unit(uint32_t seed, uint32_t dimension)
+{
+  uint32_t h = hash(seed ^ hash(dimension));
+  return (h >> 8) * (1.0f / 16777216.0f);
+}
+
 }   // end of namespace Util
 
 #endif // end of header guard _RAY_UTIL_